@@ -0,0 +1,238 @@
+#include "MakeSyntheticNtuple.h"
+
+/**
+ *  Makes a synthetic ntuple in the format ValidationParser expects, so we have
+ *  something of a known size to benchmark against. Every branch prefix type is
+ *  represented, and the calorimeter hits use real geometry ID strings.
+ */
+int main(int argc, char **argv)
+{
+  string outputFileName="synthetic_validation.root";
+  SyntheticConfig config;
+
+  static struct option longOptions[] =
+  {
+    {"help",         no_argument,       0, 'h'},
+    {"output",       required_argument, 0, 'o'},
+    {"entries",      required_argument, 0, 'n'},
+    {"seed",         required_argument, 0, 's'},
+    {"h-branches",   required_argument, 0, 'H'},
+    {"t-branches",   required_argument, 0, 'T'},
+    {"tm-branches",  required_argument, 0, 'M'},
+    {"c-branches",   required_argument, 0, 'C'},
+    {"cm-branches",  required_argument, 0, 'A'},
+    {"tracker-hits", required_argument, 0, 'k'},
+    {"calo-hits",    required_argument, 0, 'l'},
+    {"shift",        required_argument, 0, 'd'},
+    {0, 0, 0, 0}
+  };
+  int flag=0;
+  try
+  {
+    while ((flag = getopt_long (argc, argv, "ho:n:s:H:T:M:C:A:k:l:d:", longOptions, 0)) != -1)
+    {
+      switch (flag)
+      {
+        case 'o':
+          outputFileName = optarg;
+          break;
+        case 'n':
+          config.entries = std::stoll(optarg);
+          break;
+        case 's':
+          config.seed = std::stoul(optarg);
+          break;
+        case 'H':
+          config.nHistogram = std::stoi(optarg);
+          break;
+        case 'T':
+          config.nTrackerMap = std::stoi(optarg);
+          break;
+        case 'M':
+          config.nTrackerAverage = std::stoi(optarg);
+          break;
+        case 'C':
+          config.nCaloMap = std::stoi(optarg);
+          break;
+        case 'A':
+          config.nCaloAverage = std::stoi(optarg);
+          break;
+        case 'k':
+          config.meanTrackerHits = std::stod(optarg);
+          break;
+        case 'l':
+          config.meanCaloHits = std::stod(optarg);
+          break;
+        case 'd':
+          config.shift = std::stod(optarg);
+          break;
+        case 'h':
+        default:
+          PrintSyntheticUsage(argv[0]);
+          return 1;
+      }
+    }
+  }
+  catch (exception &e)
+  {
+    cout<<"ERROR: could not read the value given for option -"<<(char)flag<<endl;
+    PrintSyntheticUsage(argv[0]);
+    return 1;
+  }
+
+  if (config.nTrackerAverage > 0 && config.nTrackerMap < 1)
+  {
+    cout<<"ERROR: tm_ branches need at least one t_ branch to hold their locations"<<endl;
+    return 1;
+  }
+  if (config.nCaloAverage > 0 && config.nCaloMap < 1)
+  {
+    cout<<"ERROR: cm_ branches need at least one c_ branch to hold their locations"<<endl;
+    return 1;
+  }
+
+  return MakeSyntheticNtuple(outputFileName, config) ? 0 : 1;
+}
+
+void PrintSyntheticUsage(const char *progName)
+{
+  cout<<"Usage: "<<progName<<" -o <output ROOT file> [options]"<<endl;
+  cout<<"  -n, --entries <N>        number of events (default 10000)"<<endl;
+  cout<<"  -s, --seed <N>           random seed (default 1)"<<endl;
+  cout<<"  --h-branches <N>         number of h_ branches (default 6)"<<endl;
+  cout<<"  --t-branches <N>         number of t_ branches (default 2)"<<endl;
+  cout<<"  --tm-branches <N>        number of tm_ branches (default 2)"<<endl;
+  cout<<"  --c-branches <N>         number of c_ branches (default 2)"<<endl;
+  cout<<"  --cm-branches <N>        number of cm_ branches (default 2)"<<endl;
+  cout<<"  --tracker-hits <x>       mean number of tracker hits per event (default 40)"<<endl;
+  cout<<"  --calo-hits <x>          mean number of calorimeter hits per event (default 3)"<<endl;
+  cout<<"  --shift <x>              fractional shift applied to the generated values, to make a reference that differs a little (default 0)"<<endl;
+}
+
+/**
+ *  Write the synthetic tree. Returns false if the output file can't be made
+ */
+bool MakeSyntheticNtuple(string outputFileName, SyntheticConfig config)
+{
+  TFile *outputFile = new TFile(outputFileName.c_str(),"RECREATE");
+  if (outputFile->IsZombie())
+  {
+    cout<<"Error: could not create "<<outputFileName<<endl;
+    return false;
+  }
+  TTree *outTree = new TTree(treeName.c_str(),treeName.c_str());
+  TRandom3 random(config.seed);
+
+  // Simple histogram branches: alternate between doubles (like an energy) and ints (like a count)
+  vector<double> doubleValues(config.nHistogram,0);
+  vector<int> intValues(config.nHistogram,0);
+  for (int i=0;i<config.nHistogram;i++)
+  {
+    if (i%2==0) outTree->Branch(Form("h_synthetic_energy_%d",i), &doubleValues.at(i), Form("h_synthetic_energy_%d/D",i));
+    else outTree->Branch(Form("h_synthetic_count_%d",i), &intValues.at(i), Form("h_synthetic_count_%d/I",i));
+  }
+
+  // Tracker maps and the averages that go with them. Each tm_ branch is paired with a t_ branch
+  vector< vector<int> > trackerMaps(config.nTrackerMap);
+  vector< vector<double> > trackerAverages(config.nTrackerAverage);
+  for (int i=0;i<config.nTrackerMap;i++)
+  {
+    outTree->Branch(Form("t_synthetic_cells_%d",i), &trackerMaps.at(i));
+  }
+  for (int i=0;i<config.nTrackerAverage;i++)
+  {
+    outTree->Branch(Form("tm_synthetic_radius_%d.t_synthetic_cells_%d",i,i%config.nTrackerMap), &trackerAverages.at(i));
+  }
+
+  // Calorimeter maps and averages, the same way
+  vector< vector<string> > caloMaps(config.nCaloMap);
+  vector< vector<double> > caloAverages(config.nCaloAverage);
+  for (int i=0;i<config.nCaloMap;i++)
+  {
+    outTree->Branch(Form("c_synthetic_blocks_%d",i), &caloMaps.at(i));
+  }
+  for (int i=0;i<config.nCaloAverage;i++)
+  {
+    outTree->Branch(Form("cm_synthetic_energy_%d.c_synthetic_blocks_%d",i,i%config.nCaloMap), &caloAverages.at(i));
+  }
+
+  double scale = 1. + config.shift;
+  for (Long64_t iEntry=0; iEntry<config.entries; iEntry++)
+  {
+    for (int i=0;i<config.nHistogram;i++)
+    {
+      if (i%2==0) doubleValues.at(i) = TMath::Abs(random.Gaus(2. * scale, 0.5));
+      else intValues.at(i) = random.Poisson(3. * scale);
+    }
+
+    for (int i=0;i<config.nTrackerMap;i++)
+    {
+      trackerMaps.at(i).clear();
+      int nHits = random.Poisson(config.meanTrackerHits);
+      for (int hit=0;hit<nHits;hit++) trackerMaps.at(i).push_back(RandomTrackerCell(random));
+    }
+    for (int i=0;i<config.nTrackerAverage;i++)
+    {
+      // One value per location in the paired map branch
+      trackerAverages.at(i).clear();
+      int nHits = trackerMaps.at(i%config.nTrackerMap).size();
+      for (int hit=0;hit<nHits;hit++) trackerAverages.at(i).push_back(random.Uniform(0, 22. * scale)); // drift radius in mm
+    }
+
+    for (int i=0;i<config.nCaloMap;i++)
+    {
+      caloMaps.at(i).clear();
+      int nHits = random.Poisson(config.meanCaloHits);
+      for (int hit=0;hit<nHits;hit++) caloMaps.at(i).push_back(RandomCaloGeomID(random));
+    }
+    for (int i=0;i<config.nCaloAverage;i++)
+    {
+      caloAverages.at(i).clear();
+      int nHits = caloMaps.at(i%config.nCaloMap).size();
+      for (int hit=0;hit<nHits;hit++) caloAverages.at(i).push_back(TMath::Abs(random.Gaus(1. * scale, 0.3))); // energy in MeV
+    }
+    outTree->Fill();
+  }
+
+  outTree->Write("",TObject::kOverwrite);
+  outputFile->Close();
+  cout<<"Wrote "<<config.entries<<" synthetic entries to "<<outputFileName<<endl;
+  return true;
+}
+
+/**
+ *  An encoded tracker cell as ValidationParser decodes it: row * 100 + layer on the
+ *  French side, and the negative of row * 100 + (layer + 1) on the Italian side.
+ *  Hits are more likely near the foil, as in real events
+ */
+int RandomTrackerCell(TRandom3 &random)
+{
+  int layer = (int)random.Exp(3.);
+  if (layer >= MAX_TRACKER_LAYERS) layer = (int)random.Integer(MAX_TRACKER_LAYERS);
+  int row = (int)random.Integer(MAX_TRACKER_ROWS);
+  bool isFrance = (random.Rndm() < 0.5);
+  if (isFrance) return row * 100 + layer;
+  return -1 * (row * 100 + layer + 1);
+}
+
+/**
+ *  A calorimeter geometry ID string, like the ones the reconstruction writes:
+ *  main walls [1302:module.side.column.row.*]
+ *  x walls    [1232:module.side.wall.column.row.*]
+ *  gamma veto [1252:module.side.wall.column.*]
+ *  Most hits are on the main walls
+ */
+string RandomCaloGeomID(TRandom3 &random)
+{
+  int side = (int)random.Integer(2);
+  double whichType = random.Rndm();
+  if (whichType < 0.8)
+  {
+    return Form("[1302:0.%d.%d.%d.*]", side, (int)random.Integer(MAINWALL_WIDTH), (int)random.Integer(MAINWALL_HEIGHT));
+  }
+  if (whichType < 0.9)
+  {
+    return Form("[1232:0.%d.%d.%d.%d.*]", side, (int)random.Integer(2), (int)random.Integer(XWALL_DEPTH/2), (int)random.Integer(XWALL_HEIGHT));
+  }
+  return Form("[1252:0.%d.%d.%d.*]", side, (int)random.Integer(2), (int)random.Integer(VETO_WIDTH));
+}
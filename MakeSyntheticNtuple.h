@@ -0,0 +1,37 @@
+
+// Standard Library
+#include <iostream>
+#include <getopt.h>
+#include <string>
+#include <vector>
+
+// ROOT
+#include "TFile.h"
+#include "TTree.h"
+#include "TRandom3.h"
+#include "TMath.h"
+
+// Tree name and detector geometry
+#include "ValidationParser.h"
+
+using namespace std;
+
+// What to put in the synthetic ntuple
+struct SyntheticConfig
+{
+  Long64_t entries=10000;
+  unsigned int seed=1;
+  int nHistogram=6;      // h_ branches
+  int nTrackerMap=2;     // t_ branches
+  int nTrackerAverage=2; // tm_ branches
+  int nCaloMap=2;        // c_ branches
+  int nCaloAverage=2;    // cm_ branches
+  double meanTrackerHits=40;
+  double meanCaloHits=3;
+  double shift=0;        // Fractional shift to the generated values, for making references that differ
+};
+
+void PrintSyntheticUsage(const char *progName);
+bool MakeSyntheticNtuple(string outputFileName, SyntheticConfig config);
+int RandomTrackerCell(TRandom3 &random);
+string RandomCaloGeomID(TRandom3 &random);
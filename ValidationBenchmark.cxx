@@ -0,0 +1,295 @@
+#include "ValidationBenchmark.h"
+
+/**
+ *  End-to-end benchmark: make a synthetic sample and reference with MakeSyntheticNtuple,
+ *  then run ValidationParser over them. Each stage runs as its own process so we can
+ *  report its wall time, events/s, MB/s and peak resident memory separately.
+ */
+int main(int argc, char **argv)
+{
+  string parser="./ValidationParser";
+  string generator="./MakeSyntheticNtuple";
+  string workDir="benchmark_output";
+  string generatorArgs="";
+  long long entries=100000;
+  vector<int> threadCounts; // Thread pool sizes to compare with unzipping on one thread
+  string realSample="";
+  string realReference="";
+
+  static struct option longOptions[] =
+  {
+    {"help",           no_argument,       0, 'h'},
+    {"parser",         required_argument, 0, 'p'},
+    {"generator",      required_argument, 0, 'g'},
+    {"workdir",        required_argument, 0, 'w'},
+    {"entries",        required_argument, 0, 'n'},
+    {"generator-args", required_argument, 0, 'a'},
+    {"threads",        required_argument, 0, 't'},
+    {"real-sample",    required_argument, 0, 's'},
+    {"real-reference", required_argument, 0, 'r'},
+    {0, 0, 0, 0}
+  };
+  int flag=0;
+  while ((flag = getopt_long (argc, argv, "hp:g:w:n:a:t:s:r:", longOptions, 0)) != -1)
+  {
+    switch (flag)
+    {
+      case 'p':
+        parser = optarg;
+        break;
+      case 'g':
+        generator = optarg;
+        break;
+      case 'w':
+        workDir = optarg;
+        break;
+      case 'n':
+        try
+        {
+          entries = std::stoll(optarg);
+        }
+        catch (exception &e)
+        {
+          cout<<"ERROR: --entries needs a number, not "<<optarg<<endl;
+          return 1;
+        }
+        break;
+      case 'a':
+        generatorArgs = optarg;
+        break;
+      case 't':
+      {
+        string list = optarg;
+        for (size_t i=0; i<list.size(); i++) if (list[i]==',') list[i]=' ';
+        vector<string> counts = SplitWords(list);
+        for (int i=0;i<counts.size();i++)
+        {
+          try
+          {
+            threadCounts.push_back(std::stoi(counts.at(i)));
+          }
+          catch (exception &e)
+          {
+            cout<<"ERROR: --threads needs a comma-separated list of numbers, not "<<optarg<<endl;
+            return 1;
+          }
+        }
+        break;
+      }
+      case 's':
+        realSample = optarg;
+        break;
+      case 'r':
+        realReference = optarg;
+        break;
+      case 'h':
+      default:
+        PrintBenchmarkUsage(argv[0]);
+        return 1;
+    }
+  }
+
+  boost::filesystem::create_directories(workDir);
+  string sampleFile = workDir+"/benchmark_sample.root";
+  string referenceFile = workDir+"/benchmark_reference.root";
+  string nString = to_string(entries);
+  vector<StageResult> results;
+
+  // Generate the inputs. The reference gets a different seed and a small shift so the comparison has something to find
+  vector<string> command = {generator, "-o", sampleFile, "-n", nString, "-s", "1"};
+  vector<string> extraArgs = SplitWords(generatorArgs);
+  command.insert(command.end(), extraArgs.begin(), extraArgs.end());
+  StageResult stage = RunStage("generate sample", command, entries, 0);
+  stage.megabytes = FileSizeMB(sampleFile);
+  results.push_back(stage);
+
+  command = {generator, "-o", referenceFile, "-n", nString, "-s", "2", "--shift", "0.01"};
+  command.insert(command.end(), extraArgs.begin(), extraArgs.end());
+  stage = RunStage("generate reference", command, entries, 0);
+  stage.megabytes = FileSizeMB(referenceFile);
+  results.push_back(stage);
+
+  if (!results.at(0).succeeded || !results.at(1).succeeded)
+  {
+    cout<<"ERROR: could not generate the benchmark inputs"<<endl;
+    PrintStageTable(results);
+    return 1;
+  }
+
+  // Then time the parser on them
+  command = {parser, "-i", sampleFile, "-o", workDir+"/plots_sample_only"};
+  results.push_back(RunStage("validate sample only", command, entries, FileSizeMB(sampleFile)));
+
+  command = {parser, "-i", sampleFile, "-r", referenceFile, "-o", workDir+"/plots_compare"};
+  StageResult compareStage = RunStage("validate with reference", command, 2 * entries, FileSizeMB(sampleFile) + FileSizeMB(referenceFile));
+  results.push_back(compareStage);
+
+  // Prescaling still reads most baskets, so how many bytes it reads isn't known and no MB/s is shown
+  command = {parser, "-i", sampleFile, "-r", referenceFile, "-o", workDir+"/plots_prescale", "--prescale", "10"};
+  results.push_back(RunStage("quick look (prescale 10)", command, 2 * entries / 10, 0));
+
+  // How much unzipping on more threads helps, on the synthetic inputs and on real ones if we have them
+  vector<StageResult> scan;
+  if (threadCounts.size() > 0)
+  {
+    scan.push_back(compareStage); // The same validation, already run on one thread
+    scan.back().name = "synthetic, 1 thread";
+    RunThreadScan("synthetic", parser, sampleFile, referenceFile, workDir+"/plots_threads", 2 * entries, threadCounts, scan);
+    results.insert(results.end(), scan.begin()+1, scan.end());
+  }
+  if (realSample.length() > 0)
+  {
+    size_t firstReal = scan.size();
+    vector<int> realCounts = threadCounts;
+    realCounts.insert(realCounts.begin(), -1); // Start with one thread
+    RunThreadScan("real", parser, realSample, realReference, workDir+"/plots_real", 0, realCounts, scan);
+    results.insert(results.end(), scan.begin()+firstReal, scan.end());
+  }
+
+  PrintStageTable(results);
+  if (scan.size() > 0) PrintSpeedups(scan);
+  for (int i=0;i<results.size();i++)
+  {
+    if (!results.at(i).succeeded) return 1;
+  }
+  return 0;
+}
+
+void PrintBenchmarkUsage(const char *progName)
+{
+  cout<<"Usage: "<<progName<<" [options]"<<endl;
+  cout<<"  -p, --parser <path>            ValidationParser executable (default ./ValidationParser)"<<endl;
+  cout<<"  -g, --generator <path>         MakeSyntheticNtuple executable (default ./MakeSyntheticNtuple)"<<endl;
+  cout<<"  -w, --workdir <dir>            where to put the synthetic files and plots (default benchmark_output)"<<endl;
+  cout<<"  -n, --entries <N>              events in the synthetic sample and reference (default 100000)"<<endl;
+  cout<<"  -a, --generator-args \"<args>\"  extra options for MakeSyntheticNtuple, e.g. \"--t-branches 4 --tracker-hits 80\""<<endl;
+  cout<<"  -t, --threads <N,N,...>        also validate with ROOT unzipping on each of these numbers of threads, and show the speed-up"<<endl;
+  cout<<"  -s, --real-sample <file>       do the same on a real sample"<<endl;
+  cout<<"  -r, --real-reference <file>    and compare it with this real reference"<<endl;
+}
+
+/**
+ *  Validate a sample against a reference with ValidationParser --threads set to each of the
+ *  thread counts in turn (-1 for not at all), adding a stage to the results for each.
+ *  Stages are named "<label>, N threads"
+ */
+void RunThreadScan(string label, string parser, string sampleFile, string referenceFile, string outputDir, long long events, vector<int> threadCounts, vector<StageResult> &results)
+{
+  double megabytes = FileSizeMB(sampleFile) + FileSizeMB(referenceFile);
+  for (int i=0;i<threadCounts.size();i++)
+  {
+    vector<string> command = {parser, "-i", sampleFile, "-o", outputDir};
+    if (referenceFile.length() > 0)
+    {
+      command.push_back("-r");
+      command.push_back(referenceFile);
+    }
+    string name = label+", 1 thread";
+    if (threadCounts.at(i) >= 0)
+    {
+      command.push_back("--threads");
+      command.push_back(to_string(threadCounts.at(i)));
+      name = label+", "+(threadCounts.at(i)==0?string("all cores"):to_string(threadCounts.at(i))+" threads");
+    }
+    results.push_back(RunStage(name, command, events, megabytes));
+  }
+}
+
+// The speed-up of each stage in a thread scan over the first stage for the same input
+void PrintSpeedups(vector<StageResult> scan)
+{
+  cout<<endl;
+  cout<<left<<setw(28)<<"Threads"<<right<<setw(10)<<"Time (s)"<<setw(12)<<"Speed-up"<<endl;
+  double baseline = 0;
+  string label = "";
+  for (int i=0;i<scan.size();i++)
+  {
+    StageResult stage = scan.at(i);
+    string stageLabel = stage.name.substr(0, stage.name.find(','));
+    if (stageLabel != label) baseline = stage.seconds; // The first of each input is on one thread
+    label = stageLabel;
+    cout<<left<<setw(28)<<stage.name<<right<<fixed<<setprecision(2)<<setw(10)<<stage.seconds;
+    if (stage.succeeded && stage.seconds > 0 && baseline > 0) cout<<setw(11)<<baseline / stage.seconds<<"x";
+    else cout<<setw(12)<<"-";
+    cout<<endl;
+  }
+}
+
+/**
+ *  Run one stage in a child process and measure it. Peak RSS comes from the
+ *  child's resource usage, so each stage is measured on its own
+ */
+StageResult RunStage(string name, vector<string> command, long long events, double megabytes)
+{
+  StageResult result;
+  result.name = name;
+  result.events = events;
+  result.megabytes = megabytes;
+
+  cout<<"Running stage \""<<name<<"\":";
+  for (int i=0;i<command.size();i++) cout<<" "<<command.at(i);
+  cout<<endl;
+
+  vector<char*> args;
+  for (int i=0;i<command.size();i++) args.push_back(const_cast<char*>(command.at(i).c_str()));
+  args.push_back(0);
+
+  auto start = chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    cout<<"ERROR: could not start stage "<<name<<endl;
+    return result;
+  }
+  if (pid == 0)
+  {
+    execvp(args.at(0), args.data());
+    cerr<<"ERROR: could not run "<<command.at(0)<<endl;
+    _exit(127);
+  }
+  int status=0;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  result.peakRSSkB = usage.ru_maxrss; // kilobytes on Linux
+  result.succeeded = (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  if (!result.succeeded) cout<<"WARNING: stage \""<<name<<"\" did not finish cleanly"<<endl;
+  return result;
+}
+
+// Split a string of command-line options on white space
+vector<string> SplitWords(string input)
+{
+  vector<string> words;
+  istringstream stream(input);
+  string word;
+  while (stream >> word) words.push_back(word);
+  return words;
+}
+
+double FileSizeMB(string fileName)
+{
+  boost::system::error_code error;
+  double size = boost::filesystem::file_size(fileName, error);
+  if (error) return 0;
+  return size / (1024. * 1024.);
+}
+
+void PrintStageTable(vector<StageResult> results)
+{
+  cout<<endl;
+  cout<<left<<setw(28)<<"Stage"<<right<<setw(10)<<"Time (s)"<<setw(14)<<"Events/s"<<setw(12)<<"MB/s"<<setw(16)<<"Peak RSS (MB)"<<endl;
+  for (int i=0;i<results.size();i++)
+  {
+    StageResult stage = results.at(i);
+    double seconds = (stage.seconds > 0) ? stage.seconds : 1e-9;
+    cout<<left<<setw(28)<<stage.name<<right<<fixed<<setprecision(2)<<setw(10)<<stage.seconds;
+    if (stage.events > 0) cout<<setprecision(0)<<setw(14)<<stage.events / seconds;
+    else cout<<setw(14)<<"-"; // Not known for real inputs
+    if (stage.megabytes > 0) cout<<setprecision(2)<<setw(12)<<stage.megabytes / seconds;
+    else cout<<setw(12)<<"-";
+    cout<<setw(16)<<stage.peakRSSkB / 1024.;
+    if (!stage.succeeded) cout<<"  (FAILED)";
+    cout<<endl;
+  }
+}
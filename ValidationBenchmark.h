@@ -0,0 +1,36 @@
+
+// Standard Library
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "boost/filesystem.hpp"
+
+using namespace std;
+
+// What we measured for one stage of the benchmark
+struct StageResult
+{
+  string name;
+  bool succeeded=false;
+  double seconds=0;
+  long long events=0; // Events processed in this stage
+  double megabytes=0; // Size of the ROOT files read (or written, for generation)
+  long peakRSSkB=0;
+};
+
+int main(int argc, char **argv);
+void PrintBenchmarkUsage(const char *progName);
+StageResult RunStage(string name, vector<string> command, long long events, double megabytes);
+vector<string> SplitWords(string input);
+double FileSizeMB(string fileName);
+void PrintStageTable(vector<StageResult> results);
+void RunThreadScan(string label, string parser, string sampleFile, string referenceFile, string outputDir, long long events, vector<int> threadCounts, vector<StageResult> &results);
+void PrintSpeedups(vector<StageResult> scan);
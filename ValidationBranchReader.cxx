@@ -0,0 +1,62 @@
+#include "ValidationBranchReader.h"
+
+/**
+ *  Make a reader for a branch of numbers, choosing the element type from what is stored in the
+ *  file. Returns 0 (with an error) if the branch doesn't hold numbers we know how to read.
+ *  The caller owns the reader, and should reset the tree's branch addresses before deleting it
+ */
+BranchReader *MakeBranchReader(TTree *inputTree, string branchName)
+{
+  TBranch *branch = inputTree->GetBranch(branchName.c_str());
+  if (branch==0)
+  {
+    cout<<"ERROR: no branch "<<branchName<<" to read"<<endl;
+    return 0;
+  }
+  TClass *expectedClass=0;
+  EDataType expectedType=kOther_t;
+  if (branch->GetExpectedType(expectedClass, expectedType) != 0)
+  {
+    cout<<"ERROR: could not tell what type branch "<<branchName<<" holds"<<endl;
+    return 0;
+  }
+  if (expectedClass)
+  {
+    // A collection: find what it is a collection of
+    TVirtualCollectionProxy *proxy = expectedClass->GetCollectionProxy();
+    if (proxy==0 || proxy->GetValueClass()!=0)
+    {
+      cout<<"ERROR: branch "<<branchName<<" holds "<<expectedClass->GetName()<<", which isn't a vector of numbers"<<endl;
+      return 0;
+    }
+    return MakeTypedBranchReader(inputTree, branchName, proxy->GetType(), true);
+  }
+  return MakeTypedBranchReader(inputTree, branchName, expectedType, false);
+}
+
+// One reader for each element type we support
+BranchReader *MakeTypedBranchReader(TTree *inputTree, string branchName, EDataType type, bool isVector)
+{
+  switch (type)
+  {
+    case kChar_t:     return NewBranchReader<Char_t>(inputTree, branchName, isVector);
+    case kUChar_t:    return NewBranchReader<UChar_t>(inputTree, branchName, isVector);
+    case kShort_t:    return NewBranchReader<Short_t>(inputTree, branchName, isVector);
+    case kUShort_t:   return NewBranchReader<UShort_t>(inputTree, branchName, isVector);
+    case kInt_t:      return NewBranchReader<Int_t>(inputTree, branchName, isVector);
+    case kUInt_t:     return NewBranchReader<UInt_t>(inputTree, branchName, isVector);
+    case kLong_t:     return NewBranchReader<Long_t>(inputTree, branchName, isVector);
+    case kULong_t:    return NewBranchReader<ULong_t>(inputTree, branchName, isVector);
+    case kLong64_t:   return NewBranchReader<Long64_t>(inputTree, branchName, isVector);
+    case kULong64_t:  return NewBranchReader<ULong64_t>(inputTree, branchName, isVector);
+    case kFloat_t:
+    case kFloat16_t:  return NewBranchReader<Float_t>(inputTree, branchName, isVector); // Float16_t is a float in memory
+    case kDouble_t:
+    case kDouble32_t: return NewBranchReader<Double_t>(inputTree, branchName, isVector); // Double32_t is a double in memory
+    case kBool_t:     return NewBranchReader<Bool_t>(inputTree, branchName, isVector);
+    default:
+      break;
+  }
+  cout<<"ERROR: branch "<<branchName<<" holds a type (EDataType "<<(int)type<<") that can't be plotted"<<endl;
+  return 0;
+}
@@ -0,0 +1,113 @@
+#ifndef VALIDATION_BRANCH_READER_H
+#define VALIDATION_BRANCH_READER_H
+
+// Standard Library
+#include <iostream>
+#include <string>
+#include <vector>
+
+// ROOT
+#include "TTree.h"
+#include "TBranch.h"
+#include "TLeaf.h"
+#include "TClass.h"
+#include "TObjArray.h"
+#include "TVirtualCollectionProxy.h"
+
+using namespace std;
+
+/**
+ *  Reads the list of numbers in one entry of a branch, whatever type they are stored as:
+ *  a std::vector of any numeric type, or a C array (fixed size, or sized by another branch).
+ *  The values are read straight into a buffer of the stored type and converted one at a
+ *  time as they are used, so compact types like vector<short> aren't copied
+ */
+class BranchReader
+{
+public:
+  virtual ~BranchReader() {}
+  virtual bool IsValid() const { return branches.size()>0; }
+  virtual size_t Size() const = 0;
+  virtual double Value(size_t i) const = 0;
+  // The branches to read for each entry, in order (for a C array, the one with its size comes first)
+  const vector<TBranch*> &Branches() const { return branches; }
+
+protected:
+  vector<TBranch*> branches;
+};
+
+// A branch holding a std::vector<T>
+template <typename T> class VectorBranchReader : public BranchReader
+{
+public:
+  VectorBranchReader(TTree *inputTree, string branchName)
+  {
+    TBranch *branch=0;
+    if (inputTree->SetBranchAddress(branchName.c_str(), &values, &branch) < 0 || branch==0)
+    {
+      cout<<"ERROR: could not read branch "<<branchName<<endl;
+      return;
+    }
+    branches.push_back(branch);
+  }
+  ~VectorBranchReader() { delete values; }
+  size_t Size() const { return values?values->size():0; }
+  double Value(size_t i) const { return (double)(*values)[i]; }
+
+private:
+  vector<T> *values=0;
+};
+
+// A branch with one leaf holding a T, or a C array of them
+template <typename T> class ArrayBranchReader : public BranchReader
+{
+public:
+  ArrayBranchReader(TTree *inputTree, string branchName)
+  {
+    TBranch *branch = inputTree->GetBranch(branchName.c_str());
+    if (branch==0 || branch->GetListOfLeaves()->GetEntriesFast()!=1)
+    {
+      cout<<"ERROR: branch "<<branchName<<" needs to have exactly one leaf to be read as an array"<<endl;
+      return;
+    }
+    leaf = (TLeaf*)branch->GetListOfLeaves()->At(0);
+    countLeaf = leaf->GetLeafCount();
+    size_t maxSize = leaf->GetLenStatic();
+    if (countLeaf)
+    {
+      maxSize *= countLeaf->GetMaximum();
+      branches.push_back(countLeaf->GetBranch()); // Read first, so we know how many there are
+    }
+    buffer = new T[maxSize>0?maxSize:1];
+    inputTree->SetBranchAddress(branchName.c_str(), buffer);
+    branches.push_back(branch);
+  }
+  ~ArrayBranchReader() { delete[] buffer; }
+  size_t Size() const
+  {
+    if (countLeaf) return (size_t)countLeaf->GetValue() * leaf->GetLenStatic();
+    return leaf->GetLenStatic();
+  }
+  double Value(size_t i) const { return (double)buffer[i]; }
+
+private:
+  TLeaf *leaf=0;
+  TLeaf *countLeaf=0; // The leaf with the array's size, if it isn't fixed
+  T *buffer=0;
+};
+
+// Make a reader for a branch with elements of type T
+template <typename T> BranchReader *NewBranchReader(TTree *inputTree, string branchName, bool isVector)
+{
+  BranchReader *reader;
+  if (isVector) reader = new VectorBranchReader<T>(inputTree, branchName);
+  else reader = new ArrayBranchReader<T>(inputTree, branchName);
+  if (reader->IsValid()) return reader;
+  delete reader;
+  return 0;
+}
+
+BranchReader *MakeBranchReader(TTree *inputTree, string branchName);
+BranchReader *MakeTypedBranchReader(TTree *inputTree, string branchName, EDataType type, bool isVector);
+
+#endif
@@ -0,0 +1,196 @@
+#include "ValidationBulkFill.h"
+
+// Empty bins matching a histogram's. False if its bins aren't all the same width
+bool SetupBins(BulkBins &bins, TH1 *h)
+{
+  if (h->GetXaxis()->GetXbins()->GetSize()!=0) return false;
+  bins.nBins = h->GetNbinsX();
+  bins.low = h->GetXaxis()->GetXmin();
+  bins.high = h->GetXaxis()->GetXmax();
+  bins.sumw.assign(bins.nBins+2, 0);
+  bins.sumw2.assign(bins.nBins+2, 0);
+  return true;
+}
+
+/**
+ *  Add a block of values to the bins, each with its weight (or 1, if weights is 0). The bin of
+ *  every value is worked out first, using the same arithmetic as TAxis::FindBin, so a value on
+ *  a bin edge goes in the same bin as it would with Fill. That loop is only vectorised because
+ *  this file is built with -O3 -fno-trapping-math (see CMakeLists.txt): without them the
+ *  division is only done for values in range, and GCC leaves it as a scalar loop
+ */
+void BinValues(const double *values, const double *weights, size_t nValues, BulkBins &bins)
+{
+  bins.index.resize(nValues);
+  int *index = bins.index.data();
+  const int nBins = bins.nBins;
+  const double low = bins.low;
+  const double high = bins.high;
+  for (size_t i=0; i<nValues; i++)
+  {
+    double x = values[i];
+    index[i] = (x < low) ? 0 : (!(x < high) ? nBins+1 : 1 + (int)(nBins*(x-low)/(high-low))); // NaN is overflow, as in ROOT
+  }
+  double *sumw = bins.sumw.data();
+  double *sumw2 = bins.sumw2.data();
+  for (size_t i=0; i<nValues; i++)
+  {
+    double w = weights?weights[i]:1;
+    sumw[index[i]] += w;
+    sumw2[index[i]] += w*w;
+  }
+  for (size_t i=0; i<nValues; i++)
+  {
+    // Only the values in range count towards the mean and RMS, as with Fill
+    double w = (index[i] > 0 && index[i] <= nBins) ? (weights?weights[i]:1) : 0;
+    double x = (w != 0) ? values[i] : 0;
+    bins.totalw += w;
+    bins.totalw2 += w*w;
+    bins.totalwx += w*x;
+    bins.totalwx2 += w*x*x;
+  }
+  bins.nFilled += nValues;
+}
+
+// Put the bins into the histogram, with the same contents, errors and statistics Fill would have given
+void PutBins(const BulkBins &bins, TH1 *h)
+{
+  for (int bin=0; bin<=bins.nBins+1; bin++)
+  {
+    h->SetBinContent(bin, bins.sumw[bin]);
+    h->SetBinError(bin, TMath::Sqrt(bins.sumw2[bin]));
+  }
+  double stats[4] = {bins.totalw, bins.totalw2, bins.totalwx, bins.totalwx2};
+  h->PutStats(stats);
+  h->SetEntries(bins.nFilled);
+}
+
+/**
+ *  The branch, if it is a plain number in each entry that ROOT can hand over a whole basket
+ *  at a time: one leaf of a basic type, not an array, in a tree read from a file. Returns 0
+ *  for anything else, which is filled the usual way
+ */
+TBranch *BulkReadableBranch(TTree *inputTree, string branchName, EDataType &type)
+{
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,20,0)
+  if (inputTree->GetCurrentFile()==0 || inputTree->GetTree()!=inputTree) return 0; // In memory, or a chain
+  TBranch *branch = inputTree->GetBranch(branchName.c_str());
+  if (branch==0 || branch->GetListOfBranches()->GetEntriesFast()!=0) return 0;
+  if (branch->GetListOfLeaves()->GetEntriesFast()!=1) return 0;
+  TLeaf *leaf = (TLeaf*)branch->GetListOfLeaves()->At(0);
+  if (leaf->GetLeafCount()!=0 || leaf->GetLenStatic()!=1) return 0;
+  TClass *expectedClass=0;
+  type=kOther_t;
+  if (branch->GetExpectedType(expectedClass, type)!=0 || expectedClass!=0) return 0;
+  switch (type)
+  {
+    case kChar_t: case kUChar_t: case kShort_t: case kUShort_t: case kInt_t: case kUInt_t:
+    case kLong64_t: case kULong64_t: case kFloat_t: case kDouble_t: case kBool_t:
+      break;
+    default:
+      return 0; // Including Float16_t and Double32_t, which are packed in the file
+  }
+  if (!branch->SupportsBulkRead()) return 0;
+  return branch;
+#else
+  return 0;
+#endif
+}
+
+/**
+ *  Copy the values of the entries being used, out of a basket of numbers of type T that holds
+ *  entries [first, first+count). iSelected is how far through the selected entries we are
+ */
+template <typename T> void SelectValues(const char *payload, Long64_t first, Int_t count, TEntryList *entryList, Long64_t &iSelected, Long64_t nSelected, vector<double> &values)
+{
+  const T *span = reinterpret_cast<const T*>(payload);
+  if (entryList==0)
+  {
+    // Every entry is used, so the basket is converted in one go
+    Long64_t nValues = TMath::Min((Long64_t)count, nSelected - first);
+    values.resize(nValues);
+    for (Long64_t i=0; i<nValues; i++) values[i] = (double)span[i];
+    iSelected = first + nValues;
+    return;
+  }
+  values.clear();
+  Long64_t last = first + count;
+  for (; iSelected < nSelected; iSelected++)
+  {
+    Long64_t entry = entryList->GetEntry(iSelected);
+    if (entry >= last) break;
+    values.push_back((double)span[entry - first]);
+  }
+}
+
+void SelectTypedValues(EDataType type, const char *payload, Long64_t first, Int_t count, TEntryList *entryList, Long64_t &iSelected, Long64_t nSelected, vector<double> &values)
+{
+  switch (type)
+  {
+    case kChar_t:    SelectValues<Char_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kUChar_t:   SelectValues<UChar_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kShort_t:   SelectValues<Short_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kUShort_t:  SelectValues<UShort_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kInt_t:     SelectValues<Int_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kUInt_t:    SelectValues<UInt_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kLong64_t:  SelectValues<Long64_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kULong64_t: SelectValues<ULong64_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kFloat_t:   SelectValues<Float_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kDouble_t:  SelectValues<Double_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    case kBool_t:    SelectValues<Bool_t>(payload, first, count, entryList, iSelected, nSelected, values); break;
+    default: values.clear(); break;
+  }
+}
+
+/**
+ *  Fill a histogram with a plain number branch without going through GetEntry, a formula and
+ *  Fill for every entry: ROOT unzips each basket into one buffer, and all the values in it are
+ *  binned together. Baskets with none of the entries being used are never read. Each entry
+ *  has a weight of 1. Returns false, with the histogram untouched, if the branch can't be
+ *  read this way (or the histogram's bins aren't all the same width); the caller then fills
+ *  it with TTree::Draw as usual
+ */
+bool BulkFillHistogram(TTree *inputTree, string branchName, TH1 *h)
+{
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,20,0)
+  EDataType type;
+  TBranch *branch = BulkReadableBranch(inputTree, branchName, type);
+  BulkBins bins;
+  if (branch==0 || !SetupBins(bins, h)) return false;
+
+  TBufferFile buffer(TBuffer::kWrite, 32*1024);
+  ROOT::Internal::TBulkBranchRead &bulkRead = branch->GetBulkRead();
+  TEntryList *entryList = inputTree->GetEntryList();
+  Long64_t nSelected = entryList?entryList->GetN():inputTree->GetEntries();
+  Long64_t *basketEntry = branch->GetBasketEntry();
+  Int_t nBaskets = branch->GetWriteBasket();
+  vector<double> values;
+  Long64_t iSelected = 0;
+  while (iSelected < nSelected)
+  {
+    // Read the basket holding the next entry we need, from its start
+    Long64_t entry = entryList?entryList->GetEntry(iSelected):iSelected;
+    Long64_t basket = TMath::BinarySearch((Long64_t)nBaskets+1, basketEntry, entry);
+    Long64_t first = basketEntry[basket];
+    Int_t count = bulkRead.GetEntriesDeserialized(first, buffer);
+    if (count <= 0)
+    {
+      cout<<"WARNING: could not read the baskets of "<<branchName<<" in bulk; filling it entry by entry"<<endl;
+      return false;
+    }
+    Long64_t wasSelected = iSelected;
+    SelectTypedValues(type, buffer.GetCurrent(), first, count, entryList, iSelected, nSelected, values);
+    if (iSelected == wasSelected)
+    {
+      cout<<"WARNING: the baskets of "<<branchName<<" aren't where they should be; filling it entry by entry"<<endl;
+      return false;
+    }
+    BinValues(values.data(), 0, values.size(), bins);
+  }
+
+  PutBins(bins, h);
+  return true;
+#else
+  return false;
+#endif
+}
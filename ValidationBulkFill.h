@@ -0,0 +1,52 @@
+#ifndef VALIDATION_BULK_FILL_H
+#define VALIDATION_BULK_FILL_H
+
+// Standard Library
+#include <iostream>
+#include <string>
+#include <vector>
+
+// ROOT
+#include "RVersion.h"
+#include "TTree.h"
+#include "TBranch.h"
+#include "TLeaf.h"
+#include "TClass.h"
+#include "TObjArray.h"
+#include "TEntryList.h"
+#include "TH1.h"
+#include "TMath.h"
+#include "TBufferFile.h"
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,20,0)
+#include "ROOT/TBulkBranchRead.hxx"
+#endif
+
+using namespace std;
+
+/**
+ *  The bin contents and statistics of a 1-D histogram with fixed-width bins, built up a block
+ *  of values at a time in flat arrays and put into the histogram at the end. Bin 0 is the
+ *  underflow and nBins+1 the overflow, as in ROOT
+ */
+struct BulkBins
+{
+  int nBins;
+  double low;
+  double high;
+  vector<double> sumw; // For each bin
+  vector<double> sumw2;
+  vector<int> index; // Scratch space for the bin of each value in a block
+  Long64_t nFilled=0;
+  double totalw=0; // The statistics TH1::PutStats takes, for the values inside the range
+  double totalw2=0;
+  double totalwx=0;
+  double totalwx2=0;
+};
+
+bool SetupBins(BulkBins &bins, TH1 *h);
+void BinValues(const double *values, const double *weights, size_t nValues, BulkBins &bins);
+void PutBins(const BulkBins &bins, TH1 *h);
+TBranch *BulkReadableBranch(TTree *inputTree, string branchName, EDataType &type);
+bool BulkFillHistogram(TTree *inputTree, string branchName, TH1 *h);
+
+#endif
@@ -0,0 +1,453 @@
+#include "ValidationCampaign.h"
+
+/**
+ *  Campaign mode: validate a list or directory of samples against the same references,
+ *  running ValidationParser on several of them at once. It starts a new worker only if
+ *  there is enough free memory for it, and the reference histograms are filled once and
+ *  shared between the workers through a reference cache. At the end, it writes a table
+ *  of all the samples, worst p-value first.
+ */
+int main(int argc, char **argv)
+{
+  string parser="./ValidationParser";
+  string outputDir="campaign_output";
+  string configFile="";
+  string parserArgs="";
+  vector<string> sampleFiles;
+  vector<string> referenceFiles;
+  int jobs=sysconf(_SC_NPROCESSORS_ONLN);
+  double memoryPerJobMB=0; // 0 to measure it from the first sample
+  bool useReferenceCache=true;
+
+  static struct option longOptions[] =
+  {
+    {"help",               no_argument,       0, 'h'},
+    {"parser",             required_argument, 0, 'p'},
+    {"input",              required_argument, 0, 'i'},
+    {"list",               required_argument, 0, 'l'},
+    {"directory",          required_argument, 0, 'd'},
+    {"reference",          required_argument, 0, 'r'},
+    {"config",             required_argument, 0, 'c'},
+    {"output",             required_argument, 0, 'o'},
+    {"jobs",               required_argument, 0, 'j'},
+    {"memory-per-job",     required_argument, 0, 'm'},
+    {"parser-args",        required_argument, 0, 'a'},
+    {"no-reference-cache", no_argument,       0, 'N'},
+    {0, 0, 0, 0}
+  };
+  int flag=0;
+  try
+  {
+    while ((flag = getopt_long (argc, argv, "hp:i:l:d:r:c:o:j:m:a:", longOptions, 0)) != -1)
+    {
+      switch (flag)
+      {
+        case 'p':
+          parser = optarg;
+          break;
+        case 'i':
+          sampleFiles.push_back(optarg);
+          break;
+        case 'l':
+        {
+          vector<string> listed = SamplesInList(optarg);
+          sampleFiles.insert(sampleFiles.end(), listed.begin(), listed.end());
+          break;
+        }
+        case 'd':
+        {
+          vector<string> found = SamplesInDirectory(optarg);
+          sampleFiles.insert(sampleFiles.end(), found.begin(), found.end());
+          break;
+        }
+        case 'r':
+          referenceFiles.push_back(optarg); // ValidationParser splits comma-separated lists itself
+          break;
+        case 'c':
+          configFile = optarg;
+          break;
+        case 'o':
+          outputDir = optarg;
+          break;
+        case 'j':
+          jobs = std::stoi(optarg);
+          break;
+        case 'm':
+          memoryPerJobMB = std::stod(optarg);
+          break;
+        case 'a':
+          parserArgs = optarg;
+          break;
+        case 'N':
+          useReferenceCache = false;
+          break;
+        case 'h':
+        default:
+          PrintCampaignUsage(argv[0]);
+          return 1;
+      }
+    }
+  }
+  catch (exception &e)
+  {
+    cout<<"ERROR: could not read the value given for option -"<<(char)flag<<endl;
+    PrintCampaignUsage(argv[0]);
+    return 1;
+  }
+
+  if (sampleFiles.size()==0)
+  {
+    cout<<"ERROR: no samples to validate. Give them with -i, --list or --directory"<<endl;
+    PrintCampaignUsage(argv[0]);
+    return 1;
+  }
+  if (jobs < 1) jobs = 1;
+  boost::filesystem::create_directories(outputDir);
+
+  vector<CampaignSample> samples;
+  for (int i=0;i<sampleFiles.size();i++)
+  {
+    CampaignSample sample;
+    sample.file = sampleFiles.at(i);
+    sample.label = UniqueLabel(sample.file, samples);
+    sample.outputDir = outputDir+"/"+sample.label;
+    samples.push_back(sample);
+  }
+
+  // The same options for every sample, apart from the input and output
+  vector<string> commonArgs;
+  for (int i=0;i<referenceFiles.size();i++)
+  {
+    commonArgs.push_back("-r");
+    commonArgs.push_back(referenceFiles.at(i));
+  }
+  if (configFile.length()>0)
+  {
+    commonArgs.push_back("-c");
+    commonArgs.push_back(configFile);
+  }
+  bool hasReference = (referenceFiles.size()>0);
+  if (hasReference && useReferenceCache)
+  {
+    string cacheName = outputDir+"/ReferenceCache.root";
+    remove(cacheName.c_str()); // Made fresh each campaign, as the references may have changed
+    commonArgs.push_back("--reference-cache");
+    commonArgs.push_back(cacheName);
+  }
+  vector<string> extraArgs = SplitWords(parserArgs);
+  commonArgs.insert(commonArgs.end(), extraArgs.begin(), extraArgs.end());
+
+  cout<<"Validating "<<samples.size()<<" samples with up to "<<jobs<<" at once"<<endl;
+
+  // The first sample runs on its own. It fills the reference cache for the others,
+  // and tells us how much memory a worker needs if we weren't told
+  long memoryPerJobkB = memoryPerJobMB * 1024;
+  bool measureMemory = (memoryPerJobkB <= 0);
+  int running=0;
+  int next=0;
+  int finished=0;
+  long available=-1; // Free memory when no workers are running
+  bool firstOnItsOwn = (hasReference && useReferenceCache) || measureMemory;
+  while (next < samples.size() || running > 0)
+  {
+    // Start as many as we can. Workers that have just started haven't used their memory
+    // yet, so count it for all of them against what was free before any of them started
+    if (running == 0) available = AvailableMemorykB();
+    while (next < samples.size() && running < jobs)
+    {
+      if (running > 0 && firstOnItsOwn && next == 1) break; // Still waiting for the first one
+      if (running > 0 && available >= 0 && (running + 1) * memoryPerJobkB > available) break; // Wait for one to finish
+      vector<string> command = {parser, "-i", samples.at(next).file, "-o", samples.at(next).outputDir};
+      command.insert(command.end(), commonArgs.begin(), commonArgs.end());
+      if (StartSample(samples.at(next), command)) running++;
+      next++;
+    }
+    if (running == 0) continue; // Nothing started, because none could be
+
+    // Then wait for one to finish
+    int status=0;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, 0, &usage);
+    if (pid <= 0) break;
+    for (int i=0;i<samples.size();i++)
+    {
+      if (samples.at(i).pid != pid) continue;
+      FinishSample(samples.at(i), status, usage, hasReference);
+      running--;
+      // Leave some room above the biggest worker we have seen
+      if (measureMemory) memoryPerJobkB = max(memoryPerJobkB, (long)(1.25 * samples.at(i).peakRSSkB));
+      cout<<"["<<++finished<<"/"<<samples.size()<<"] "<<samples.at(i).label<<(samples.at(i).succeeded?" finished":" FAILED")<<" in "<<fixed<<setprecision(1)<<samples.at(i).seconds<<" s"<<endl;
+      break;
+    }
+  }
+
+  PrintCampaignTable(samples);
+  WriteCampaignSummary(outputDir+"/CampaignSummary.csv", samples);
+  for (int i=0;i<samples.size();i++)
+  {
+    if (!samples.at(i).succeeded) return 1;
+  }
+  return 0;
+}
+
+void PrintCampaignUsage(const char *progName)
+{
+  cout<<"Usage: "<<progName<<" -d <directory of samples> -r <reference ROOT file> [options]"<<endl;
+  cout<<"  -i, --input <file>             a sample to validate (can be given more than once)"<<endl;
+  cout<<"  -l, --list <file>              a text file listing the samples, one per line"<<endl;
+  cout<<"  -d, --directory <dir>          validate every .root file in this directory"<<endl;
+  cout<<"  -r, --reference <file>         reference to compare every sample with (can be given more than once)"<<endl;
+  cout<<"  -c, --config <file>            config file for ValidationParser"<<endl;
+  cout<<"  -o, --output <dir>             where to put the results (default campaign_output)"<<endl;
+  cout<<"  -j, --jobs <N>                 most samples to validate at once (default: number of cores)"<<endl;
+  cout<<"  -m, --memory-per-job <MB>      memory to allow for each one (default: measured from the first sample)"<<endl;
+  cout<<"  -a, --parser-args \"<args>\"     extra options for ValidationParser, e.g. \"--prescale 10\""<<endl;
+  cout<<"  -p, --parser <path>            ValidationParser executable (default ./ValidationParser)"<<endl;
+  cout<<"  --no-reference-cache           fill the reference histograms separately for every sample"<<endl;
+}
+
+// All the ROOT files in a directory, in alphabetical order
+vector<string> SamplesInDirectory(string directory)
+{
+  vector<string> files;
+  boost::system::error_code error;
+  boost::filesystem::directory_iterator it(directory, error);
+  if (error)
+  {
+    cout<<"WARNING: could not read directory "<<directory<<endl;
+    return files;
+  }
+  for (; it != boost::filesystem::directory_iterator(); it++)
+  {
+    if (it->path().extension() == ".root") files.push_back(it->path().string());
+  }
+  sort(files.begin(), files.end());
+  return files;
+}
+
+// The samples listed in a text file, one per line. Blank lines and lines starting with # are skipped
+vector<string> SamplesInList(string listFileName)
+{
+  vector<string> files;
+  ifstream listFile(listFileName.c_str());
+  if (!listFile)
+  {
+    cout<<"WARNING: could not read sample list "<<listFileName<<endl;
+    return files;
+  }
+  string line;
+  while (getline(listFile, line))
+  {
+    vector<string> words = SplitWords(line);
+    if (words.size()==0 || words.at(0)[0]=='#') continue;
+    files.push_back(words.at(0));
+  }
+  return files;
+}
+
+// The file name without path or .root, made unique among the samples so far
+string UniqueLabel(string fileName, vector<CampaignSample> &samples)
+{
+  string label = boost::filesystem::path(fileName).stem().string();
+  string unique = label;
+  for (int n=2; ; n++)
+  {
+    bool taken=false;
+    for (int i=0;i<samples.size();i++)
+    {
+      if (samples.at(i).label == unique) taken=true;
+    }
+    if (!taken) return unique;
+    unique = label+"_"+to_string(n);
+  }
+}
+
+/**
+ *  Start ValidationParser on a sample in a child process, with its output
+ *  going to a log file in the sample's output directory
+ */
+bool StartSample(CampaignSample &sample, vector<string> command)
+{
+  boost::filesystem::create_directories(sample.outputDir);
+  string logFileName = sample.outputDir+"/ValidationParser.log";
+
+  vector<char*> args;
+  for (int i=0;i<command.size();i++) args.push_back(const_cast<char*>(command.at(i).c_str()));
+  args.push_back(0);
+
+  sample.start = chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    cout<<"ERROR: could not start validating "<<sample.file<<endl;
+    return false;
+  }
+  if (pid == 0)
+  {
+    int logFile = open(logFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (logFile >= 0)
+    {
+      dup2(logFile, 1);
+      dup2(logFile, 2);
+      close(logFile);
+    }
+    execvp(args.at(0), args.data());
+    cerr<<"ERROR: could not run "<<command.at(0)<<endl;
+    _exit(127);
+  }
+  sample.pid = pid;
+  return true;
+}
+
+/**
+ *  Record how a sample's run went. It counts as a success if ValidationParser exited
+ *  without an error and wrote its results
+ */
+void FinishSample(CampaignSample &sample, int status, struct rusage &usage, bool hasReference)
+{
+  sample.seconds = chrono::duration<double>(chrono::steady_clock::now() - sample.start).count();
+  sample.peakRSSkB = usage.ru_maxrss; // kilobytes on Linux
+  sample.pid = 0;
+  string expected = sample.outputDir+(hasReference?"/ValidationResults.csv":"/ValidationHistograms.root");
+  sample.succeeded = (WIFEXITED(status) && WEXITSTATUS(status) == 0 && boost::filesystem::exists(expected));
+  if (hasReference) ReadSampleResults(sample);
+}
+
+// Memory we could use without swapping, from /proc/meminfo. -1 if we can't tell
+long AvailableMemorykB()
+{
+  ifstream meminfo("/proc/meminfo");
+  string name;
+  long value;
+  string unit;
+  while (meminfo >> name >> value >> unit)
+  {
+    if (name == "MemAvailable:") return value;
+  }
+  return -1;
+}
+
+// Split a string of command-line options on white space
+vector<string> SplitWords(string input)
+{
+  vector<string> words;
+  istringstream stream(input);
+  string word;
+  while (stream >> word) words.push_back(word);
+  return words;
+}
+
+// Split a line of CSV into fields, allowing for quoted fields as written by CSVField
+vector<string> SplitCSVLine(string line)
+{
+  vector<string> fields;
+  string field="";
+  bool quoted=false;
+  for (int i=0;i<line.length();i++)
+  {
+    char c = line[i];
+    if (quoted)
+    {
+      if (c=='"' && i+1<line.length() && line[i+1]=='"') { field += '"'; i++; }
+      else if (c=='"') quoted=false;
+      else field += c;
+    }
+    else if (c=='"') quoted=true;
+    else if (c==',') { fields.push_back(field); field=""; }
+    else field += c;
+  }
+  fields.push_back(field);
+  return fields;
+}
+
+// Find the worst p-value for a sample, and count its flagged cells, from its ValidationResults.csv
+void ReadSampleResults(CampaignSample &sample)
+{
+  ifstream resultsFile((sample.outputDir+"/ValidationResults.csv").c_str());
+  string line;
+  if (!getline(resultsFile, line)) return;
+  vector<string> header = SplitCSVLine(line);
+  int branchColumn=-1, referenceColumn=-1, pValueColumn=-1, flaggedColumn=-1;
+  for (int i=0;i<header.size();i++)
+  {
+    if (header.at(i)=="branch") branchColumn=i;
+    if (header.at(i)=="reference") referenceColumn=i;
+    if (header.at(i)=="p_value") pValueColumn=i;
+    if (header.at(i)=="n_flagged_cells") flaggedColumn=i;
+  }
+  if (branchColumn<0 || pValueColumn<0) return;
+  while (getline(resultsFile, line))
+  {
+    vector<string> fields = SplitCSVLine(line);
+    if (fields.size()!=header.size()) continue;
+    sample.branches++;
+    if (flaggedColumn>=0) sample.flaggedCells += atoi(fields.at(flaggedColumn).c_str());
+    double pValue = NAN;
+    try
+    {
+      pValue = std::stod(fields.at(pValueColumn));
+    }
+    catch (exception &e)
+    {
+      continue;
+    }
+    if (std::isnan(pValue)) continue;
+    if (std::isnan(sample.worstPValue) || pValue < sample.worstPValue)
+    {
+      sample.worstPValue = pValue;
+      sample.worstBranch = fields.at(branchColumn);
+      sample.worstReference = (referenceColumn>=0)?fields.at(referenceColumn):"";
+    }
+  }
+}
+
+// Order for the summary: failures first, then the lowest worst p-value
+bool IsWorse(const CampaignSample &a, const CampaignSample &b)
+{
+  if (a.succeeded != b.succeeded) return !a.succeeded;
+  if (std::isnan(a.worstPValue) != std::isnan(b.worstPValue)) return std::isnan(b.worstPValue);
+  if (a.worstPValue != b.worstPValue) return a.worstPValue < b.worstPValue;
+  return a.flaggedCells > b.flaggedCells;
+}
+
+bool WriteCampaignSummary(string fileName, vector<CampaignSample> samples)
+{
+  stable_sort(samples.begin(), samples.end(), IsWorse);
+  ofstream summaryFile(fileName.c_str());
+  if (!summaryFile)
+  {
+    cout<<"WARNING: could not write the campaign summary to "<<fileName<<endl;
+    return false;
+  }
+  summaryFile<<setprecision(8);
+  summaryFile<<"rank,sample,file,succeeded,worst_p_value,worst_branch,worst_reference,branches,flagged_cells,seconds,peak_rss_mb,output"<<"\n";
+  for (int i=0;i<samples.size();i++)
+  {
+    const CampaignSample &sample = samples.at(i);
+    summaryFile<<i+1<<","<<sample.label<<","<<sample.file<<","<<(sample.succeeded?1:0)<<",";
+    summaryFile<<sample.worstPValue<<","<<sample.worstBranch<<","<<sample.worstReference<<",";
+    summaryFile<<sample.branches<<","<<sample.flaggedCells<<","<<sample.seconds<<","<<sample.peakRSSkB / 1024.<<","<<sample.outputDir<<"\n";
+  }
+  cout<<"Campaign summary written to "<<fileName<<endl;
+  return true;
+}
+
+void PrintCampaignTable(vector<CampaignSample> samples)
+{
+  stable_sort(samples.begin(), samples.end(), IsWorse);
+  cout<<endl;
+  cout<<left<<setw(6)<<"Rank"<<setw(32)<<"Sample"<<right<<setw(14)<<"Worst p-value"<<"  "<<left<<setw(32)<<"Branch"<<right<<setw(10)<<"Flagged"<<setw(10)<<"Time (s)"<<setw(16)<<"Peak RSS (MB)"<<endl;
+  for (int i=0;i<samples.size();i++)
+  {
+    const CampaignSample &sample = samples.at(i);
+    cout<<left<<setw(6)<<i+1<<setw(32)<<sample.label<<right<<setw(14);
+    if (std::isnan(sample.worstPValue)) cout<<"-";
+    else cout<<scientific<<setprecision(3)<<sample.worstPValue;
+    string branch = sample.worstBranch;
+    if (sample.worstReference.length()>0) branch += " ("+sample.worstReference+")";
+    cout<<"  "<<left<<setw(32)<<branch<<right<<setw(10)<<sample.flaggedCells;
+    cout<<fixed<<setprecision(1)<<setw(10)<<sample.seconds<<setw(16)<<sample.peakRSSkB / 1024.;
+    if (!sample.succeeded) cout<<"  (FAILED)";
+    cout<<endl;
+  }
+}
@@ -0,0 +1,54 @@
+
+// Standard Library
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "boost/filesystem.hpp"
+
+using namespace std;
+
+// One sample in a campaign, and what we found when we validated it
+struct CampaignSample
+{
+  string file;
+  string label; // Unique; names its output directory
+  string outputDir;
+  pid_t pid=0;
+  chrono::steady_clock::time_point start;
+  bool succeeded=false;
+  double seconds=0;
+  long peakRSSkB=0;
+  // From its ValidationResults.csv
+  int branches=0;
+  int flaggedCells=0;
+  double worstPValue=NAN;
+  string worstBranch;
+  string worstReference;
+};
+
+int main(int argc, char **argv);
+void PrintCampaignUsage(const char *progName);
+vector<string> SamplesInDirectory(string directory);
+vector<string> SamplesInList(string listFileName);
+string UniqueLabel(string fileName, vector<CampaignSample> &samples);
+bool StartSample(CampaignSample &sample, vector<string> command);
+void FinishSample(CampaignSample &sample, int status, struct rusage &usage, bool hasReference);
+long AvailableMemorykB();
+vector<string> SplitWords(string input);
+vector<string> SplitCSVLine(string line);
+void ReadSampleResults(CampaignSample &sample);
+bool IsWorse(const CampaignSample &a, const CampaignSample &b);
+bool WriteCampaignSummary(string fileName, vector<CampaignSample> samples);
+void PrintCampaignTable(vector<CampaignSample> samples);
@@ -0,0 +1,65 @@
+#include "ValidationCellDistributions.h"
+
+void CellDistributions::Setup(int cells, int bins, double lowEdge, double highEdge)
+{
+  nCells = cells;
+  nBins = bins;
+  low = lowEdge;
+  high = highEdge;
+  sumWeights.assign((size_t)nCells * (nBins + 2), 0);
+  sumWeightsSquared.assign((size_t)nCells * (nBins + 2), 0);
+}
+
+// As a histogram of cell number (x) against value (y), to save
+TH2D *CellDistributions::ToHistogram(string name, string title) const
+{
+  TH2D *hist = new TH2D(name.c_str(), title.c_str(), nCells, 0, nCells, nBins, low, high);
+  hist->Sumw2();
+  hist->GetXaxis()->SetTitle("Cell");
+  hist->GetYaxis()->SetTitle(title.c_str());
+  for (int cell=0; cell<nCells; cell++)
+  {
+    for (int bin=0; bin<=nBins+1; bin++)
+    {
+      size_t index = (size_t)cell * (nBins + 2) + bin;
+      if (sumWeights[index]==0 && sumWeightsSquared[index]==0) continue;
+      hist->SetBinContent(cell+1, bin, sumWeights[index]);
+      hist->SetBinError(cell+1, bin, TMath::Sqrt(sumWeightsSquared[index]));
+    }
+  }
+  return hist;
+}
+
+/**
+ *  Compare the shape of the value distribution in one cell (x bin) of the sample and reference.
+ *  The reference is scaled to the same number of hits. Bins with nothing in either are left
+ *  out, and one degree of freedom is taken for the normalisation. Underflow and overflow count
+ *  as bins, so a tail moving out of range is noticed.
+ *  Returns the p-value, or NAN if there isn't anything to compare
+ */
+double CellDistributionChiSquared(TH2D *hSample, TH2D *hRef, int cellBin, double &chisq, int &ndf, double &sampleHits)
+{
+  chisq = 0;
+  ndf = 0;
+  sampleHits = 0;
+  double refHits = 0;
+  int nBins = hSample->GetNbinsY();
+  for (int bin=0; bin<=nBins+1; bin++)
+  {
+    sampleHits += hSample->GetBinContent(cellBin, bin);
+    refHits += hRef->GetBinContent(cellBin, bin);
+  }
+  if (sampleHits <= 0 || refHits <= 0) return NAN;
+  double scale = sampleHits / refHits;
+  int usedBins = 0;
+  for (int bin=0; bin<=nBins+1; bin++)
+  {
+    double variance = pow(hSample->GetBinError(cellBin, bin),2) + pow(scale * hRef->GetBinError(cellBin, bin),2);
+    if (variance <= 0) continue;
+    chisq += pow(hSample->GetBinContent(cellBin, bin) - scale * hRef->GetBinContent(cellBin, bin),2) / variance;
+    usedBins++;
+  }
+  ndf = usedBins - 1;
+  if (ndf < 1) return NAN;
+  return TMath::Prob(chisq, ndf);
+}
@@ -0,0 +1,47 @@
+#ifndef VALIDATION_CELL_DISTRIBUTIONS_H
+#define VALIDATION_CELL_DISTRIBUTIONS_H
+
+// Standard Library
+#include <string>
+#include <vector>
+#include <cmath>
+
+// ROOT
+#include "TH2.h"
+#include "TMath.h"
+
+using namespace std;
+
+/**
+ *  The distribution of an averaged value in every cell of a map, so a change in its shape
+ *  shows up even if the mean doesn't move. All the cells are in one flat array, indexed
+ *  by a dense cell number, with nBins bins plus underflow and overflow for each cell
+ */
+struct CellDistributions
+{
+  int nCells=0;
+  int nBins=0;
+  double low=0;
+  double high=1;
+  vector<double> sumWeights;
+  vector<double> sumWeightsSquared;
+
+  void Setup(int cells, int bins, double lowEdge, double highEdge);
+  void Fill(int cell, double value, double weight=1)
+  {
+    if (cell<0 || cell>=nCells || std::isnan(value)) return;
+    int bin;
+    if (value < low) bin = 0;
+    else if (value >= high) bin = nBins + 1;
+    else bin = 1 + (int)((value - low) * nBins / (high - low));
+    if (bin > nBins) bin = nBins; // Rounding, just below the top edge
+    size_t index = (size_t)cell * (nBins + 2) + bin;
+    sumWeights[index] += weight;
+    sumWeightsSquared[index] += weight * weight;
+  }
+  TH2D *ToHistogram(string name, string title) const;
+};
+
+double CellDistributionChiSquared(TH2D *hSample, TH2D *hRef, int cellBin, double &chisq, int &ndf, double &sampleHits);
+
+#endif
@@ -0,0 +1,392 @@
+#include "ValidationFeed.h"
+#include "ValidationParser.h"
+
+ValidationFeed::ValidationFeed() : nEvents(0)
+{
+}
+
+ValidationFeed::~ValidationFeed()
+{
+  for (FeedBranch *branch : branches)
+  {
+    DeleteAccumulators(*branch);
+    delete branch;
+  }
+}
+
+/**
+ *  Declare a branch, named as it would be in the ntuple, so its type comes from the prefix.
+ *  Branches have to be added before the first event, and a tm_ or cm_ branch after the map
+ *  branch its name ends in. The histogram of an h_ branch has nBins from low to high; with
+ *  no binning, its range is worked out from its first FEED_RANGE_VALUES values, as Draw does
+ */
+bool ValidationFeed::AddBranch(string branchName, int nBins, double low, double high)
+{
+  if (branchesByName.count(branchName))
+  {
+    cout<<"WARNING: branch "<<branchName<<" is already in the feed"<<endl;
+    return false;
+  }
+  if (nEvents>0)
+  {
+    cout<<"ERROR: can't add branch "<<branchName<<" after events have been fed"<<endl;
+    return false;
+  }
+  FeedBranch *branch = new FeedBranch;
+  branch->name = branchName;
+  if (branchName.compare(0,2,"h_")==0)
+  {
+    branch->type = 'h';
+    if (nBins > 0 && high > low)
+    {
+      branch->nBins = nBins;
+      branch->low = low;
+      branch->high = high;
+    }
+  }
+  else if (branchName.compare(0,2,"t_")==0 || branchName.compare(0,2,"c_")==0)
+  {
+    branch->type = branchName[0];
+    branch->isTracker = (branch->type == 't');
+  }
+  else if (branchName.compare(0,3,"tm_")==0 || branchName.compare(0,3,"cm_")==0)
+  {
+    branch->type = 'm';
+    branch->isTracker = (branchName[0] == 't');
+    size_t pos = branchName.find(".");
+    map<string, FeedBranch*>::iterator found = branchesByName.end();
+    if (pos != string::npos) found = branchesByName.find(branchName.substr(pos+1));
+    if (found == branchesByName.end() || found->second->type != branchName[0])
+    {
+      cout<<"ERROR: add the map branch for "<<branchName<<" (after the dot in its name) to the feed before it"<<endl;
+      delete branch;
+      return false;
+    }
+    branch->mapBranch = found->second;
+  }
+  else
+  {
+    cout<<"ERROR: branch "<<branchName<<" doesn't have a prefix the validation knows about"<<endl;
+    delete branch;
+    return false;
+  }
+  MakeAccumulators(*branch);
+  branches.push_back(branch);
+  branchesByName[branchName] = branch;
+  return true;
+}
+
+// Empty histograms for a branch, with the binning the validation uses for its plots
+void ValidationFeed::MakeAccumulators(FeedBranch &branch)
+{
+  string name = "feed_"+branch.name;
+  if (branch.type == 'h')
+  {
+    branch.hist = new TH1D(name.c_str(), "", (branch.nBins>0)?branch.nBins:100, branch.low, branch.high);
+    branch.hist->SetDirectory(0); // Only ever in memory
+    branch.hist->Sumw2();
+    if (branch.nBins == 0) branch.hist->SetBuffer(FEED_RANGE_VALUES);
+    return;
+  }
+  int nMaps = branch.isTracker?1:6;
+  for (int i=0; i<nMaps; i++)
+  {
+    for (int which=0; which<((branch.type=='m')?3:1); which++)
+    {
+      string mapName = name+Form("_%d_%d",i,which);
+      TH2D *h = 0;
+      if (branch.isTracker) h = new TH2D(mapName.c_str(),"",MAX_TRACKER_LAYERS*2,MAX_TRACKER_LAYERS*-1,MAX_TRACKER_LAYERS,MAX_TRACKER_ROWS,0,MAX_TRACKER_ROWS);
+      else h = new TH2D(mapName.c_str(),"",CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
+      h->SetDirectory(0);
+      h->Sumw2();
+      if (which == 0) branch.counts.push_back(h);
+      else if (which == 1) branch.sums.push_back(h);
+      else branch.sumsOfSquares.push_back(h);
+    }
+  }
+}
+
+void ValidationFeed::DeleteAccumulators(FeedBranch &branch)
+{
+  delete branch.hist;
+  branch.hist = 0;
+  for (int i=0; i<branch.counts.size(); i++) delete branch.counts.at(i);
+  for (int i=0; i<branch.sums.size(); i++) delete branch.sums.at(i);
+  for (int i=0; i<branch.sumsOfSquares.size(); i++) delete branch.sumsOfSquares.at(i);
+  branch.counts.clear();
+  branch.sums.clear();
+  branch.sumsOfSquares.clear();
+  branch.problems = HitProblems();
+}
+
+ValidationFeed::FeedBranch *ValidationFeed::FindBranch(string branchName, char type)
+{
+  map<string, FeedBranch*>::iterator found = branchesByName.find(branchName);
+  if (found == branchesByName.end() || found->second->type != type)
+  {
+    cout<<"ERROR: the feed has no branch "<<branchName<<" of that type"<<endl;
+    return 0;
+  }
+  return found->second;
+}
+
+bool ValidationFeed::SetValue(string branchName, double value)
+{
+  FeedBranch *branch = FindBranch(branchName, 'h');
+  if (!branch) return false;
+  branch->scalar = value;
+  return true;
+}
+
+bool ValidationFeed::AddTrackerHit(string branchName, int encodedLocation)
+{
+  FeedBranch *branch = FindBranch(branchName, 't');
+  if (!branch) return false;
+  branch->trackerHits.push_back(encodedLocation);
+  return true;
+}
+
+bool ValidationFeed::AddCaloHit(string branchName, string geomId)
+{
+  FeedBranch *branch = FindBranch(branchName, 'c');
+  if (!branch) return false;
+  branch->caloHits.push_back(geomId);
+  return true;
+}
+
+// A value for a tm_ or cm_ branch, in the same order as the hits in its map branch
+bool ValidationFeed::AddAverageValue(string branchName, double value)
+{
+  FeedBranch *branch = FindBranch(branchName, 'm');
+  if (!branch) return false;
+  branch->values.push_back(value);
+  return true;
+}
+
+/**
+ *  The event is complete: add it to every branch's histograms. The hits of each map branch
+ *  are placed once, and the averages over them use the same places
+ */
+void ValidationFeed::EndEvent()
+{
+  for (FeedBranch *branch : branches)
+  {
+    if (branch->type == 't' || branch->type == 'c') PlaceHits(*branch);
+  }
+  for (FeedBranch *branch : branches)
+  {
+    if (branch->type == 'h') branch->hist->Fill(branch->scalar);
+    else if (branch->type == 'm') AddAverages(*branch);
+  }
+  nEvents++;
+  ResetEvent();
+}
+
+/**
+ *  Work out where each of the event's hits in a map branch is, and count them. Hits that
+ *  can't be placed on the map are left out, as when reading a tree
+ */
+void ValidationFeed::PlaceHits(FeedBranch &branch)
+{
+  size_t nHits = branch.isTracker?branch.trackerHits.size():branch.caloHits.size();
+  branch.walls.assign(nHits, 0);
+  branch.xs.resize(nHits);
+  branch.ys.resize(nHits);
+  int eventProblems = 0;
+  for (size_t i=0; i<nHits; i++)
+  {
+    if (branch.isTracker)
+    {
+      DecodeTrackerHit(branch.trackerHits[i], branch.xs[i], branch.ys[i]);
+    }
+    else if (!DecodeCaloHit(branch.caloHits[i], branch.walls[i], branch.xs[i], branch.ys[i]))
+    {
+      branch.walls[i] = -1;
+      eventProblems |= HIT_UNPARSEABLE;
+      continue;
+    }
+    int cell = branch.isTracker?TrackerCellId(branch.xs[i], branch.ys[i]):CaloCellId(branch.walls[i], branch.xs[i], branch.ys[i]);
+    if (cell < 0)
+    {
+      branch.walls[i] = -1;
+      eventProblems |= HIT_OFF_MAP;
+      continue;
+    }
+    branch.counts.at(branch.walls[i])->Fill(branch.xs[i], branch.ys[i]);
+  }
+  branch.problems.Count(eventProblems);
+}
+
+/**
+ *  Add the event's values for a tm_ or cm_ branch to the cells of the hits they go with.
+ *  The problems with the hits themselves are counted for the map branch; here we only
+ *  count events without one value for each hit
+ */
+void ValidationFeed::AddAverages(FeedBranch &branch)
+{
+  const FeedBranch &hits = *branch.mapBranch;
+  size_t nHits = hits.walls.size();
+  if (branch.values.size() != nHits) branch.problems.Count(HIT_LENGTH_MISMATCH);
+  if (branch.values.size() < nHits) nHits = branch.values.size(); // Protect against a short list of values
+  for (size_t i=0; i<nHits; i++)
+  {
+    int wall = hits.walls[i];
+    double value = branch.values[i];
+    if (wall < 0) continue;
+    if (branch.isTracker && std::isnan(value)) continue; // Nothing to average, as when reading a tree
+    branch.counts.at(wall)->Fill(hits.xs[i], hits.ys[i]);
+    branch.sums.at(wall)->Fill(hits.xs[i], hits.ys[i], value);
+    branch.sumsOfSquares.at(wall)->Fill(hits.xs[i], hits.ys[i], value*value);
+  }
+}
+
+void ValidationFeed::ResetEvent()
+{
+  for (FeedBranch *branch : branches)
+  {
+    branch->scalar = 0;
+    branch->trackerHits.clear();
+    branch->caloHits.clear();
+    branch->values.clear();
+  }
+}
+
+// A branch's column has to have the right number of entries for the block
+bool ValidationFeed::CheckColumn(const FeedBlock &block, const FeedBranch &branch, size_t columnSize, bool hasColumn)
+{
+  if (!hasColumn) return true; // No hits in any of the events (or 0 for an h_ branch)
+  if (branch.type == 'h')
+  {
+    if (columnSize == block.nEvents) return true;
+    cout<<"ERROR: block has "<<columnSize<<" values for "<<branch.name<<" but "<<block.nEvents<<" events"<<endl;
+    return false;
+  }
+  map<string, vector<size_t> >::const_iterator offsets = block.offsets.find(branch.name);
+  if (offsets == block.offsets.end() || offsets->second.size() != block.nEvents+1)
+  {
+    cout<<"ERROR: block needs "<<block.nEvents+1<<" offsets for "<<branch.name<<endl;
+    return false;
+  }
+  for (size_t event=0; event<block.nEvents; event++)
+  {
+    if (offsets->second[event] > offsets->second[event+1] || offsets->second[event+1] > columnSize)
+    {
+      cout<<"ERROR: bad offsets for "<<branch.name<<" in block"<<endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ *  Push a block of events. The whole block is checked first, so if anything in it is wrong,
+ *  none of its events are added. Returns false if the block wasn't added
+ */
+bool ValidationFeed::PushBlock(const FeedBlock &block)
+{
+  // Find each branch's column once, rather than for every event
+  size_t nBranches = branches.size();
+  vector<const vector<double>*> valueColumns(nBranches, 0);
+  vector<const vector<int>*> trackerColumns(nBranches, 0);
+  vector<const vector<string>*> caloColumns(nBranches, 0);
+  vector<const vector<size_t>*> offsetColumns(nBranches, 0);
+  for (size_t i=0; i<nBranches; i++)
+  {
+    const FeedBranch &branch = *branches[i];
+    size_t columnSize = 0;
+    if (branch.type == 'h' || branch.type == 'm')
+    {
+      map<string, vector<double> >::const_iterator column = block.values.find(branch.name);
+      if (column != block.values.end()) { valueColumns[i] = &column->second; columnSize = column->second.size(); }
+    }
+    else if (branch.type == 't')
+    {
+      map<string, vector<int> >::const_iterator column = block.trackerHits.find(branch.name);
+      if (column != block.trackerHits.end()) { trackerColumns[i] = &column->second; columnSize = column->second.size(); }
+    }
+    else
+    {
+      map<string, vector<string> >::const_iterator column = block.caloHits.find(branch.name);
+      if (column != block.caloHits.end()) { caloColumns[i] = &column->second; columnSize = column->second.size(); }
+    }
+    bool hasColumn = valueColumns[i] || trackerColumns[i] || caloColumns[i];
+    if (!CheckColumn(block, branch, columnSize, hasColumn)) return false;
+    if (hasColumn && branch.type != 'h') offsetColumns[i] = &block.offsets.find(branch.name)->second;
+  }
+  // Then add the events one by one, as if they had been fed one at a time
+  for (size_t event=0; event<block.nEvents; event++)
+  {
+    for (size_t i=0; i<nBranches; i++)
+    {
+      FeedBranch &branch = *branches[i];
+      if (branch.type == 'h')
+      {
+        if (valueColumns[i]) branch.scalar = (*valueColumns[i])[event];
+        continue;
+      }
+      if (!offsetColumns[i]) continue; // No hits in any of the events
+      size_t first = (*offsetColumns[i])[event];
+      size_t last = (*offsetColumns[i])[event+1];
+      if (branch.type == 't') branch.trackerHits.assign(trackerColumns[i]->begin()+first, trackerColumns[i]->begin()+last);
+      else if (branch.type == 'c') branch.caloHits.assign(caloColumns[i]->begin()+first, caloColumns[i]->begin()+last);
+      else branch.values.assign(valueColumns[i]->begin()+first, valueColumns[i]->begin()+last);
+    }
+    EndEvent();
+  }
+  return true;
+}
+
+// The names of the branches, in the order they were added
+vector<string> ValidationFeed::GetBranchNames() const
+{
+  vector<string> names;
+  for (FeedBranch *branch : branches) names.push_back(branch->name);
+  return names;
+}
+
+/**
+ *  A copy of the histogram of an h_ branch, which the caller owns. If its range is still being
+ *  worked out, it is worked out from the values so far. 0 if there is no such branch
+ */
+TH1D *ValidationFeed::CopyHistogram(string branchName) const
+{
+  map<string, FeedBranch*>::const_iterator found = branchesByName.find(branchName);
+  if (found == branchesByName.end() || found->second->type != 'h') return 0;
+  TH1D *copy = (TH1D*)found->second->hist->Clone((branchName+"_copy").c_str());
+  copy->SetDirectory(0);
+  copy->BufferEmpty(1); // Fix the range, and fill the bins from the values held back so far
+  if (copy->GetXaxis()->GetXmax() <= copy->GetXaxis()->GetXmin()) copy->SetBins(copy->GetNbinsX(), 0, 1); // No values yet
+  return copy;
+}
+
+/**
+ *  Add what has been accumulated for a t_, c_, tm_ or cm_ branch to the validation's own
+ *  histograms: the hits in each cell, and for an average the sums of the values and of their
+ *  squares (one histogram each for the tracker, six for the calorimeter). The branch's
+ *  problems are added too. Returns false if there is no such branch
+ */
+bool ValidationFeed::AddMap(string branchName, const vector<TH2D*> &counts, const vector<TH2D*> &sums, const vector<TH2D*> &sumsOfSquares, HitProblems &problems) const
+{
+  map<string, FeedBranch*>::const_iterator found = branchesByName.find(branchName);
+  if (found == branchesByName.end() || found->second->type == 'h') return false;
+  const FeedBranch &branch = *found->second;
+  for (size_t i=0; i<branch.counts.size() && i<counts.size(); i++) counts.at(i)->Add(branch.counts.at(i));
+  for (size_t i=0; i<branch.sums.size() && i<sums.size(); i++) sums.at(i)->Add(branch.sums.at(i));
+  for (size_t i=0; i<branch.sumsOfSquares.size() && i<sumsOfSquares.size(); i++) sumsOfSquares.at(i)->Add(branch.sumsOfSquares.at(i));
+  problems.lengthMismatch += branch.problems.lengthMismatch;
+  problems.unparseable += branch.problems.unparseable;
+  problems.offMap += branch.problems.offMap;
+  return true;
+}
+
+// Throw away the events fed so far, keeping the branches, to start a new stretch of data
+void ValidationFeed::Clear()
+{
+  for (FeedBranch *branch : branches)
+  {
+    DeleteAccumulators(*branch);
+    MakeAccumulators(*branch);
+  }
+  nEvents = 0;
+  ResetEvent();
+}
@@ -0,0 +1,103 @@
+#ifndef VALIDATION_FEED_H
+#define VALIDATION_FEED_H
+
+// Standard Library
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+// ROOT
+#include "TH1.h"
+#include "TH2.h"
+
+// What can be wrong with an event's hits
+#include "ValidationPipeline.h"
+
+using namespace std;
+
+/**
+ *  A block of events to push into a ValidationFeed in one go. Each branch is one column.
+ *  An h_ branch has one value per event. For the t_, c_, tm_ and cm_ branches, the hits of
+ *  all the events are one after another, and offsets[branch] says where each event starts:
+ *  nEvents+1 numbers, so event i's hits are [offsets[i], offsets[i+1])
+ */
+struct FeedBlock
+{
+  size_t nEvents=0;
+  map<string, vector<double> > values; // h_, tm_ and cm_ branches
+  map<string, vector<int> > trackerHits; // t_ branches, encoded locations
+  map<string, vector<string> > caloHits; // c_ branches, geometry ID strings
+  map<string, vector<size_t> > offsets;
+};
+
+/**
+ *  Feeds events to the validation straight from a processing module, without writing an
+ *  ntuple and reading it back. Declare the branches, as they would be named in the ntuple,
+ *  then push events one at a time or in blocks. Each event is added to the histograms and
+ *  maps of its branches as soon as it is complete, and then forgotten, so memory doesn't
+ *  grow however long the feed runs. A ValidationSession can validate what has been
+ *  accumulated at any point, as often as wanted; Clear() starts again with no events
+ */
+class ValidationFeed
+{
+public:
+  ValidationFeed();
+  ~ValidationFeed();
+  bool AddBranch(string branchName, int nBins=0, double low=0, double high=0);
+  // One event at a time; anything not set in an event is 0, or has no hits
+  bool SetValue(string branchName, double value);
+  bool AddTrackerHit(string branchName, int encodedLocation);
+  bool AddCaloHit(string branchName, string geomId);
+  bool AddAverageValue(string branchName, double value);
+  void EndEvent();
+  // Many events at once
+  bool PushBlock(const FeedBlock &block);
+  Long64_t GetEntries() const { return nEvents; }
+  void Clear();
+  // What has been accumulated, for the validation
+  vector<string> GetBranchNames() const;
+  bool HasBranch(string branchName) const { return branchesByName.count(branchName) > 0; }
+  TH1D *CopyHistogram(string branchName) const;
+  bool AddMap(string branchName, const vector<TH2D*> &counts, const vector<TH2D*> &sums, const vector<TH2D*> &sumsOfSquares, HitProblems &problems) const;
+
+private:
+  struct FeedBranch
+  {
+    string name;
+    char type; // The prefix: 'h', 't', 'c', or 'm' for tm_ and cm_
+    bool isTracker=false; // For the maps and averages
+    FeedBranch *mapBranch=0; // For an average, the branch with the hits its values go with
+    int nBins=0; // For an h_ branch: 0 to take the range from the first values
+    double low=0;
+    double high=0;
+    // Everything accumulated so far
+    TH1D *hist=0; // h_ branches
+    vector<TH2D*> counts; // Hits in each cell: one map for the tracker, one for each calorimeter wall
+    vector<TH2D*> sums; // For averages, the sum of the values in each cell
+    vector<TH2D*> sumsOfSquares; // And of their squares
+    HitProblems problems;
+    // The event being filled
+    double scalar=0;
+    vector<int> trackerHits;
+    vector<string> caloHits;
+    vector<double> values;
+    // The hits of a map branch in this event, once they have been placed
+    vector<int> walls; // -1 for a hit that isn't on the map
+    vector<int> xs;
+    vector<int> ys;
+  };
+  FeedBranch *FindBranch(string branchName, char type);
+  void MakeAccumulators(FeedBranch &branch);
+  void DeleteAccumulators(FeedBranch &branch);
+  void PlaceHits(FeedBranch &branch);
+  void AddAverages(FeedBranch &branch);
+  void ResetEvent();
+  bool CheckColumn(const FeedBlock &block, const FeedBranch &branch, size_t columnSize, bool hasColumn);
+
+  Long64_t nEvents;
+  vector<FeedBranch*> branches;
+  map<string, FeedBranch*> branchesByName;
+};
+
+#endif
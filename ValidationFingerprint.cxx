@@ -0,0 +1,76 @@
+#include "ValidationFingerprint.h"
+
+// 64-bit FNV-1a: quick, and plenty to tell whether data has changed (this isn't for security)
+unsigned long long FNV_OFFSET=14695981039346656037ULL;
+unsigned long long FNV_PRIME=1099511628211ULL;
+
+unsigned long long HashBytes(const char *data, Long64_t length, unsigned long long hash)
+{
+  for (Long64_t i=0;i<length;i++)
+  {
+    hash ^= (unsigned char)data[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+// A fingerprint of a string, as 16 hex digits
+string FingerprintString(string input)
+{
+  ostringstream out;
+  out<<hex<<setw(16)<<setfill('0')<<HashBytes(input.c_str(), input.length(), FNV_OFFSET);
+  return out.str();
+}
+
+/**
+ *  A fingerprint of the contents of a branch, taken from its baskets as they are stored in the
+ *  file: the compressed data is hashed without being unzipped or decoded. Each basket's key
+ *  header is left out, as it has the time the file was written, so a branch rewritten with the
+ *  same contents (and compression) has the same fingerprint.
+ *  Returns an empty string if there is no branch, or its baskets aren't all in the file
+ */
+string BranchFingerprint(TTree *inputTree, string branchName)
+{
+  TBranch *branch = inputTree->GetBranch(branchName.c_str());
+  if (branch==0) return "";
+  unsigned long long hash = FNV_OFFSET;
+  string description = Form("%s %s %lld", branchName.c_str(), branch->GetTitle(), branch->GetEntries());
+  hash = HashBytes(description.c_str(), description.length(), hash);
+  if (!AddBranchToFingerprint(branch, hash)) return "";
+  ostringstream out;
+  out<<hex<<setw(16)<<setfill('0')<<hash;
+  return out.str();
+}
+
+// Add the stored baskets of a branch, and of any branches inside it, to a fingerprint
+bool AddBranchToFingerprint(TBranch *branch, unsigned long long &hash)
+{
+  TFile *file = branch->GetFile();
+  if (file==0) return false;
+  Int_t *basketBytes = branch->GetBasketBytes();
+  Long64_t *basketEntry = branch->GetBasketEntry();
+  vector<char> buffer;
+  for (Int_t i=0;i<branch->GetWriteBasket();i++)
+  {
+    Long64_t seek = branch->GetBasketSeek(i);
+    Int_t bytes = basketBytes[i];
+    if (seek<=0 || bytes<=0) return false; // Not written to the file
+    buffer.resize(bytes);
+    if (file->ReadBuffer(buffer.data(), seek, bytes)) return false; // true means it failed
+    // The key header's length is 14 bytes in, after the total size, version, object size and date
+    if (bytes < 16) return false;
+    Int_t keyLength = ((unsigned char)buffer[14] << 8) | (unsigned char)buffer[15];
+    if (keyLength > bytes) return false;
+    hash = HashBytes((char*)&basketEntry[i], sizeof(Long64_t), hash);
+    hash = HashBytes(buffer.data() + keyLength, bytes - keyLength, hash);
+  }
+  TObjArray *subBranches = branch->GetListOfBranches();
+  // A basket that was never written out (the tree wasn't closed properly) can't be fingerprinted
+  bool hasSubBranches = (subBranches && subBranches->GetEntriesFast() > 0);
+  if (!hasSubBranches && branch->GetEntries() > 0 && (branch->GetWriteBasket()==0 || basketEntry[branch->GetWriteBasket()] < branch->GetEntries())) return false;
+  for (int i=0; subBranches && i<subBranches->GetEntriesFast(); i++)
+  {
+    if (!AddBranchToFingerprint((TBranch*)subBranches->At(i), hash)) return false;
+  }
+  return true;
+}
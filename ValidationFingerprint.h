@@ -0,0 +1,24 @@
+#ifndef VALIDATION_FINGERPRINT_H
+#define VALIDATION_FINGERPRINT_H
+
+// Standard Library
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+// ROOT
+#include "TFile.h"
+#include "TTree.h"
+#include "TBranch.h"
+#include "TObjArray.h"
+
+using namespace std;
+
+unsigned long long HashBytes(const char *data, Long64_t length, unsigned long long hash);
+string FingerprintString(string input);
+string BranchFingerprint(TTree *inputTree, string branchName);
+bool AddBranchToFingerprint(TBranch *branch, unsigned long long &hash);
+
+#endif
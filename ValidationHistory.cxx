@@ -0,0 +1,276 @@
+#include "ValidationHistory.h"
+#include "ValidationResults.h" // for CSVField
+
+// Need at least this many earlier runs with a value before we look for drift in it
+int MIN_HISTORY_RUNS=3;
+
+// The summary numbers from this run, to add to the history
+vector<HistoryValue> historyValues;
+
+// One run in the history file, and where its values are in the Values tree
+struct HistoryRun
+{
+  Int_t run;
+  Long64_t time;
+  string hash;
+  Long64_t firstValue;
+  Long64_t nValues;
+};
+
+// Running totals for one value over the runs in the window
+struct WindowTotals
+{
+  int n=0;
+  double sum=0;
+  double sumSquares=0;
+};
+
+void AddHistoryValue(string branch, string quantity, double value, double error)
+{
+  if (std::isnan(value) || std::isinf(value)) return;
+  HistoryValue entry;
+  entry.branch = branch;
+  entry.quantity = quantity;
+  entry.value = value;
+  entry.error = (std::isnan(error) || std::isinf(error))?0:error;
+  historyValues.push_back(entry);
+}
+
+const vector<HistoryValue> &GetHistoryValues()
+{
+  return historyValues;
+}
+
+// Forget this run's values, before validating another sample
+void ClearHistoryValues()
+{
+  historyValues.clear();
+}
+
+/**
+ *  Compare this run's values with the last few runs in the history file, then add this run to it.
+ *
+ *  The history is three trees in a ROOT file:
+ *  Runs   - one entry per run: number, time, sample hash and file, and the range of entries it has in Values
+ *  Keys   - one entry per distinct value: its number, branch and quantity
+ *  Values - one entry per value per run: run number, key number, value and uncertainty
+ *  Each run's values are contiguous in Values, so the window only reads the entries for the runs in it,
+ *  and never the old ntuples. A sample that is already in the history (same hash) is not added again,
+ *  and isn't part of its own window.
+ *
+ *  window: how many earlier runs to compare with
+ *  threshold: flag values more than this many standard deviations from the window mean
+ */
+bool UpdateHistory(string historyFileName, string sampleFile, string sampleHash, Long64_t entries, int window, double threshold, vector<DriftResult> &drifts)
+{
+  TDirectory *current = gDirectory;
+  TFile *historyFile = new TFile(historyFileName.c_str(),"UPDATE");
+  if (historyFile->IsZombie())
+  {
+    cout<<"WARNING: could not open history file "<<historyFileName<<endl;
+    current->cd();
+    return false;
+  }
+  historyFile->cd();
+
+  // Get the trees, or make them if this is a new history
+  Int_t run=0;
+  Long64_t time=0;
+  string *hash = new string();
+  string *file = new string();
+  Long64_t runEntries=0;
+  Long64_t firstValue=0;
+  Long64_t nValues=0;
+  Int_t key=0;
+  string *branch = new string();
+  string *quantity = new string();
+  Double_t value=0;
+  Double_t error=0;
+
+  TTree *runTree = (TTree*)historyFile->Get("Runs");
+  TTree *keyTree = (TTree*)historyFile->Get("Keys");
+  TTree *valueTree = (TTree*)historyFile->Get("Values");
+  if (runTree==0 || keyTree==0 || valueTree==0)
+  {
+    runTree = new TTree("Runs","Validation runs");
+    runTree->Branch("run",&run,"run/I");
+    runTree->Branch("time",&time,"time/L");
+    runTree->Branch("hash",&hash);
+    runTree->Branch("file",&file);
+    runTree->Branch("entries",&runEntries,"entries/L");
+    runTree->Branch("firstValue",&firstValue,"firstValue/L");
+    runTree->Branch("nValues",&nValues,"nValues/L");
+
+    keyTree = new TTree("Keys","Summary values");
+    keyTree->Branch("key",&key,"key/I");
+    keyTree->Branch("branch",&branch);
+    keyTree->Branch("quantity",&quantity);
+
+    valueTree = new TTree("Values","Summary values for each run");
+    valueTree->Branch("run",&run,"run/I");
+    valueTree->Branch("key",&key,"key/I");
+    valueTree->Branch("value",&value,"value/D");
+    valueTree->Branch("error",&error,"error/D");
+  }
+  else
+  {
+    runTree->SetBranchAddress("run",&run);
+    runTree->SetBranchAddress("time",&time);
+    runTree->SetBranchAddress("hash",&hash);
+    runTree->SetBranchAddress("file",&file);
+    runTree->SetBranchAddress("entries",&runEntries);
+    runTree->SetBranchAddress("firstValue",&firstValue);
+    runTree->SetBranchAddress("nValues",&nValues);
+    keyTree->SetBranchAddress("key",&key);
+    keyTree->SetBranchAddress("branch",&branch);
+    keyTree->SetBranchAddress("quantity",&quantity);
+    valueTree->SetBranchAddress("run",&run);
+    valueTree->SetBranchAddress("key",&key);
+    valueTree->SetBranchAddress("value",&value);
+    valueTree->SetBranchAddress("error",&error);
+  }
+
+  // Which number goes with which branch and quantity
+  map<pair<string,string>,int> keys;
+  for (Long64_t i=0;i<keyTree->GetEntries();i++)
+  {
+    keyTree->GetEntry(i);
+    keys[make_pair(*branch,*quantity)] = key;
+  }
+
+  // The runs so far, oldest first
+  vector<HistoryRun> runs;
+  bool alreadyStored=false;
+  for (Long64_t i=0;i<runTree->GetEntries();i++)
+  {
+    runTree->GetEntry(i);
+    HistoryRun thisRun;
+    thisRun.run = run;
+    thisRun.time = time;
+    thisRun.hash = *hash;
+    thisRun.firstValue = firstValue;
+    thisRun.nValues = nValues;
+    runs.push_back(thisRun);
+    if (*hash == sampleHash) alreadyStored=true;
+  }
+
+  // Add up each value over the most recent runs, not counting this sample
+  vector<WindowTotals> totals(keys.size());
+  int windowRuns=0;
+  for (int i=runs.size()-1; i>=0 && windowRuns<window; i--)
+  {
+    if (runs.at(i).hash == sampleHash) continue;
+    windowRuns++;
+    for (Long64_t entry=runs.at(i).firstValue; entry<runs.at(i).firstValue+runs.at(i).nValues; entry++)
+    {
+      valueTree->GetEntry(entry);
+      if (key<0 || key>=totals.size()) continue;
+      totals.at(key).n++;
+      totals.at(key).sum += value;
+      totals.at(key).sumSquares += value * value;
+    }
+  }
+
+  // Compare this run with them
+  drifts.clear();
+  int nFlagged=0;
+  for (int i=0;i<historyValues.size();i++)
+  {
+    const HistoryValue &thisValue = historyValues.at(i);
+    DriftResult result;
+    result.branch = thisValue.branch;
+    result.quantity = thisValue.quantity;
+    result.value = thisValue.value;
+    result.error = thisValue.error;
+    map<pair<string,string>,int>::iterator found = keys.find(make_pair(thisValue.branch,thisValue.quantity));
+    if (found != keys.end() && totals.at(found->second).n >= MIN_HISTORY_RUNS)
+    {
+      const WindowTotals &total = totals.at(found->second);
+      result.windowRuns = total.n;
+      result.windowMean = total.sum / total.n;
+      double variance = (total.sumSquares / total.n - result.windowMean * result.windowMean) * total.n / (total.n - 1);
+      result.windowRMS = TMath::Sqrt(max(variance,0.));
+      // Allow for the spread over the window and the uncertainty on this run's value
+      double sigma = TMath::Sqrt(result.windowRMS * result.windowRMS + result.error * result.error);
+      if (sigma > 0)
+      {
+        result.drift = (result.value - result.windowMean) / sigma;
+        result.flagged = (TMath::Abs(result.drift) > threshold);
+      }
+      else if (result.value != result.windowMean)
+      {
+        result.drift = INFINITY; // It has always been exactly the same until now
+        result.flagged = true;
+      }
+      else result.drift = 0;
+    }
+    if (result.flagged) nFlagged++;
+    drifts.push_back(result);
+  }
+  cout<<"History: compared "<<historyValues.size()<<" values with the last "<<windowRuns<<" runs in "<<historyFileName<<"; "<<nFlagged<<" have drifted by more than "<<threshold<<" sigma"<<endl;
+
+  // Add this run, unless this sample is already there
+  if (alreadyStored)
+  {
+    cout<<"History: this sample is already in "<<historyFileName<<", so it is not added again"<<endl;
+  }
+  else
+  {
+    run = runs.empty()?1:runs.back().run+1;
+    firstValue = valueTree->GetEntries();
+    for (int i=0;i<historyValues.size();i++)
+    {
+      pair<string,string> name = make_pair(historyValues.at(i).branch,historyValues.at(i).quantity);
+      map<pair<string,string>,int>::iterator found = keys.find(name);
+      if (found == keys.end())
+      {
+        key = keys.size();
+        *branch = name.first;
+        *quantity = name.second;
+        keyTree->Fill();
+        keys[name] = key;
+      }
+      else key = found->second;
+      value = historyValues.at(i).value;
+      error = historyValues.at(i).error;
+      valueTree->Fill();
+    }
+    nValues = historyValues.size();
+    time = std::time(0);
+    *hash = sampleHash;
+    *file = sampleFile;
+    runEntries = entries;
+    runTree->Fill();
+    runTree->Write("",TObject::kOverwrite);
+    keyTree->Write("",TObject::kOverwrite);
+    valueTree->Write("",TObject::kOverwrite);
+    cout<<"History: added run "<<run<<" to "<<historyFileName<<endl;
+  }
+  historyFile->Close();
+  delete hash;
+  delete file;
+  delete branch;
+  delete quantity;
+  current->cd();
+  return true;
+}
+
+// Write every value from this run with how far it is from the recent runs
+bool WriteDriftCSV(string fileName, const vector<DriftResult> &drifts)
+{
+  ofstream driftFile(fileName.c_str());
+  if (!driftFile)
+  {
+    cout<<"WARNING: could not write drift results to "<<fileName<<endl;
+    return false;
+  }
+  driftFile<<setprecision(8);
+  driftFile<<"branch,quantity,value,error,window_runs,window_mean,window_rms,drift,flagged"<<"\n";
+  for (int i=0;i<drifts.size();i++)
+  {
+    const DriftResult &result = drifts.at(i);
+    driftFile<<CSVField(result.branch)<<","<<CSVField(result.quantity)<<","<<result.value<<","<<result.error<<",";
+    driftFile<<result.windowRuns<<","<<result.windowMean<<","<<result.windowRMS<<","<<result.drift<<","<<(result.flagged?1:0)<<"\n";
+  }
+  return true;
+}
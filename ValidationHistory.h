@@ -0,0 +1,53 @@
+#ifndef VALIDATION_HISTORY_H
+#define VALIDATION_HISTORY_H
+
+// Standard Library
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+
+// ROOT
+#include "TFile.h"
+#include "TTree.h"
+#include "TDirectory.h"
+#include "TMath.h"
+
+using namespace std;
+
+// One summary number from this run: a statistic for a whole branch, or the value in one cell of a map
+struct HistoryValue
+{
+  string branch;
+  string quantity; // e.g. "mean", "hits per event" or a detector location
+  double value;
+  double error;
+};
+
+// How one value from this run compares with the same value in the recent runs
+struct DriftResult
+{
+  string branch;
+  string quantity;
+  double value;
+  double error;
+  int windowRuns=0; // Earlier runs in the window that had this value
+  double windowMean=NAN;
+  double windowRMS=NAN;
+  double drift=NAN; // Difference from the window mean, in standard deviations
+  bool flagged=false;
+};
+
+void AddHistoryValue(string branch, string quantity, double value, double error);
+const vector<HistoryValue> &GetHistoryValues();
+void ClearHistoryValues();
+bool UpdateHistory(string historyFileName, string sampleFile, string sampleHash, Long64_t entries, int window, double threshold, vector<DriftResult> &drifts);
+bool WriteDriftCSV(string fileName, const vector<DriftResult> &drifts);
+
+#endif
@@ -0,0 +1,134 @@
+#include "ValidationHitIndex.h"
+
+const char HIT_INDEX_MAGIC[8]={'S','N','H','I','T','I','D','X'};
+Long64_t HIT_INDEX_VERSION=2;
+
+// The next 8-byte boundary
+Long64_t Align8(Long64_t position)
+{
+  return (position + 7) / 8 * 8;
+}
+
+/**
+ *  Map an index file into memory. Returns 0 if it doesn't exist, or isn't a complete index
+ *  of this version; the caller then makes a new one
+ */
+HitIndex *OpenHitIndex(string fileName)
+{
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(HitIndexHeader))
+  {
+    close(fd);
+    return 0;
+  }
+  size_t bytes = info.st_size;
+  void *mapping = mmap(0, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the file open
+  if (mapping == MAP_FAILED) return 0;
+
+  const HitIndexHeader *header = (const HitIndexHeader*)mapping;
+  const char *start = (const char*)mapping;
+  bool good = (memcmp(header->magic, HIT_INDEX_MAGIC, 8)==0 && header->version==HIT_INDEX_VERSION);
+  good = good && header->nEvents >= 0 && header->nHits >= 0;
+  good = good && header->cellsStart + header->nHits * (Long64_t)sizeof(Int_t) <= (Long64_t)bytes;
+  good = good && header->offsetsStart + (header->nEvents + 1) * (Long64_t)sizeof(Long64_t) <= (Long64_t)bytes;
+  good = good && header->problemsStart + header->nEvents * (Long64_t)sizeof(UChar_t) <= (Long64_t)bytes;
+  good = good && (header->valuesStart==0 || header->valuesStart + header->nHits * (Long64_t)sizeof(double) <= (Long64_t)bytes);
+  if (!good)
+  {
+    cout<<"WARNING: "<<fileName<<" isn't a hit index this version can read; it will be made again"<<endl;
+    munmap(mapping, bytes);
+    return 0;
+  }
+  HitIndex *index = new HitIndex;
+  index->nEvents = header->nEvents;
+  index->nHits = header->nHits;
+  index->offsets = (const Long64_t*)(start + header->offsetsStart);
+  index->cells = (const Int_t*)(start + header->cellsStart);
+  index->values = header->valuesStart?(const double*)(start + header->valuesStart):0;
+  index->problems = (const UChar_t*)(start + header->problemsStart);
+  index->mapping = mapping;
+  index->mappedBytes = bytes;
+  if (index->offsets[index->nEvents] != index->nHits)
+  {
+    cout<<"WARNING: "<<fileName<<" is not a complete hit index; it will be made again"<<endl;
+    CloseHitIndex(index);
+    return 0;
+  }
+  return index;
+}
+
+void CloseHitIndex(HitIndex *index)
+{
+  if (index==0) return;
+  munmap(index->mapping, index->mappedBytes);
+  delete index;
+}
+
+HitIndexWriter::HitIndexWriter(string fileName, bool hasValues)
+{
+  finalName = fileName;
+  tempName = fileName + Form(".%d.tmp", (int)getpid()); // Each process writes its own
+  valuesName = tempName + ".values";
+  withValues = hasValues;
+  offsets.push_back(0);
+  cellsOut.open(tempName.c_str(), ios::binary | ios::trunc);
+  if (withValues) valuesOut.open(valuesName.c_str(), ios::binary | ios::trunc);
+  valid = cellsOut.good() && (!withValues || valuesOut.good());
+  if (!valid)
+  {
+    cout<<"WARNING: could not write hit index "<<finalName<<endl;
+    cellsOut.close();
+    valuesOut.close();
+    remove(tempName.c_str());
+    remove(valuesName.c_str());
+    return;
+  }
+  HitIndexHeader header; // Filled in when we know the sizes
+  memset(&header, 0, sizeof(header));
+  cellsOut.write((const char*)&header, sizeof(header));
+}
+
+// Add the values and offsets after the cells, fill in the header, and put the file in place
+bool HitIndexWriter::Finish()
+{
+  if (!valid) return false;
+  HitIndexHeader header;
+  memcpy(header.magic, HIT_INDEX_MAGIC, 8);
+  header.version = HIT_INDEX_VERSION;
+  header.nEvents = offsets.size() - 1;
+  header.nHits = nHits;
+  header.cellsStart = sizeof(HitIndexHeader);
+  Long64_t position = header.cellsStart + nHits * sizeof(Int_t);
+  const char padding[8] = {0,0,0,0,0,0,0,0};
+  cellsOut.write(padding, Align8(position) - position);
+  position = Align8(position);
+  header.valuesStart = 0;
+  if (withValues)
+  {
+    valuesOut.close();
+    ifstream valuesIn(valuesName.c_str(), ios::binary);
+    if (nHits > 0) cellsOut<<valuesIn.rdbuf();
+    valuesIn.close();
+    remove(valuesName.c_str());
+    header.valuesStart = position;
+    position += nHits * sizeof(double);
+  }
+  header.offsetsStart = position;
+  cellsOut.write((const char*)offsets.data(), offsets.size() * sizeof(Long64_t));
+  position += offsets.size() * sizeof(Long64_t);
+  header.problemsStart = position;
+  cellsOut.write((const char*)problems.data(), problems.size() * sizeof(UChar_t));
+  cellsOut.seekp(0);
+  cellsOut.write((const char*)&header, sizeof(header));
+  cellsOut.close();
+  if (cellsOut.fail() || rename(tempName.c_str(), finalName.c_str()) != 0)
+  {
+    cout<<"WARNING: could not write hit index "<<finalName<<endl;
+    remove(tempName.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,100 @@
+#ifndef VALIDATION_HIT_INDEX_H
+#define VALIDATION_HIT_INDEX_H
+
+// Standard Library
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// ROOT
+#include "Rtypes.h"
+#include "TString.h"
+
+using namespace std;
+
+/**
+ *  A sidecar file with the hits of a map branch already decoded, so a file that is validated
+ *  again doesn't have to have its locations read and decoded again. It has one entry for each
+ *  entry of the tree, selected or not, in flat columns that are used straight from the file
+ *  through a memory map:
+ *    header
+ *    cells:    nHits Int_t, the dense cell number of each hit (-1 if it isn't on the map)
+ *    values:   nHits double, the value to average at each hit (only for average branches)
+ *    offsets:  nEvents+1 Long64_t, so entry i's hits are [offsets[i], offsets[i+1])
+ *    problems: nEvents UChar_t, what was wrong with each entry's hits (HIT_ bits)
+ *  Each column starts on an 8-byte boundary
+ */
+struct HitIndexHeader
+{
+  char magic[8];
+  Long64_t version;
+  Long64_t nEvents;
+  Long64_t nHits;
+  Long64_t offsetsStart; // Where each column starts, in bytes from the start of the file
+  Long64_t cellsStart;
+  Long64_t valuesStart; // 0 if there are no values
+  Long64_t problemsStart;
+};
+
+// An index file, mapped into memory. The columns point into the mapping
+struct HitIndex
+{
+  Long64_t nEvents=0;
+  Long64_t nHits=0;
+  const Long64_t *offsets=0;
+  const Int_t *cells=0;
+  const double *values=0;
+  const UChar_t *problems=0;
+  void *mapping=0;
+  size_t mappedBytes=0;
+};
+
+HitIndex *OpenHitIndex(string fileName);
+void CloseHitIndex(HitIndex *index);
+
+/**
+ *  Writes an index file an event at a time, without holding the hits in memory: the cells
+ *  go straight to the file, and the values to a second file that is copied in at the end.
+ *  It is written under a temporary name and renamed when it is complete, so a run that
+ *  stops part way through, or another run reading at the same time, never sees half a file
+ */
+class HitIndexWriter
+{
+public:
+  HitIndexWriter(string fileName, bool hasValues);
+  bool IsValid() const { return valid; }
+  void AddHit(int cell, double value=0)
+  {
+    Int_t cellId = cell;
+    cellsOut.write((const char*)&cellId, sizeof(cellId));
+    if (withValues) valuesOut.write((const char*)&value, sizeof(value));
+    nHits++;
+  }
+  void EndEvent(int eventProblems)
+  {
+    offsets.push_back(nHits);
+    problems.push_back(eventProblems);
+  }
+  bool Finish();
+
+private:
+  string finalName;
+  string tempName;
+  string valuesName;
+  bool withValues;
+  bool valid;
+  ofstream cellsOut;
+  ofstream valuesOut;
+  vector<Long64_t> offsets;
+  vector<UChar_t> problems;
+  Long64_t nHits=0;
+};
+
+#endif
@@ -0,0 +1,336 @@
+#include "ValidationMain.h"
+
+/**
+ *  main function
+ * Arguments are <root file> <config file (optional)>
+ */
+int main(int argc, char **argv)
+{
+  gErrorIgnoreLevel = kWarning;
+  if (argc < 2)
+  {
+    PrintUsage(argv[0]);
+    return -1;
+  }
+  // This bit is kept for compatibility with old version that would take just a root file name and a config file name
+  string dataFileInput="";
+  vector<string> referenceFileInputs;
+  ValidationOptions options;
+  if (argc == 2 && argv[1][0]!= '-')
+  {
+    dataFileInput = argv[1];
+  }
+  else if (argc == 3 && argv[1][0]!= '-')
+  {
+    dataFileInput = argv[1];
+    options.configFile = (argv[2]);
+  }
+  else
+  {
+    int flag=0;
+    // Long versions of the quick-look sampling options
+    static struct option longOptions[] =
+    {
+      {"help",            no_argument,       0, 'h'},
+      {"max-entries",     required_argument, 0, 'n'},
+      {"prescale",        required_argument, 0, 'p'},
+      {"sample-fraction", required_argument, 0, 'f'},
+      {"seed",            required_argument, 0, 's'},
+      {"trace",           required_argument, 0, 'T'},
+      {"reference-cache", required_argument, 0, 'R'},
+      {"history",         required_argument, 0, 'H'},
+      {"history-window",  required_argument, 0, 'W'},
+      {"reuse-unchanged", no_argument,       0, 'U'},
+      {"cut",             required_argument, 0, 'C'},
+      {"weight",          required_argument, 0, 'w'},
+      {"cell-distributions", required_argument, 0, 'D'},
+      {"time-branch",     required_argument, 0, 'B'},
+      {"time-slices",     required_argument, 0, 'S'},
+      {"pipeline",        required_argument, 0, 'P'},
+      {"threads",         required_argument, 0, 'j'},
+      {"memory-limit",    required_argument, 0, 'm'},
+      {"hit-index",       required_argument, 0, 'X'},
+      {"toys",            required_argument, 0, 'y'},
+      {0, 0, 0, 0}
+    };
+    while ((flag = getopt_long (argc, argv, "h-i:r:c:t:o:n:p:f:s:", longOptions, 0)) != -1)
+    {
+      switch (flag)
+      {
+        case 'h':
+        case '-':
+          PrintUsage(argv[0]);
+          return 1;
+          break;
+        case 'i':
+          dataFileInput = optarg;
+          break;
+        case 'r':
+        {
+          // Can be given more than once, or as a comma-separated list
+          string refList=optarg;
+          vector<string> refNames;
+          boost::split(refNames, refList, boost::is_any_of(","));
+          for (int i=0;i<refNames.size();i++)
+          {
+            boost::trim(refNames.at(i));
+            if (refNames.at(i).length()>0) referenceFileInputs.push_back(refNames.at(i));
+          }
+          break;
+        }
+        case 'c':
+          options.configFile = optarg;
+          break;
+        case 'o':
+          options.plotDir = optarg;
+          break;
+        case 't':
+          options.tempDir = optarg;
+          break;
+        case 'n':
+          try
+          {
+            options.maxEntries = std::stoll(optarg);
+          }
+          catch (exception &e)
+          {
+            options.maxEntries = -2;
+          }
+          if (options.maxEntries < -1)
+          {
+            cout<<"ERROR: --max-entries needs a number of entries, or -1 for all of them, not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 'p':
+          try
+          {
+            options.prescale = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            options.prescale = 0;
+          }
+          if (options.prescale < 1)
+          {
+            cout<<"ERROR: --prescale needs a positive whole number, not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 'f':
+          try
+          {
+            options.sampleFraction = std::stod(optarg);
+          }
+          catch (exception &e)
+          {
+            options.sampleFraction = -1;
+          }
+          if (options.sampleFraction <= 0 || options.sampleFraction > 1)
+          {
+            cout<<"ERROR: --sample-fraction must be greater than 0 and at most 1, not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 's':
+          try
+          {
+            options.sampleSeed = std::stoul(optarg);
+          }
+          catch (exception &e)
+          {
+            cout<<"ERROR: --seed needs a whole number, not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 'T':
+          options.traceFile = optarg;
+          break;
+        case 'R':
+          options.referenceCache = optarg;
+          break;
+        case 'H':
+          options.historyFile = optarg;
+          break;
+        case 'U':
+          options.reuseUnchanged = true;
+          break;
+        case 'C':
+          options.cut = optarg;
+          break;
+        case 'w':
+          options.weight = optarg;
+          break;
+        case 'D':
+          try
+          {
+            options.cellDistributionBins = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            options.cellDistributionBins = 0;
+          }
+          if (options.cellDistributionBins < 1)
+          {
+            cout<<"ERROR: --cell-distributions needs a positive number of bins, not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 'B':
+          options.timeBranch = optarg;
+          break;
+        case 'S':
+          try
+          {
+            options.timeSlices = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            options.timeSlices = 0;
+          }
+          if (options.timeSlices < 2)
+          {
+            cout<<"ERROR: --time-slices needs at least 2 intervals, not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 'P':
+          try
+          {
+            options.pipelineThreads = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            options.pipelineThreads = -1;
+          }
+          if (options.pipelineThreads < 0)
+          {
+            cout<<"ERROR: --pipeline needs a number of decoding threads (0 for none), not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 'j':
+          try
+          {
+            options.threads = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            options.threads = -1;
+          }
+          if (options.threads < 0)
+          {
+            cout<<"ERROR: --threads needs a number of threads (0 for one per core), not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 'm':
+          try
+          {
+            options.memoryLimitMB = std::stol(optarg);
+          }
+          catch (exception &e)
+          {
+            options.memoryLimitMB = 0;
+          }
+          if (options.memoryLimitMB < 1)
+          {
+            cout<<"ERROR: --memory-limit needs a positive number of MB, not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 'X':
+          options.hitIndexDir = optarg;
+          break;
+        case 'y':
+          try
+          {
+            options.toys = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            options.toys = 0;
+          }
+          if (options.toys < 1)
+          {
+            cout<<"ERROR: --toys needs a positive number of toys, not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case 'W':
+          try
+          {
+            options.historyWindow = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            options.historyWindow = 0;
+          }
+          if (options.historyWindow < 1)
+          {
+            cout<<"ERROR: --history-window needs a positive whole number, not "<<optarg<<endl;
+            return 1;
+          }
+          break;
+        case '?':
+          if (optopt == 'i' || optopt == 'r' || optopt == 'c' || optopt == 't' || optopt == 'o' || optopt == 'n' || optopt == 'p' || optopt == 'f' || optopt == 's')
+            fprintf (stderr, "Option -%c requires an argument.\n", optopt);
+          else if (isprint (optopt))
+            fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+          else
+            fprintf (stderr,
+                     "Unknown option character `\\x%x'.\n",
+                     optopt);
+          PrintUsage(argv[0]);
+          return 1;
+        default:
+          abort ();
+      }
+    }
+  }
+
+  if (dataFileInput.length()<=0)
+  {
+    cout<<"ERROR: Data file name is needed."<<endl;
+    PrintUsage(argv[0]);
+    return -1;
+  }
+  // Everything else is done by the library
+  ValidationSession session(options);
+  if (referenceFileInputs.size() == 0)
+  {
+    cout<<"WARNING: No reference ROOT file given. To generate comparison plots, provide a valid reference ROOT file."<<endl;
+  }
+  for (int i=0;i<referenceFileInputs.size();i++)
+  {
+    session.AddReference(referenceFileInputs.at(i)); // Any we can't use are skipped
+  }
+  if (!session.Validate(dataFileInput)) return 1;
+  return 0;
+}
+
+void PrintUsage(const char *progName)
+{
+  cout<<"Usage: "<<progName<<" -i <data ROOT file> -r <reference ROOT file (optional)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)>"<<endl;
+  cout<<"To compare with several references in one run, give -r more than once or a comma-separated list"<<endl;
+  cout<<"Quick-look options (applied to sample and reference alike):"<<endl;
+  cout<<"  -n, --max-entries <N>       only use the first N entries of each file"<<endl;
+  cout<<"  -p, --prescale <N>          only use every Nth entry"<<endl;
+  cout<<"  -f, --sample-fraction <x>   randomly keep a fraction x (0 < x <= 1) of entries"<<endl;
+  cout<<"  -s, --seed <N>              seed for the random sampling (default 4357)"<<endl;
+  cout<<"  --cut \"<expression>\"        only use events passing this selection, e.g. \"h_track_count==2\""<<endl;
+  cout<<"  --weight <branch>           weight each event by this branch (or expression), and normalise references by the summed weights"<<endl;
+  cout<<"  --cell-distributions <N>    histogram the values in each cell of tm_ and cm_ maps with N bins, and compare their shapes cell by cell"<<endl;
+  cout<<"  --time-branch <branch>      split the sample's t_ and c_ maps into intervals of this time or run number branch, and check each cell is stable"<<endl;
+  cout<<"  --time-slices <N>           how many intervals to split them into (default 10)"<<endl;
+  cout<<"  --pipeline <N>              read the t_, c_, tm_ and cm_ branches on their own thread, and decode them on N more"<<endl;
+  cout<<"  --threads <N>               let ROOT unzip baskets in parallel, using N threads in all with --pipeline (0 for one per core)"<<endl;
+  cout<<"  --memory-limit <MB>         free each branch's histograms and baskets before the next, to keep memory flat, and report the peak"<<endl;
+  cout<<"  --hit-index <dir>           keep the decoded t_ and c_ hits of each file in dir, so later runs on it don't decode them again"<<endl;
+  cout<<"  --toys <N>                  also work out p-values from N toys, on --threads threads (or one per core)"<<endl;
+  cout<<"  --trace <file>              write a Chrome/Perfetto trace of the run to this JSON file"<<endl;
+  cout<<"  --reference-cache <file>    reuse the reference histograms in this ROOT file, or save them there if it doesn't exist yet"<<endl;
+  cout<<"  --history <file>            add this run's summary values to a history ROOT file, and look for drifts"<<endl;
+  cout<<"  --history-window <N>        compare with the last N runs in the history (default 10)"<<endl;
+  cout<<"  --reuse-unchanged           reuse the last run's outputs in the output directory for branches whose data hasn't changed"<<endl;
+}
@@ -0,0 +1,21 @@
+
+// Standard Library
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <getopt.h>
+#include "boost/algorithm/string.hpp"
+
+// ROOT
+#include "TError.h"
+
+// The validation library
+#include "ValidationSession.h"
+
+using namespace std;
+
+int main(int argc, char **argv);
+void PrintUsage(const char *progName);
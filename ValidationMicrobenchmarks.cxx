@@ -0,0 +1,262 @@
+// Microbenchmarks for the hot inner pieces of ValidationParser, using Google Benchmark.
+// They call the parser's functions in the ValidationCore library
+#include "ValidationParser.h"
+
+#include "benchmark/benchmark.h"
+
+// Representative geometry IDs: mostly main wall hits, some x wall and gamma veto
+vector<string> MakeCaloGeomIDs(int nHits)
+{
+  TRandom3 random(1);
+  vector<string> ids;
+  for (int i=0;i<nHits;i++)
+  {
+    int side = (int)random.Integer(2);
+    double whichType = random.Rndm();
+    if (whichType < 0.8) ids.push_back(Form("[1302:0.%d.%d.%d.*]", side, (int)random.Integer(MAINWALL_WIDTH), (int)random.Integer(MAINWALL_HEIGHT)));
+    else if (whichType < 0.9) ids.push_back(Form("[1232:0.%d.%d.%d.%d.*]", side, (int)random.Integer(2), (int)random.Integer(XWALL_DEPTH/2), (int)random.Integer(XWALL_HEIGHT)));
+    else ids.push_back(Form("[1252:0.%d.%d.%d.*]", side, (int)random.Integer(2), (int)random.Integer(VETO_WIDTH)));
+  }
+  return ids;
+}
+
+// Encoded tracker cells, French side positive and Italian side negative
+vector<int> MakeTrackerCells(int nHits)
+{
+  TRandom3 random(2);
+  vector<int> cells;
+  for (int i=0;i<nHits;i++)
+  {
+    int layer = (int)random.Integer(MAX_TRACKER_LAYERS);
+    int row = (int)random.Integer(MAX_TRACKER_ROWS);
+    if (random.Rndm() < 0.5) cells.push_back(row * 100 + layer);
+    else cells.push_back(-1 * (row * 100 + layer + 1));
+  }
+  return cells;
+}
+
+// A filled tracker map, like the ones TrackerMapHistogram makes
+TH2D *MakeTrackerMap(string name, int seed, int nHits)
+{
+  TRandom3 random(seed);
+  TH2D *h = new TH2D(name.c_str(),name.c_str(),MAX_TRACKER_LAYERS*2,MAX_TRACKER_LAYERS*-1,MAX_TRACKER_LAYERS,MAX_TRACKER_ROWS,0,MAX_TRACKER_ROWS);
+  h->Sumw2();
+  vector<int> cells = MakeTrackerCells(nHits);
+  for (int i=0;i<cells.size();i++)
+  {
+    int x, y;
+    DecodeTrackerHit(cells.at(i), x, y);
+    h->Fill(x, y);
+  }
+  return h;
+}
+
+// A set of 6 calorimeter wall maps, like the ones MakeCaloPlotSet makes
+vector<TH2D*> MakeCaloMaps(string name, int nHits)
+{
+  vector<TH2D*> hists;
+  for (int i=0; i<6; i++)
+  {
+    TH2D *h = new TH2D((name+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
+    h->Sumw2();
+    hists.push_back(h);
+  }
+  vector<string> ids = MakeCaloGeomIDs(nHits);
+  for (int i=0;i<ids.size();i++)
+  {
+    int wall, x, y;
+    if (DecodeCaloHit(ids.at(i), wall, x, y)) hists.at(wall)->Fill(x, y);
+  }
+  return hists;
+}
+
+static void BM_DecodeCaloHit(benchmark::State& state)
+{
+  vector<string> ids = MakeCaloGeomIDs(state.range(0));
+  for (auto _ : state)
+  {
+    int wall, x, y;
+    for (int i=0;i<ids.size();i++)
+    {
+      DecodeCaloHit(ids.at(i), wall, x, y);
+      benchmark::DoNotOptimize(x);
+      benchmark::DoNotOptimize(y);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * ids.size());
+}
+BENCHMARK(BM_DecodeCaloHit)->Arg(1000)->Arg(100000);
+
+static void BM_DecodeTrackerHit(benchmark::State& state)
+{
+  vector<int> cells = MakeTrackerCells(state.range(0));
+  for (auto _ : state)
+  {
+    int x, y;
+    for (int i=0;i<cells.size();i++)
+    {
+      DecodeTrackerHit(cells.at(i), x, y);
+      benchmark::DoNotOptimize(x);
+      benchmark::DoNotOptimize(y);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * cells.size());
+}
+BENCHMARK(BM_DecodeTrackerHit)->Arg(1000)->Arg(100000);
+
+// Decoding plus filling, which is what the tracker map loop does per hit
+static void BM_FillTrackerMap(benchmark::State& state)
+{
+  vector<int> cells = MakeTrackerCells(state.range(0));
+  TH2D *h = new TH2D("bm_fill_tracker","",MAX_TRACKER_LAYERS*2,MAX_TRACKER_LAYERS*-1,MAX_TRACKER_LAYERS,MAX_TRACKER_ROWS,0,MAX_TRACKER_ROWS);
+  h->Sumw2();
+  for (auto _ : state)
+  {
+    int x, y;
+    for (int i=0;i<cells.size();i++)
+    {
+      DecodeTrackerHit(cells.at(i), x, y);
+      h->Fill(x, y);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * cells.size());
+  delete h;
+}
+BENCHMARK(BM_FillTrackerMap)->Arg(100000);
+
+// Filling a 1-D histogram one value at a time, as TTree::Draw does
+static void BM_Fill1D(benchmark::State& state)
+{
+  TRandom3 random(6);
+  vector<double> values(state.range(0));
+  for (size_t i=0;i<values.size();i++) values[i] = random.Gaus(5,2);
+  TH1D *h = new TH1D("bm_fill_1d","",100,0,10);
+  h->Sumw2();
+  for (auto _ : state)
+  {
+    for (size_t i=0;i<values.size();i++) h->Fill(values[i]);
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+  delete h;
+}
+BENCHMARK(BM_Fill1D)->Arg(100000);
+
+// And a block at a time, as BatchFillHistogram does
+static void BM_BinValues(benchmark::State& state)
+{
+  TRandom3 random(6);
+  vector<double> values(state.range(0));
+  for (size_t i=0;i<values.size();i++) values[i] = random.Gaus(5,2);
+  TH1D *h = new TH1D("bm_bin_values","",100,0,10);
+  h->Sumw2();
+  for (auto _ : state)
+  {
+    BulkBins bins;
+    SetupBins(bins, h);
+    for (size_t i=0;i<values.size();i+=BATCH_FILL_BLOCK)
+    {
+      BinValues(values.data()+i, 0, TMath::Min(BATCH_FILL_BLOCK, values.size()-i), bins);
+    }
+    PutBins(bins, h);
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+  delete h;
+}
+BENCHMARK(BM_BinValues)->Arg(100000);
+
+static void BM_ChiSquared1D(benchmark::State& state)
+{
+  TRandom3 random(3);
+  TH1D *h1 = new TH1D("bm_chisq_sample","",state.range(0),0,10);
+  TH1D *h2 = new TH1D("bm_chisq_reference","",state.range(0),0,10);
+  h1->Sumw2();
+  h2->Sumw2();
+  for (int i=0;i<100000;i++)
+  {
+    h1->Fill(random.Gaus(5,2));
+    h2->Fill(random.Gaus(5,2));
+  }
+  for (auto _ : state)
+  {
+    double chisq;
+    int ndf;
+    benchmark::DoNotOptimize(ChiSquared(h1, h2, chisq, ndf, false));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  delete h1;
+  delete h2;
+}
+BENCHMARK(BM_ChiSquared1D)->Arg(100)->Arg(10000);
+
+static void BM_ChiSquaredTrackerMap(benchmark::State& state)
+{
+  TH2D *hSample = MakeTrackerMap("bm_chisq_tracker_sample", 4, 100000);
+  TH2D *hRef = MakeTrackerMap("bm_chisq_tracker_reference", 5, 100000);
+  for (auto _ : state)
+  {
+    double chisq;
+    int ndf;
+    benchmark::DoNotOptimize(ChiSquared(hSample, hRef, chisq, ndf, false));
+  }
+  state.SetItemsProcessed(state.iterations() * hSample->GetNbinsX() * hSample->GetNbinsY());
+  delete hSample;
+  delete hRef;
+}
+BENCHMARK(BM_ChiSquaredTrackerMap);
+
+static void BM_PullPlot2D(benchmark::State& state)
+{
+  TH2D *hSample = MakeTrackerMap("bm_pull_tracker_sample", 6, 100000);
+  TH2D *hRef = MakeTrackerMap("bm_pull_tracker_reference", 7, 100000);
+  for (auto _ : state)
+  {
+    TH2D *hPull = PullPlot2D(hSample, hRef);
+    benchmark::DoNotOptimize(hPull);
+    delete hPull;
+  }
+  state.SetItemsProcessed(state.iterations() * hSample->GetNbinsX() * hSample->GetNbinsY());
+  delete hSample;
+  delete hRef;
+}
+BENCHMARK(BM_PullPlot2D);
+
+// Includes the Gaussian fit and the PNG of the pulls, as in a real run
+static void BM_CheckCaloPulls(benchmark::State& state)
+{
+  vector<TH2D*> vSample = MakeCaloMaps("plt_bm_calo", 20000);
+  vector<TH2D*> vRef = MakeCaloMaps("ref_bm_calo", 20000);
+  vector<TH2D*> vPull = MakeCaloPullPlots(vSample, vRef);
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(CheckCaloPulls(vPull, "Benchmark"));
+  }
+  for (int i=0;i<vPull.size();i++)
+  {
+    delete vSample.at(i);
+    delete vRef.at(i);
+    delete vPull.at(i);
+  }
+}
+BENCHMARK(BM_CheckCaloPulls)->Unit(benchmark::kMillisecond);
+
+int main(int argc, char **argv)
+{
+  gROOT->SetBatch(true);
+  gErrorIgnoreLevel = kError; // Recreating the same histogram names is expected here
+  gStyle->SetOptStat(0);
+
+  // PullPlot2D and the pull checks write histograms, plots and text, so give them somewhere to go
+  plotdir = "microbenchmark_output";
+  boost::filesystem::create_directories(plotdir);
+  TFile *outputFile = new TFile((plotdir+"/MicrobenchmarkHistograms.root").c_str(),"RECREATE");
+  outputFile->cd();
+  textOut.open((plotdir+"/MicrobenchmarkResults.txt").c_str());
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+  benchmark::RunSpecifiedBenchmarks();
+
+  textOut.close();
+  outputFile->Close();
+  return 0;
+}
@@ -1,95 +1,607 @@
 #include "ValidationParser.h"
 
+string treeName="Validation";
+
+// Colour palettes for 1-D histogram comparisons
+int REF_FILL_COLOR=kRed-10;
+int REF_LINE_COLOR=kRed;
+int REF_FILL_STYLE=1001;
+
+// Tracker geometry
+int MAX_TRACKER_LAYERS=9;
+int MAX_TRACKER_ROWS=113;
+
+// Palettes for general plots and for pull plots
+// (where we want different colours for positive and negative values)
+int PALETTE = kBird;
+int PULL_PALETTE=kThermometer;
+
+// For 2-D comparisons - report if the magnitude of the pull
+// (difference between sample and reference) for a cell
+// is more than this many sigma
+double REPORT_PULLS_OVER=3.;
+
+// Only compare the distribution of values in a cell if the sample has at least this many hits there
+double MIN_CELL_DISTRIBUTION_HITS=10;
+
+// When writing a trace, mark the event loops off in chunks of this many entries
+Long64_t TRACE_CHUNK_ENTRIES=10000;
+
+// The map event loops pass entries between their stages in chunks of this many
+Long64_t PIPELINE_CHUNK_ENTRIES=1000;
+// And each queue between the stages holds at most this many chunks
+int PIPELINE_QUEUE_CHUNKS=4;
+
+// 1-D histograms that can't be filled a basket at a time are filled in blocks of this many values
+size_t BATCH_FILL_BLOCK=4096;
+
+// With --memory-limit, the tree caches share this fraction of the limit
+double MEMORY_LIMIT_CACHE_FRACTION=0.125;
+
+// An h_ branch fed without a binning takes its range from its first this-many values
+int FEED_RANGE_VALUES=1000;
+
+// Calorimeter dimensions
+
+int MAINWALL_WIDTH = 20;
+int MAINWALL_HEIGHT = 13;
+int XWALL_DEPTH = 4;
+int XWALL_HEIGHT = 16;
+int VETO_DEPTH = 2;
+int VETO_WIDTH = 16;
+
+// The 6 calorimeter walls, in the order of enum WALL
+string CALO_WALL[6] = {"Italy","France","Tunnel","Mountain","Top","Bottom"};
+int CALO_XBINS[6] = {MAINWALL_WIDTH,MAINWALL_WIDTH,XWALL_DEPTH,XWALL_DEPTH,VETO_WIDTH,VETO_WIDTH};
+int CALO_XLO[6] = {-1*MAINWALL_WIDTH,0,-1 * XWALL_DEPTH/2,-1 * XWALL_DEPTH/2,0,0};
+int CALO_XHI[6] = {0,MAINWALL_WIDTH,XWALL_DEPTH/2,XWALL_DEPTH/2,VETO_WIDTH,VETO_WIDTH};
+int CALO_YBINS[6] = {MAINWALL_HEIGHT,MAINWALL_HEIGHT,XWALL_HEIGHT,XWALL_HEIGHT,VETO_DEPTH,VETO_DEPTH}; // They are all zero to nbins in the y direction
+
 // Global variables
 bool hasConfig=true;
 bool hasValidReference = true;
 TTree *tree;
-TTree *reftree;
+ValidationFeed *sampleFeed=0; // Or the events fed from memory, instead of a tree
+TTree *reftree; // The reference we are comparing with now
+vector<Reference> references; // All the references to compare with
+int currentReference=0;
 map<string,string> configParams;
 string plotdir;
 ofstream textOut;
+RunSummary runSummary; // For the structured results files
+
+// Quick-look sampling: the same selection is applied to sample and reference
+Long64_t maxEntries=-1; // Only look at the first this-many entries (-1 for all)
+int prescale=1; // Only use every Nth entry
+double sampleFraction=1.; // Randomly keep this fraction of entries
+unsigned int sampleSeed=4357; // Seed for the random sampling, so quick looks are reproducible
+
+// Selection cuts: only events passing them are used
+string eventCut=""; // --cut, for every branch
+map<string,string> branchCuts; // Extra cuts for particular branches, from the config file
+map<TTree*,TEntryList*> baseEntryLists; // The entries passing the sampling and --cut, for each tree
+map<pair<TTree*,string>,TEntryList*> cutEntryLists; // And the ones also passing each branch cut
+map<TEntryList*,string> selectionFingerprints;
+
+// Per-event weights: every histogram is filled with them, and references are normalised by their sum
+string weightExpression=""; // --weight, a branch or an expression of branches
+map<TTree*,bool> weightUsable; // Whether the weight could be compiled for each tree
+map<pair<TTree*,TEntryList*>,double> selectedWeights; // Sum of the weights of the entries being used
+
+// Per-cell distributions of the values in average maps
+int cellDistributionBins=0; // --cell-distributions: how many bins, or 0 for none
+
+// Splitting the sample's maps into intervals of time, to see cells that stop working
+string timeBranch=""; // --time-branch, a time or run number
+int timeSlices=10; // --time-slices: how many intervals
+double firstTime=0; // The range of times in the selected sample entries
+double lastTime=0;
+bool timeSlicesEnabled=false; // Whether this sample's maps are split: it needs a time range, even if --time-branch is given
+
+// --pipeline: threads decoding the maps, while another reads them; 0 to do it all on one thread
+int pipelineThreads=0;
+// --threads: all the threads we may use, including ROOT's for unzipping baskets; -1 for ROOT not to use any
+int threads=-1;
+
+// --toys: how many toy samples and references to throw for empirical p-values; 0 for none
+int toys=0;
+
+// --hit-index: a directory of decoded map hits, kept between runs so they are only decoded once ("" for none)
+string hitIndexDir="";
+
+// --memory-limit: release everything a branch used before starting the next, to keep under this many MB (0 for no limit)
+long memoryLimitMB=0;
+
+// Reference histograms shared between runs, so a campaign only fills them once
+string referenceCacheName=""; // --reference-cache
+TFile *referenceCache=0; // Made by an earlier run, which we read from
+TFile *newReferenceCache=0; // Or being made by this run
+string newReferenceCacheName=""; // Under this temporary name, which is this process's own
+
+// History of summary values from earlier runs, to look for slow drifts
+string historyFileName=""; // --history
+int historyWindow=10; // Compare with this many earlier runs
+
+// Reusing the outputs of branches that haven't changed since the last run into the same output directory
+bool reuseUnchanged=false; // --reuse-unchanged
+map<string,BranchRecord> priorBranches; // From the last run
+vector<BranchRecord> branchRecords; // From this run
+TFile *priorHistograms=0; // The last run's ValidationHistograms.root
+vector<string> savedImages; // Every image file we have saved
+map<pair<TTree*,string>,string> branchFingerprints; // So each branch is only fingerprinted once
+
+// Are we looking at a subset of the entries?
+bool IsSampling()
+{
+  return (maxEntries >= 0 || prescale > 1 || sampleFraction < 1.);
+}
+
+// Are we using only some of the events, because of sampling or a --cut?
+bool HasSelection()
+{
+  return (IsSampling() || eventCut.length() > 0);
+}
 
 /**
- *  main function
- * Arguments are <root file> <config file (optional)>
+ *  Build the list of entries to use for a tree when running in quick-look mode or with a --cut,
+ *  and attach it to the tree so Draw() and the map loops only visit (and only read the baskets
+ *  for) those entries. Returns false if the cut can't be compiled for this tree
  */
-int main(int argc, char **argv)
+bool MakeSelectionEntryList(TTree *inputTree, string listName)
 {
-  gStyle->SetOptStat(0);
-  gStyle->SetPalette(PALETTE);
-  gErrorIgnoreLevel = kWarning;
-  if (argc < 2)
+  baseEntryLists[inputTree] = 0;
+  if (!HasSelection()) return true;
+  TTreeFormula *cutFormula = 0;
+  if (eventCut.length() > 0)
+  {
+    cutFormula = CompileCut(eventCut, inputTree, listName);
+    if (cutFormula == 0) return false;
+  }
+  Long64_t nEntries = inputTree->GetEntries();
+  if (maxEntries >= 0 && maxEntries < nEntries) nEntries = maxEntries;
+  
+  ProfileScope profile("Select entries","io");
+  TEntryList *entryList = new TEntryList(listName.c_str(), listName.c_str(), inputTree);
+  entryList->SetDirectory(0); // Keep it out of the output file
+  TRandom3 random(sampleSeed); // Same seed for sample and reference
+  for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
+  {
+    if (iEntry % prescale != 0) continue;
+    if (sampleFraction < 1. && random.Rndm() >= sampleFraction) continue;
+    if (cutFormula && !PassesCut(cutFormula, inputTree, iEntry)) continue;
+    entryList->Enter(iEntry, inputTree);
+  }
+  delete cutFormula;
+  inputTree->SetEntryList(entryList);
+  baseEntryLists[inputTree] = entryList;
+  return true;
+}
+
+/**
+ *  Compile a selection for a tree, once, so it can be evaluated quickly for each entry.
+ *  Only the branches it uses are read when it is evaluated. Returns 0 (with an error) if
+ *  it isn't a valid expression for this tree
+ */
+TTreeFormula *CompileCut(string cut, TTree *inputTree, string name)
+{
+  TTreeFormula *formula = new TTreeFormula(("cut_"+name).c_str(), cut.c_str(), inputTree);
+  if (formula->GetNdim() == 0)
   {
-    cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)>"<<endl;
-    return -1;
+    cout<<"ERROR: could not compile the cut \""<<cut<<"\" for "<<TreeSourceName(inputTree)<<endl;
+    delete formula;
+    return 0;
   }
-  // This bit is kept for compatibility with old version that would take just a root file name and a config file name
-  string dataFileInput="";
-  string referenceFileInput="";
-  string configFileInput="";
-  string tempDirInput="";
-  string plotDirInput="";
-  if (argc == 2 && argv[1][0]!= '-')
+  return formula;
+}
+
+// An entry passes if any instance of the cut is true (for cuts on vector branches)
+bool PassesCut(TTreeFormula *formula, TTree *inputTree, Long64_t entry)
+{
+  inputTree->LoadTree(entry);
+  int nInstances = formula->GetNdata();
+  for (int i=0;i<nInstances;i++)
   {
-    dataFileInput = argv[1];
+    if (formula->EvalInstance(i) != 0) return true;
   }
-  else if (argc == 3 && argv[1][0]!= '-')
+  return false;
+}
+
+// The cut for a branch in the config file, if there is one (under its full name, or without its map branch)
+string BranchCut(string branchName)
+{
+  map<string,string>::iterator found = branchCuts.find(branchName);
+  if (found != branchCuts.end()) return found->second;
+  int pos=branchName.find(".");
+  if (pos>1)
   {
-    dataFileInput = argv[1];
-    configFileInput = (argv[2]);
+    found = branchCuts.find(branchName.substr(0,pos));
+    if (found != branchCuts.end()) return found->second;
   }
-  else
+  return "";
+}
+
+/**
+ *  If a branch has its own cut, use only the entries that pass it (as well as the sampling and
+ *  --cut) in the sample and every reference. The list for each tree and cut is made once, in a
+ *  pass that only reads the branches the cut uses, so branches with the same cut share it.
+ *  Returns false if the cut can't be compiled, or no sample entries pass it, in which case the
+ *  branch can't be plotted
+ */
+bool ApplyBranchCut(string branchName)
+{
+  string cut = BranchCut(branchName);
+  if (cut.length()==0) return true;
+  if (sampleFeed)
   {
-    int flag=0;
-    while ((flag = getopt (argc, argv, "h-i:r:c:t:o:")) != -1)
+    cout<<"ERROR: not plotting "<<branchName<<" as fed events can't be cut"<<endl;
+    return false;
+  }
+  vector<TTree*> trees(1,tree);
+  for (int i=0;i<references.size();i++) trees.push_back(references.at(i).tree);
+  for (int i=0;i<trees.size();i++)
+  {
+    TTree *inputTree = trees.at(i);
+    pair<TTree*,string> id = make_pair(inputTree, cut);
+    if (cutEntryLists.count(id)==0)
     {
-      switch (flag)
+      TTreeFormula *cutFormula = CompileCut(cut, inputTree, Form("%s_%d",branchName.c_str(),i));
+      if (cutFormula==0)
       {
-        case 'h':
-        case '-':
-          cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)>"<<endl;
-          return 1;
-          break;
-        case 'i':
-          dataFileInput = optarg;
-          break;
-        case 'r':
-          referenceFileInput = optarg;
-          break;
-        case 'c':
-          configFileInput = optarg;
-          break;
-        case 'o':
-          plotDirInput = optarg;
-          break;
-        case 't':
-          tempDirInput = optarg;
-          break;
-        case '?':
-          if (optopt == 'i' || optopt == 'r' || optopt == 'c' || optopt == 't' || optopt == 'o' )
-            fprintf (stderr, "Option -%c requires an argument.\n", optopt);
-          else if (isprint (optopt))
-            fprintf (stderr, "Unknown option `-%c'.\n", optopt);
-          else
-            fprintf (stderr,
-                     "Unknown option character `\\x%x'.\n",
-                     optopt);
-          cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)>"<<endl;
-          return 1;
-        default:
-          abort ();
+        RemoveBranchCut();
+        cout<<"ERROR: not plotting "<<branchName<<" as its cut could not be compiled"<<endl;
+        return false;
       }
+      ProfileScope profile("Select entries","io");
+      TEntryList *entryList = new TEntryList(Form("cutEntries_%d",(int)cutEntryLists.size()), cut.c_str(), inputTree);
+      entryList->SetDirectory(0);
+      Long64_t nEntries = SelectedEntries(inputTree);
+      for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
+      {
+        Long64_t treeEntry = inputTree->GetEntryNumber(iEntry); // Only the ones passing the sampling and --cut
+        if (PassesCut(cutFormula, inputTree, treeEntry)) entryList->Enter(treeEntry, inputTree);
+      }
+      delete cutFormula;
+      cutEntryLists[id] = entryList;
+    }
+    inputTree->SetEntryList(cutEntryLists[id]);
+  }
+  if (SelectedEntries(tree)==0)
+  {
+    RemoveBranchCut();
+    cout<<"WARNING: not plotting "<<branchName<<" as no sample entries pass its cut "<<cut<<endl;
+    return false;
+  }
+  cout<<"Using the "<<SelectedEntries(tree)<<" sample entries passing the cut "<<cut<<endl;
+  return true;
+}
+
+// Go back to the entries for all branches
+void RemoveBranchCut()
+{
+  for (map<TTree*,TEntryList*>::iterator it=baseEntryLists.begin(); it!=baseEntryLists.end(); it++)
+  {
+    it->first->SetEntryList(it->second);
+  }
+}
+
+// A fingerprint of which entries of a tree are being used, so a change in a cut is noticed
+string SelectionFingerprint(TTree *inputTree)
+{
+  TEntryList *entryList = inputTree->GetEntryList();
+  if (entryList==0) return "all";
+  map<TEntryList*,string>::iterator found = selectionFingerprints.find(entryList);
+  if (found != selectionFingerprints.end()) return found->second;
+  ostringstream entries;
+  Long64_t nEntries = entryList->GetN();
+  for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++) entries<<inputTree->GetEntryNumber(iEntry)<<" ";
+  string fingerprint = FingerprintString(entries.str());
+  selectionFingerprints[entryList] = fingerprint;
+  return fingerprint;
+}
+
+/**
+ *  Open a reference file and add it to the list to compare with.
+ *  Returns false (with a warning) if it can't be used
+ */
+bool AddReference(string refFileName)
+{
+  ProfileScope openRefProfile("Open reference","io");
+  TFile *refFile = new TFile(refFileName.c_str());
+  if (refFile->IsZombie())
+  {
+    cout<<"WARNING: No valid reference ROOT file given. To generate comparison plots, provide a valid reference ROOT file.";
+    cout<<" Bad ROOT file: "<<refFileName<<endl;
+    delete refFile;
+    return false;
+  }
+  TTree *thisRefTree = (TTree*) refFile->Get(treeName.c_str()); // Name is in the .h file for now
+  // Check if it found the tree
+  if (thisRefTree==0)
+  {
+    cout<<"WARNING: no reference data in a tree named "<<treeName<<" found in "<<refFileName<<". To generate comparison plots, provide a valid reference ROOT file."<<endl;
+    delete refFile;
+    return false;
+  }
+  
+  // Label it by its file name (without path or .root), which has to be unique
+  string label=refFileName.substr(refFileName.find_last_of("/")+1);
+  if (label.length()>5 && label.substr(label.length()-5)==".root") label=label.substr(0,label.length()-5);
+  if (!AddReferenceTree(thisRefTree, label, refFileName))
+  {
+    delete refFile;
+    return false;
+  }
+  references.back().file=refFile; // So it is closed when the references are dropped
+  return true;
+}
+
+/**
+ *  Add a reference tree, from a file or only in memory (fileName is empty then),
+ *  labelled so its plots can be told apart from other references'
+ */
+bool AddReferenceTree(TTree *referenceTree, string label, string fileName)
+{
+  if (referenceTree==0) return false;
+  for (int i=0;i<label.length();i++)
+  {
+    if (!isalnum(label[i]) && label[i]!='-') label[i]='_';
+  }
+  for (int i=0;i<references.size();i++)
+  {
+    if (references.at(i).label==label) label=label+"_"+to_string(references.size()+1);
+  }
+  
+  Reference ref;
+  ref.fileName=(fileName.length()>0)?fileName:label;
+  ref.label=label;
+  ref.tree=referenceTree;
+  references.push_back(ref);
+  return true;
+}
+
+// Switch which reference we are comparing with
+void SetCurrentReference(int index)
+{
+  currentReference=index;
+  reftree=references.at(index).tree;
+}
+
+// Added to the names of reference plots and histograms so each reference gets its own.
+// Empty if there is only one reference, so the names are the same as they always were
+string RefSuffix()
+{
+  if (references.size()<=1) return "";
+  return "_"+references.at(currentReference).label;
+}
+
+// The heading for a branch's results in the text file
+string ResultHeading(string branchName)
+{
+  if (references.size()<=1) return branchName+":";
+  return branchName+" (compared with "+references.at(currentReference).label+"):";
+}
+
+/**
+ *  Check whether the current reference has a branch, and entries selected to compare it with,
+ *  and warn if it doesn't. Without any entries it couldn't be normalised to the sample
+ */
+bool ReferenceHasBranch(string branchName)
+{
+  if (!reftree->GetBranchStatus(branchName.c_str()))
+  {
+    cout<<"WARNING: branch "<<branchName<<" not found in reference file "<<references.at(currentReference).fileName<<". No comparison plots will be made for this branch"<<endl;
+    return false;
+  }
+  if (SelectedWeight(reftree)==0)
+  {
+    cout<<"WARNING: no entries of reference "<<references.at(currentReference).label<<" are selected for "<<branchName<<". No comparison plots will be made for this branch"<<endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ *  The reference histograms only depend on the references and on the sampling
+ *  options, so this is what a reference cache has to match before we use it
+ */
+string ReferenceCacheKey()
+{
+  string key="";
+  for (int i=0;i<references.size();i++)
+  {
+    key += references.at(i).label+":"+references.at(i).hash+":"+to_string(SelectedEntries(references.at(i).tree))+";";
+  }
+  key += Form("max entries %lld, prescale %d, sample fraction %g, seed %u", maxEntries, prescale, sampleFraction, sampleSeed);
+  key += "; cut "+eventCut;
+  key += "; weight "+weightExpression;
+  key += Form("; cell distributions %d", cellDistributionBins);
+  for (map<string,string>::iterator it=branchCuts.begin(); it!=branchCuts.end(); it++) key += "; "+it->first+" cut "+it->second;
+  return key;
+}
+
+/**
+ *  Open the reference cache given with --reference-cache. If it exists and was made
+ *  from the same references, the reference histograms are read from it instead of being
+ *  filled. If it doesn't exist, this run makes it. It is written under a temporary name
+ *  and renamed at the end, so other runs never see half of one. Each process has its own
+ *  temporary name, so campaign workers making the same cache don't write over each other
+ */
+void OpenReferenceCache()
+{
+  if (referenceCacheName.length()==0 || !hasValidReference) return;
+  TDirectory *current = gDirectory;
+  if (boost::filesystem::exists(referenceCacheName))
+  {
+    referenceCache = new TFile(referenceCacheName.c_str());
+    TNamed *key = (referenceCache->IsZombie())?0:(TNamed*)referenceCache->Get("ReferenceCacheKey");
+    if (key==0 || ReferenceCacheKey()!=key->GetTitle())
+    {
+      cout<<"WARNING: reference cache "<<referenceCacheName<<" was made from different references or sampling options. Filling the reference histograms instead"<<endl;
+      referenceCache->Close();
+      referenceCache=0;
+    }
+    else cout<<"Using reference histograms from "<<referenceCacheName<<endl;
+  }
+  else
+  {
+    newReferenceCacheName = referenceCacheName + Form(".%d.tmp", (int)getpid());
+    newReferenceCache = new TFile(newReferenceCacheName.c_str(),"RECREATE");
+    if (newReferenceCache->IsZombie())
+    {
+      cout<<"WARNING: could not make reference cache "<<referenceCacheName<<endl;
+      delete newReferenceCache;
+      newReferenceCache=0;
+      remove(newReferenceCacheName.c_str());
+    }
+    else
+    {
+      TNamed key("ReferenceCacheKey", ReferenceCacheKey().c_str());
+      key.Write();
+      cout<<"Saving reference histograms to "<<referenceCacheName<<endl;
     }
   }
+  current->cd();
+}
+
+void CloseReferenceCache()
+{
+  if (referenceCache) referenceCache->Close();
+  referenceCache=0;
+  if (newReferenceCache)
+  {
+    newReferenceCache->Close();
+    if (rename(newReferenceCacheName.c_str(), referenceCacheName.c_str()) != 0)
+    {
+      cout<<"WARNING: could not save reference cache "<<referenceCacheName<<endl;
+      remove(newReferenceCacheName.c_str());
+    }
+  }
+  newReferenceCache=0;
+}
+
+/**
+ *  A copy of a cached reference histogram, in the current directory and named histName
+ *  (cacheName if that isn't given). Returns 0 if it isn't in the cache
+ */
+TH1 *GetCachedReference(string cacheName, string histName)
+{
+  if (referenceCache==0) return 0;
+  TH1 *cached = (TH1*)referenceCache->Get(cacheName.c_str());
+  if (cached==0) return 0;
+  TDirectory *current = gDirectory;
+  TH1 *hist = (TH1*)cached->Clone((histName.length()>0?histName:cacheName).c_str());
+  hist->SetDirectory(current);
+  delete cached;
+  return hist;
+}
+
+// Save a filled reference histogram to the cache, if this run is making one
+void CacheReference(TH1 *hist, string cacheName)
+{
+  if (newReferenceCache==0) return;
+  TDirectory *current = gDirectory;
+  newReferenceCache->cd();
+  hist->Write((cacheName.length()>0?cacheName:string(hist->GetName())).c_str(),TObject::kOverwrite);
+  current->cd();
+}
+
+// Number of entries we are actually using from a tree (all of them unless sampling)
+Long64_t SelectedEntries(TTree *inputTree)
+{
+  TEntryList *entryList = inputTree->GetEntryList();
+  if (entryList) return entryList->GetN();
+  return inputTree->GetEntries();
+}
+
+// Number of sample entries we are using, from the tree or the feed
+Long64_t SampleEntries()
+{
+  if (sampleFeed) return sampleFeed->GetEntries();
+  return SelectedEntries(tree);
+}
+
+// What the references are normalised to: the summed weights of the sample. Fed events all have a weight of 1
+double SampleWeight()
+{
+  if (sampleFeed) return sampleFeed->GetEntries();
+  return SelectedWeight(tree);
+}
+
+bool SampleHasBranch(string branchName)
+{
+  if (sampleFeed) return sampleFeed->HasBranch(branchName);
+  return tree->GetBranchStatus(branchName.c_str());
+}
+
+/**
+ *  The weight expression to use for a tree: empty if there is no --weight, or if it can't be
+ *  compiled for this tree (with a warning, once), in which case its events have unit weight
+ */
+string WeightFor(TTree *inputTree)
+{
+  if (weightExpression.length()==0) return "";
+  map<TTree*,bool>::iterator found = weightUsable.find(inputTree);
+  if (found == weightUsable.end())
+  {
+    TTreeFormula formula("weight", weightExpression.c_str(), inputTree);
+    bool usable = (formula.GetNdim() > 0);
+    if (!usable) cout<<"WARNING: could not use the weight \""<<weightExpression<<"\" for "<<TreeSourceName(inputTree)<<". Its events will all have a weight of 1"<<endl;
+    found = weightUsable.insert(make_pair(inputTree, usable)).first;
+  }
+  return (found->second)?weightExpression:"";
+}
 
-  if (dataFileInput.length()<=0)
+// Compile the weight for a tree, for loops that fill histograms entry by entry. 0 for unit weights
+TTreeFormula *MakeWeightFormula(TTree *inputTree)
+{
+  string weight = WeightFor(inputTree);
+  if (weight.length()==0) return 0;
+  return new TTreeFormula("weight", weight.c_str(), inputTree);
+}
+
+// The weight of an entry. Only reads the branches the weight uses
+double EventWeight(TTreeFormula *weightFormula, TTree *inputTree, Long64_t treeEntry)
+{
+  if (weightFormula==0) return 1;
+  inputTree->LoadTree(treeEntry);
+  if (weightFormula->GetNdata() < 1) return 0;
+  return weightFormula->EvalInstance(0);
+}
+
+/**
+ *  The sum of the weights of the entries being used from a tree, which is what the
+ *  references are normalised by. Just the number of entries if there are no weights.
+ *  Summed once for each selection of entries
+ */
+double SelectedWeight(TTree *inputTree)
+{
+  if (WeightFor(inputTree).length()==0) return SelectedEntries(inputTree);
+  pair<TTree*,TEntryList*> id = make_pair(inputTree, inputTree->GetEntryList());
+  map<pair<TTree*,TEntryList*>,double>::iterator found = selectedWeights.find(id);
+  if (found != selectedWeights.end()) return found->second;
+  ProfileScope profile("Sum weights","io");
+  TTreeFormula *weightFormula = MakeWeightFormula(inputTree);
+  double sumWeights = 0;
+  Long64_t nEntries = SelectedEntries(inputTree);
+  for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
   {
-    cout<<"ERROR: Data file name is needed."<<endl;
-    cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional)> -c <config file (optional)>"<<endl;
-    return -1;
+    sumWeights += EventWeight(weightFormula, inputTree, inputTree->GetEntryNumber(iEntry));
   }
-  ParseRootFile(dataFileInput,configFileInput,referenceFileInput,tempDirInput,plotDirInput);
-  return 0;
+  delete weightFormula;
+  selectedWeights[id] = sumWeights;
+  return sumWeights;
+}
+
+/**
+ *  The effective number of hits in a cell of a weighted count map, (sum of w)^2 / (sum of w^2).
+ *  This is just the number of hits if they all have a weight of 1
+ */
+double EffectiveHits(TH2D *counts, int x, int y)
+{
+  double sumWeights = counts->GetBinContent(x,y);
+  double error = counts->GetBinError(x,y);
+  if (error <= 0) return sumWeights;
+  return sumWeights * sumWeights / (error * error);
 }
 
 
@@ -97,27 +609,54 @@ int main(int argc, char **argv)
  *  Main work function - parses a ROOT file and plots the variables in the branches
  *  rootFileName: path to the ROOT file with SuperNEMO validation data
  *  configFileName: optional to specify how to plot certain variables
+ *  refFileNames: reference files to compare with, as well as any added already
  */
-void ParseRootFile(string rootFileName, string configFileName, string refFileName, string tempDirName, string plotDirName)
+bool ParseRootFile(string rootFileName, string configFileName, vector<string> refFileNames, string tempDirName, string plotDirName)
 {
+  for (int i=0;i<refFileNames.size();i++)
+  {
+    AddReference(refFileNames.at(i)); // Any we can't use are skipped
+  }
+  return ValidateFile(rootFileName, configFileName, tempDirName, plotDirName);
+}
 
-  // Check the input root file can be opened and contains a tree with the right name
-  cout<<"Processing "<<rootFileName<<endl;
-  TFile *rootFile;
-
-  rootFile = new TFile(rootFileName.c_str());
+// Check the input root file can be opened and contains a tree with the right name, and validate that tree
+bool ValidateFile(string rootFileName, string configFileName, string tempDirName, string plotDirName)
+{
+  // The file is closed, with the tree and its baskets, however we leave
+  unique_ptr<TFile> rootFile;
+  {
+    ProfileScope openProfile("Open sample","io");
+    rootFile.reset(new TFile(rootFileName.c_str()));
+  }
   if (rootFile->IsZombie())
   {
     cout<<"Error: file "<<rootFileName<<" not found"<<endl;
-    return ;
+    return false;
   }
-  tree = (TTree*) rootFile->Get(treeName.c_str()); // Name is in the .h file for now
+  TTree *fileTree = (TTree*) rootFile->Get(treeName.c_str()); // Name is in the .h file for now
   // Check if it found the tree
-  if (tree==0)
+  if (fileTree==0)
     {
       cout<<"Error: no data in a tree named "<<treeName<<endl;
-      return;
+      return false;
     }
+  bool succeeded = ValidateTree(fileTree, rootFileName, configFileName, tempDirName, plotDirName);
+  tree = 0; // It goes with the file
+  return succeeded;
+}
+
+/**
+ *  Validate a sample tree against the references: plot the variables in its branches, compare
+ *  them and write the results. The tree can be from a file, or one that is only in memory.
+ *  sampleName: the file name, or another name for a tree in memory
+ */
+bool ValidateTree(TTree *sampleTree, string sampleName, string configFileName, string tempDirName, string plotDirName)
+{
+  ProfileScope profile("ParseRootFile","total");
+  cout<<"Processing "<<sampleName<<endl;
+  tree = sampleTree;
+  string rootFileName = sampleName;
 
   // Check if we have a config file
   ifstream configFile (configFileName.c_str());
@@ -137,35 +676,36 @@ void ParseRootFile(string rootFileName, string configFileName, string refFileNam
     configParams=LoadConfig(configFile);
   }
   
-  // Check for a reference file
-  
-  TFile *refFile;
-  if (refFileName.length() > 0)
+  // There can be several references, added before we get here
+  hasValidReference = (references.size() > 0);
+  if (hasValidReference) SetCurrentReference(0);
+
+  // Pick the entries to use if this is a quick look, or there is a cut (fed events are all used)
+  bool selected = sampleFeed || MakeSelectionEntryList(tree, "sampleEntries");
+  for (int i=0;i<references.size() && selected;i++)
   {
-    
-    refFile = new TFile(refFileName.c_str());
-    if (refFile->IsZombie())
-    {
-      cout<<"WARNING: No valid reference ROOT file given. To generate comparison plots, provide a valid reference ROOT file.";
-      if (refFileName.length()>0) cout<<" Bad ROOT file: "<<refFileName;
-      cout <<endl;
-      hasValidReference = false;
-    }
+    selected = MakeSelectionEntryList(references.at(i).tree, "referenceEntries_"+references.at(i).label);
   }
-  else
+  if (!selected)
   {
-    cout<<"WARNING: No reference ROOT file given. To generate comparison plots, provide a valid reference ROOT file."<<endl;
-    hasValidReference = false;
+    ReleaseSelections();
+    return false;
   }
-
-  if (hasValidReference)
+  if (SampleEntries()==0)
   {
-    reftree = (TTree*) refFile->Get(treeName.c_str()); // Name is in the .h file for now
-    // Check if it found the tree
-    if (reftree==0)
+    cout<<"ERROR: no entries of "<<sampleName<<" are selected, so there is nothing to validate"<<endl;
+    ReleaseSelections();
+    return false;
+  }
+  timeSlicesEnabled = (tree && timeBranch.length()>0 && FindTimeRange()); // If not, carry on without the time slices for this sample
+  if (memoryLimitMB>0) LimitTreeCaches();
+  if (HasSelection())
+  {
+    string mode = IsSampling()?"Quick-look mode":"Selection";
+    cout<<mode<<": using "<<SampleEntries()<<" of "<<tree->GetEntries()<<" sample entries"<<endl;
+    for (int i=0;i<references.size();i++)
     {
-      cout<<"WARNING: no reference data in a tree named "<<treeName<<" found in "<<refFileName<<". To generate comparison plots, provide a valid reference ROOT file."<<endl;
-      hasValidReference = false;
+      cout<<mode<<": using "<<SelectedEntries(references.at(i).tree)<<" of "<<references.at(i).tree->GetEntries()<<" entries of reference "<<references.at(i).label<<endl;
     }
   }
 
@@ -184,7 +724,8 @@ void ParseRootFile(string rootFileName, string configFileName, string refFileNam
     {
       rootFileNameNoPath=rootFileName;
     }
-    plotdir = "plots_"+rootFileNameNoPath.substr(0,rootFileNameNoPath.length()-5);
+    if (rootFileNameNoPath.length()>5 && rootFileNameNoPath.substr(rootFileNameNoPath.length()-5)==".root") rootFileNameNoPath=rootFileNameNoPath.substr(0,rootFileNameNoPath.length()-5);
+    plotdir = "plots_"+rootFileNameNoPath;
   }
 
   boost::filesystem::path dir(plotdir.c_str());
@@ -196,78 +737,638 @@ void ParseRootFile(string rootFileName, string configFileName, string refFileNam
   // If there is a temp directory specified, make that too
   if (tempDirName.length() > 0)
   {
-    boost::filesystem::path dir(tempDirName.c_str());
-    if(boost::filesystem::create_directories(dir))
+    boost::filesystem::path dir(tempDirName.c_str());
+    if(boost::filesystem::create_directories(dir))
+    {
+      cout<< "Directory Created: "<<tempDirName<<std::endl;
+    }
+  }
+  else tempDirName=plotdir; // If no temp directory is specified, we will use the output directory for temp files
+  
+  // Find what the last run into this directory made, before we overwrite it
+  if (reuseUnchanged) LoadPriorRun();
+  
+  // In the plots directory, make an output ROOT file for the histograms
+  TFile *outputFile=new TFile((tempDirName+"/TempHistograms.root").c_str(),"RECREATE");
+  outputFile->cd();
+  
+  if (hasValidReference)
+  {
+    // Open the output text file
+    textOut.open((plotdir+"/ValidationResults.txt").c_str());
+    runSummary.sampleFile = rootFileName;
+    runSummary.sampleHash = FileHash(rootFileName);
+    runSummary.sampleEntries = SampleEntries();
+    runSummary.sampled = IsSampling();
+    runSummary.cut = eventCut;
+    runSummary.weight = weightExpression;
+    textOut<<"Sample: "<<rootFileName<<" ("<<(tree?tree->GetEntries():SampleEntries()) <<" entries)"<<"\n";
+    textOut<<"SHA-256 hash: "<<runSummary.sampleHash<<"\n";
+    for (int i=0;i<references.size();i++)
+    {
+      Reference &ref = references.at(i);
+      ref.hash = FileHash(ref.fileName);
+      ReferenceSummary refSummary;
+      refSummary.label = ref.label;
+      refSummary.file = ref.fileName;
+      refSummary.hash = ref.hash;
+      refSummary.entries = SelectedEntries(ref.tree);
+      runSummary.references.push_back(refSummary);
+      textOut<<"Compared with "<<ref.fileName<<" ("<<ref.tree->GetEntries() <<" entries)";
+      if (references.size()>1) textOut<<", labelled "<<ref.label;
+      textOut<<"\n";
+      textOut<<"SHA-256 hash: "<<ref.hash<<"\n";
+    }
+    if (eventCut.length()>0) textOut<<"Cut: "<<eventCut<<"\n";
+    if (weightExpression.length()>0)
+    {
+      textOut<<"Weight: "<<weightExpression<<" (summed weights "<<SampleWeight()<<" for the sample";
+      for (int i=0;i<references.size();i++) textOut<<", "<<SelectedWeight(references.at(i).tree)<<" for "<<references.at(i).label;
+      textOut<<")"<<"\n";
+    }
+    if (HasSelection())
+    {
+      textOut<<(IsSampling()?"Quick-look mode":"Selection")<<": used "<<SampleEntries()<<" sample entries and";
+      for (int i=0;i<references.size();i++) textOut<<" "<<SelectedEntries(references.at(i).tree)<<" ("<<references.at(i).label<<")";
+      textOut<<" reference entries";
+      if (IsSampling()) textOut<<" (max entries "<<maxEntries<<", prescale "<<prescale<<", sample fraction "<<sampleFraction<<", seed "<<sampleSeed<<")";
+      textOut<<"\n";
+      textOut<<"Statistics below are for the selected entries only"<<"\n";
+    }
+    OpenReferenceCache(); // Needs the reference hashes
+    textOut<<"\n";
+    
+  }
+
+  // Get a list of all the branches in the main tree (or the feed)
+  vector<string> branchNames;
+  if (sampleFeed) branchNames = sampleFeed->GetBranchNames();
+  else
+  {
+    TIter next(tree->GetListOfBranches());
+    TBranch *branch;
+    while( (branch=(TBranch *)next() )) branchNames.push_back(branch->GetName());
+  }
+  
+  // Loop the branches and decide how to treat them based on the first character of the name
+  for (int i=0;i<branchNames.size();i++)
+  {
+    ProcessBranch(branchNames.at(i), outputFile);
+    if (memoryLimitMB>0) ReleaseBranchMemory(branchNames.at(i), outputFile);
+  }
+  if (memoryLimitMB>0) ReportPeakMemory();
+  
+  if (configFile.is_open()) configFile.close();
+  CloseReferenceCache();
+  outputFile->Close();
+  if (textOut.is_open())  textOut.close();
+  
+  // Add this run to the history, and see whether anything has drifted since the last few
+  if (historyFileName.length()>0)
+  {
+    ProfileScope historyProfile("UpdateHistory","io");
+    string sampleHash = runSummary.sampleHash; // Only there if we have a reference
+    if (sampleHash.length()==0) sampleHash = FileHash(rootFileName);
+    vector<DriftResult> drifts;
+    if (UpdateHistory(historyFileName, rootFileName, sampleHash, SampleEntries(), historyWindow, REPORT_PULLS_OVER, drifts))
+    {
+      WriteDriftCSV(plotdir+"/ValidationDrift.csv", drifts);
+    }
+  }
+  
+  // Machine-readable versions of the results, for automated checks
+  if (hasValidReference)
+  {
+    runSummary.memoryLimitMB = memoryLimitMB;
+    runSummary.toys = toys;
+    runSummary.peakRSSMB = PeakRSSkB() / 1024.;
+    WriteResultsJSON(plotdir+"/ValidationResults.json", runSummary);
+    WriteResultsCSV(plotdir+"/ValidationResults.csv", runSummary);
+  }
+  
+  // Fix ROOT problem by copying all histograms from the output file to another file
+  // If your input ntuple files are too big, ROOT will write them to the output file
+  // We don't want that, but we can't avoid it so instead, we will copy the good
+  // stuff to a new file and then delete the old stuff. Sigh.
+  {
+    ProfileScope moveProfile("MoveHistograms","io");
+    if (priorHistograms) priorHistograms->Close(); // We are about to replace it
+    priorHistograms=0;
+    MoveHistograms(tempDirName+"/TempHistograms.root" , plotdir+"/ValidationHistograms.root");
+  }
+  if (reuseUnchanged) WriteBranchRecords(plotdir+"/ValidationFingerprints.txt");
+  ReleaseSelections(); // The trees may be used again, by the next sample
+  return true;
+}
+
+/**
+ *  Validate the events a ValidationFeed has accumulated, as if they were a sample tree. They
+ *  have no entries to select or weight, so --cut, --weight, sampling and --reuse-unchanged
+ *  can't be used. The events aren't kept, so there are no time slices, cell distributions or
+ *  hit index for them either
+ */
+bool ValidateFeed(ValidationFeed *feed, string sampleName, string configFileName, string tempDirName, string plotDirName)
+{
+  if (HasSelection() || weightExpression.length()>0 || reuseUnchanged)
+  {
+    cout<<"ERROR: fed events can't be used with --cut, --weight, sampling or --reuse-unchanged"<<endl;
+    return false;
+  }
+  if (timeBranch.length()>0 || cellDistributionBins>0 || hitIndexDir.length()>0)
+  {
+    cout<<"WARNING: no time slices, cell distributions or hit index for fed events"<<endl;
+  }
+  sampleFeed = feed;
+  bool succeeded = ValidateTree(0, sampleName, configFileName, tempDirName, plotDirName);
+  sampleFeed = 0;
+  return succeeded;
+}
+
+/**
+ *  With --memory-limit, keep the tree caches small: between them, all the input trees
+ *  get MEMORY_LIMIT_CACHE_FRACTION of the limit
+ */
+void LimitTreeCaches()
+{
+  vector<TTree*> inputTrees;
+  if (tree) inputTrees.push_back(tree);
+  for (int i=0;i<references.size();i++) inputTrees.push_back(references.at(i).tree);
+  if (inputTrees.size()==0) return;
+  Long64_t cacheBytes = (Long64_t)(memoryLimitMB * 1024 * 1024 * MEMORY_LIMIT_CACHE_FRACTION / inputTrees.size());
+  for (int i=0;i<inputTrees.size();i++) inputTrees.at(i)->SetCacheSize(cacheBytes);
+  cout<<"Memory limit "<<memoryLimitMB<<" MB: tree caches of "<<cacheBytes/(1024*1024)<<" MB each"<<endl;
+}
+
+/**
+ *  With --memory-limit, free everything a branch used once it is finished with, so memory
+ *  doesn't grow with the number of branches: the baskets the input trees are holding, and
+ *  anything still in the output file's directory (histograms that have been written).
+ *  Then check we are still under the limit. The next branch may have to read some of the
+ *  same baskets again, which is the price of a flat memory use
+ */
+void ReleaseBranchMemory(string branchName, TFile *outputFile)
+{
+  if (tree) tree->DropBaskets();
+  for (int i=0;i<references.size();i++) references.at(i).tree->DropBaskets();
+  outputFile->GetList()->Delete();
+  outputFile->cd();
+  long rssMB = CurrentRSSkB() / 1024;
+  if (rssMB > memoryLimitMB)
+  {
+    cout<<"WARNING: using "<<rssMB<<" MB after "<<branchName<<", over the memory limit of "<<memoryLimitMB<<" MB"<<endl;
+  }
+}
+
+// The most memory the run has used, against the limit
+void ReportPeakMemory()
+{
+  double peakMB = PeakRSSkB() / 1024.;
+  cout<<Form("Peak memory (RSS): %.0f MB, limit %ld MB",peakMB,memoryLimitMB)<<endl;
+  if (textOut.is_open()) textOut<<Form("Peak memory (RSS): %.0f MB, limit %ld MB",peakMB,memoryLimitMB)<<"\n";
+  if (peakMB > memoryLimitMB) cout<<"WARNING: the memory limit was exceeded"<<endl;
+}
+
+// The SHA-256 hash of a file, or an empty string if the name isn't a file (a tree in memory)
+string FileHash(string fileName)
+{
+  if (!boost::filesystem::is_regular_file(fileName)) return "";
+  return FirstWordOf(exec(("shasum -a 256 "+fileName).c_str()));
+}
+
+// The file a tree is from, or its name if it is only in memory, for messages
+string TreeSourceName(TTree *inputTree)
+{
+  if (inputTree->GetCurrentFile()) return inputTree->GetCurrentFile()->GetName();
+  return string("tree ")+inputTree->GetName()+" in memory";
+}
+
+// Set the options, from the command line or from a ValidationSession
+void ConfigureValidation(const ValidationOptions &options)
+{
+  gStyle->SetOptStat(0);
+  gStyle->SetPalette(PALETTE);
+  maxEntries = options.maxEntries;
+  prescale = options.prescale;
+  sampleFraction = options.sampleFraction;
+  sampleSeed = options.sampleSeed;
+  eventCut = options.cut;
+  weightExpression = options.weight;
+  referenceCacheName = options.referenceCache;
+  historyFileName = options.historyFile;
+  historyWindow = options.historyWindow;
+  reuseUnchanged = options.reuseUnchanged;
+  cellDistributionBins = options.cellDistributionBins;
+  timeBranch = options.timeBranch;
+  timeSlices = options.timeSlices;
+  memoryLimitMB = options.memoryLimitMB;
+  hitIndexDir = options.hitIndexDir;
+  toys = options.toys;
+  pipelineThreads = options.pipelineThreads;
+  if (pipelineThreads > 0) ROOT::EnableThreadSafety(); // The trees are read on another thread
+  threads = options.threads;
+  if (threads >= 0) StartImplicitMT();
+}
+
+/**
+ *  Turn on ROOT's implicit multithreading, so the baskets of the branches being read are
+ *  unzipped in parallel (through the tree cache) rather than one at a time in GetEntry.
+ *  The pool is shared with the pipeline: its reader and decoders come out of the threads
+ *  we were given, and ROOT gets the rest. 0 threads means one per core for ROOT
+ */
+void StartImplicitMT()
+{
+  int poolSize = threads;
+  if (threads > 0 && pipelineThreads > 0) poolSize = threads - pipelineThreads - 1;
+  if (threads > 0 && poolSize < 2)
+  {
+    cout<<"WARNING: --threads "<<threads<<" leaves no spare threads for unzipping, so baskets will be unzipped one at a time"<<endl;
+    return;
+  }
+  ROOT::EnableImplicitMT(poolSize);
+  TTreeCacheUnzip::SetParallelUnzip(TTreeCacheUnzip::kEnable); // Before any file is opened
+  cout<<"Unzipping baskets on "<<ROOT::GetThreadPoolSize()<<" threads"<<endl;
+}
+
+void StopImplicitMT()
+{
+  if (!ROOT::IsImplicitMTEnabled()) return;
+  TTreeCacheUnzip::SetParallelUnzip(TTreeCacheUnzip::kDisable);
+  ROOT::DisableImplicitMT();
+}
+
+/**
+ *  Forget everything about the last sample, so another can be validated. The references
+ *  are kept unless keepReferences is false. Options are kept
+ */
+void ResetValidation(bool keepReferences)
+{
+  tree = 0;
+  sampleFeed = 0;
+  hasConfig = true;
+  configParams.clear();
+  branchCuts.clear();
+  plotdir = "";
+  runSummary = RunSummary();
+  baseEntryLists.clear();
+  cutEntryLists.clear();
+  selectionFingerprints.clear();
+  weightUsable.clear();
+  selectedWeights.clear();
+  firstTime = 0;
+  lastTime = 0;
+  timeSlicesEnabled = false;
+  priorBranches.clear();
+  branchRecords.clear();
+  priorHistograms = 0;
+  savedImages.clear();
+  branchFingerprints.clear();
+  ClearBranchResults();
+  ClearHistoryValues();
+  if (!keepReferences)
+  {
+    for (int i=0;i<references.size();i++) delete references.at(i).file; // Closes it, and deletes its tree
+    references.clear();
+    currentReference = 0;
+    reftree = 0;
+  }
+}
+
+// Take the selected entry lists off the trees and delete them
+void ReleaseSelections()
+{
+  for (map<TTree*,TEntryList*>::iterator it=baseEntryLists.begin(); it!=baseEntryLists.end(); it++)
+  {
+    it->first->SetEntryList(0);
+    delete it->second;
+  }
+  for (map<pair<TTree*,string>,TEntryList*>::iterator it=cutEntryLists.begin(); it!=cutEntryLists.end(); it++)
+  {
+    delete it->second;
+  }
+  baseEntryLists.clear();
+  cutEntryLists.clear();
+  selectionFingerprints.clear();
+  selectedWeights.clear();
+}
+
+const RunSummary &GetRunSummary()
+{
+  return runSummary;
+}
+
+string GetPlotDirectory()
+{
+  return plotdir;
+}
+
+// Hack to move all the histograms from one ROOT file to another, while not moving
+// any TTrees. Then delete the old file. It fixes a "feature" of ROOT which means that it will
+// write the input tuples to the output file if they are too big to hold in memory.
+// Not ideal.
+void MoveHistograms(string fromFile, string toFile)
+{
+  TFile *fIn = new TFile(fromFile.c_str());
+  TFile *fOut = new TFile(toFile.c_str(),"RECREATE");
+  // Loop through the input file and if it's a histogram, write it to the output file
+  TList* list = fIn->GetListOfKeys() ;
+  TIter next(list) ;
+  TKey* key ;
+  TObject* obj ;
+  
+  while (( key = (TKey*)next() )) {
+    obj = key->ReadObj() ;
+    if ( obj->InheritsFrom("TH2") || obj->InheritsFrom("TH1"))
+    {
+      obj->Write("",TObject::kOverwrite);
+    }
+  }
+  fOut->cd();
+  fOut->Close();
+  fIn->Close();
+  remove(fromFile.c_str());
+}
+
+/**
+ *  Plot a branch, or reuse what the last run made for it if nothing it depends on has changed.
+ *  With --reuse-unchanged, this also records what the branch made, for the next run
+ */
+void ProcessBranch(string branchName, TFile *outputFile)
+{
+  // Only use the events passing this branch's own cut, if it has one
+  if (!ApplyBranchCut(branchName)) return;
+  if (!reuseUnchanged)
+  {
+    PlotVariable(branchName);
+    RemoveBranchCut();
+    return;
+  }
+  BranchRecord record;
+  record.branch = branchName;
+  {
+    SetProfileBranch(branchName);
+    ProfileScope profile("Fingerprint","io");
+    record.fingerprint = InputFingerprint(branchName);
+    SetProfileBranch("");
+  }
+  
+  // Note where everything stands before, so we know what this branch added
+  Long64_t textStart = textOut.is_open()?(Long64_t)textOut.tellp():0;
+  int firstResult = GetBranchResults().size();
+  int firstHistoryValue = GetHistoryValues().size();
+  int firstImage = savedImages.size();
+  set<string> keysBefore = KeyNames(outputFile);
+  
+  if (!ReusePriorBranch(record, outputFile)) PlotVariable(branchName);
+  
+  record.textStart = textStart;
+  record.textLength = (textOut.is_open()?(Long64_t)textOut.tellp():0) - textStart;
+  record.results.assign(GetBranchResults().begin()+firstResult, GetBranchResults().end());
+  record.historyValues.assign(GetHistoryValues().begin()+firstHistoryValue, GetHistoryValues().end());
+  record.images.assign(savedImages.begin()+firstImage, savedImages.end());
+  record.histograms.clear();
+  set<string> keysAfter = KeyNames(outputFile);
+  for (set<string>::iterator it=keysAfter.begin(); it!=keysAfter.end(); it++)
+  {
+    if (keysBefore.count(*it)==0) record.histograms.push_back(*it);
+  }
+  branchRecords.push_back(record);
+  RemoveBranchCut();
+}
+
+// The names of everything saved in a ROOT file
+set<string> KeyNames(TFile *file)
+{
+  set<string> names;
+  TIter next(file->GetListOfKeys());
+  TKey *key;
+  while ((key = (TKey*)next()))
+  {
+    names.insert(key->GetName());
+  }
+  return names;
+}
+
+/**
+ *  Everything apart from the data that changes what we make for a branch. If any of
+ *  these change, a branch has to be plotted again even if its data hasn't changed
+ */
+string OutputSettings()
+{
+  string settings = Form("sampling: max entries %lld, prescale %d, sample fraction %g, seed %u; ", maxEntries, prescale, sampleFraction, sampleSeed);
+  settings += Form("report pulls over %g; history %d; ", REPORT_PULLS_OVER, (int)(historyFileName.length()>0));
+  settings += "cut: "+eventCut+"; ";
+  settings += "weight: "+weightExpression+"; ";
+  settings += Form("cell distributions: %d; ", cellDistributionBins);
+  settings += Form("time slices: %s %d; ", timeSlicesEnabled?timeBranch.c_str():"", timeSlices);
+  settings += Form("toys: %d; ", toys);
+  settings += "references:";
+  for (int i=0;i<references.size();i++) settings += " "+references.at(i).label;
+  return settings;
+}
+
+// Fingerprint a branch in a tree, or get it from the ones we have already done
+string CachedBranchFingerprint(TTree *inputTree, string branchName)
+{
+  pair<TTree*,string> id = make_pair(inputTree, branchName);
+  map<pair<TTree*,string>,string>::iterator found = branchFingerprints.find(id);
+  if (found != branchFingerprints.end()) return found->second;
+  string fingerprint = BranchFingerprint(inputTree, branchName);
+  branchFingerprints[id] = fingerprint;
+  return fingerprint;
+}
+
+/**
+ *  A fingerprint of everything the plots and results for a branch depend on: the sample
+ *  and reference data in the branch (and its map branch, for an average), its config and
+ *  the other settings. Empty if a branch couldn't be fingerprinted, so it will be plotted
+ */
+string InputFingerprint(string branchName)
+{
+  vector<string> inputs(1,branchName);
+  string shortName=branchName;
+  if (branchName.length()>1 && branchName[1]=='m')
+  {
+    int pos=branchName.find(".");
+    if (pos>1)
+    {
+      inputs.push_back(branchName.substr(pos+1));
+      shortName=branchName.substr(0,pos);
+    }
+  }
+  // The weights are an input too. We can only fingerprint a weight that is a single branch
+  if (weightExpression.length()>0)
+  {
+    if (!tree->GetBranchStatus(weightExpression.c_str())) return "";
+    inputs.push_back(weightExpression);
+  }
+  // And so are the times, if the maps are split into intervals of them
+  if (timeSlicesEnabled && shortName==branchName && (branchName[0]=='t' || branchName[0]=='c'))
+  {
+    if (!tree->GetBranchStatus(timeBranch.c_str())) return "";
+    inputs.push_back(timeBranch);
+  }
+  string description = branchName+"\n";
+  for (int i=0;i<inputs.size();i++)
+  {
+    string fingerprint = CachedBranchFingerprint(tree, inputs.at(i));
+    if (fingerprint.length()==0) return "";
+    description += "sample "+inputs.at(i)+" "+fingerprint+"\n";
+    for (int iRef=0;iRef<references.size();iRef++)
+    {
+      TTree *thisRefTree = references.at(iRef).tree;
+      if (!thisRefTree->GetBranchStatus(inputs.at(i).c_str()))
+      {
+        description += "reference "+references.at(iRef).label+" "+inputs.at(i)+" missing\n";
+        continue;
+      }
+      fingerprint = CachedBranchFingerprint(thisRefTree, inputs.at(i));
+      if (fingerprint.length()==0) return "";
+      description += "reference "+references.at(iRef).label+" "+inputs.at(i)+" "+fingerprint+"\n";
+    }
+  }
+  description += "config "+configParams[branchName]+"|"+configParams[shortName]+"\n";
+  description += "cut "+BranchCut(branchName)+"\n";
+  // Which entries we are using, so a change in the data a cut depends on is noticed
+  description += "selection "+SelectionFingerprint(tree);
+  for (int iRef=0;iRef<references.size();iRef++) description += " "+SelectionFingerprint(references.at(iRef).tree);
+  description += "\n";
+  description += OutputSettings()+"\n";
+  return FingerprintString(description);
+}
+
+/**
+ *  If the last run made this branch's outputs from the same inputs, and they are all still
+ *  there, use them again instead of plotting it: its part of the text results, its results,
+ *  history values and histograms. Its images are already in the output directory
+ */
+bool ReusePriorBranch(BranchRecord &record, TFile *outputFile)
+{
+  if (record.fingerprint.length()==0 || priorHistograms==0) return false;
+  map<string,BranchRecord>::iterator found = priorBranches.find(record.branch);
+  if (found == priorBranches.end() || found->second.fingerprint != record.fingerprint) return false;
+  BranchRecord &prior = found->second;
+  for (int i=0;i<prior.images.size();i++)
+  {
+    if (!boost::filesystem::exists(prior.images.at(i))) return false;
+  }
+  vector<TObject*> histograms;
+  for (int i=0;i<prior.histograms.size();i++)
+  {
+    TObject *hist = priorHistograms->Get(prior.histograms.at(i).c_str());
+    if (hist==0)
     {
-      cout<< "Directory Created: "<<tempDirName<<std::endl;
+      for (int j=0;j<histograms.size();j++) delete histograms.at(j);
+      return false;
     }
+    histograms.push_back(hist);
   }
-  else tempDirName=plotdir; // If no temp directory is specified, we will use the output directory for temp files
   
-  // In the plots directory, make an output ROOT file for the histograms
-  TFile *outputFile=new TFile((tempDirName+"/TempHistograms.root").c_str(),"RECREATE");
+  cout<<"Unchanged since the last run: reusing the outputs for "<<record.branch<<endl;
+  if (textOut.is_open()) textOut<<prior.text;
+  for (int i=0;i<prior.results.size();i++) AddBranchResult(prior.results.at(i));
+  for (int i=0;i<prior.historyValues.size();i++)
+  {
+    const HistoryValue &value = prior.historyValues.at(i);
+    AddHistoryValue(value.branch, value.quantity, value.value, value.error);
+  }
+  savedImages.insert(savedImages.end(), prior.images.begin(), prior.images.end());
   outputFile->cd();
-  
-  if (hasValidReference)
+  for (int i=0;i<histograms.size();i++)
   {
-    // Open the output text file
-    textOut.open((plotdir+"/ValidationResults.txt").c_str());
-    textOut<<"Sample: "<<rootFileName<<" ("<<tree->GetEntries() <<" entries)"<<endl;
-    textOut<<"SHA-256 hash: "<<FirstWordOf(exec(("shasum -a 256 "+rootFileName).c_str()))<<endl;
-    textOut<<"Compared with "<<refFileName<<" ("<<reftree->GetEntries() <<" entries)"<<endl;
-    textOut<<"SHA-256 hash: "<<FirstWordOf(exec(("shasum -a 256 "+refFileName).c_str()))<<endl;
-    textOut<<endl;
-    
+    histograms.at(i)->Write(prior.histograms.at(i).c_str(),TObject::kOverwrite);
+    delete histograms.at(i);
   }
+  return true;
+}
 
-  // Get a list of all the branches in the main tree
-  TObjArray* branches = tree->GetListOfBranches();
-  TIter next(branches);
-  TBranch *branch;
-  
-  // Loop the branches and decide how to treat them based on the first character of the name
-  while( (branch=(TBranch *)next() )){
-    string branchName=branch->GetName();
-    PlotVariable(branchName);
+/**
+ *  Read what the last run into the output directory made for each branch, from its
+ *  ValidationFingerprints.txt, ValidationResults.txt and ValidationHistograms.root
+ */
+void LoadPriorRun()
+{
+  priorBranches.clear();
+  ifstream recordFile((plotdir+"/ValidationFingerprints.txt").c_str());
+  if (!recordFile) return;
+  ifstream textFile((plotdir+"/ValidationResults.txt").c_str());
+  stringstream textStream;
+  textStream<<textFile.rdbuf();
+  string priorText = textStream.str();
+  
+  string line;
+  BranchRecord *record=0;
+  while (getline(recordFile, line))
+  {
+    vector<string> fields = SplitTabs(line);
+    if (fields.at(0)=="branch" && fields.size()==5)
+    {
+      record = &priorBranches[fields.at(1)];
+      record->branch = fields.at(1);
+      record->fingerprint = fields.at(2);
+      record->textStart = atoll(fields.at(3).c_str());
+      record->textLength = atoll(fields.at(4).c_str());
+      if (record->textStart + record->textLength <= priorText.length()) record->text = priorText.substr(record->textStart, record->textLength);
+      else record->fingerprint = ""; // The text results are missing, so we can't reuse it
+      continue;
+    }
+    if (record==0) continue;
+    if (fields.at(0)=="histogram" && fields.size()==2) record->histograms.push_back(fields.at(1));
+    else if (fields.at(0)=="image" && fields.size()==2) record->images.push_back(fields.at(1));
+    else if (fields.at(0)=="history" && fields.size()==5)
+    {
+      HistoryValue value;
+      value.branch = fields.at(1);
+      value.quantity = fields.at(2);
+      value.value = atof(fields.at(3).c_str());
+      value.error = atof(fields.at(4).c_str());
+      record->historyValues.push_back(value);
+    }
+    else if (fields.at(0)=="result")
+    {
+      BranchResult result;
+      if (ReadBranchResultRecord(fields, result)) record->results.push_back(result);
+      else record->fingerprint = "";
+    }
+    else if (fields.at(0)=="cell" && record->results.size()>0)
+    {
+      FlaggedCell cell;
+      if (ReadFlaggedCellRecord(fields, cell)) record->results.back().flaggedCells.push_back(cell);
+      else record->fingerprint = "";
+    }
   }
   
-  if (configFile.is_open()) configFile.close();
-  outputFile->Close();
-  if (textOut.is_open())  textOut.close();
-  
-  // Fix ROOT problem by copying all histograms from the output file to another file
-  // If your input ntuple files are too big, ROOT will write them to the output file
-  // We don't want that, but we can't avoid it so instead, we will copy the good
-  // stuff to a new file and then delete the old stuff. Sigh.
-  MoveHistograms(tempDirName+"/TempHistograms.root" , plotdir+"/ValidationHistograms.root");
-  return;
+  string histogramFileName = plotdir+"/ValidationHistograms.root";
+  if (priorBranches.size()>0 && boost::filesystem::exists(histogramFileName))
+  {
+    priorHistograms = new TFile(histogramFileName.c_str());
+    if (priorHistograms->IsZombie()) priorHistograms=0;
+  }
+  cout<<"Found the outputs for "<<priorBranches.size()<<" branches from the last run in "<<plotdir<<endl;
 }
 
-// Hack to move all the histograms from one ROOT file to another, while not moving
-// any TTrees. Then delete the old file. It fixes a "feature" of ROOT which means that it will
-// write the input tuples to the output file if they are too big to hold in memory.
-// Not ideal.
-void MoveHistograms(string fromFile, string toFile)
+// Save what each branch needed and made, so the next run can tell whether it can reuse it
+void WriteBranchRecords(string fileName)
 {
-  TFile *fIn = new TFile(fromFile.c_str());
-  TFile *fOut = new TFile(toFile.c_str(),"RECREATE");
-  // Loop through the input file and if it's a histogram, write it to the output file
-  TList* list = fIn->GetListOfKeys() ;
-  TIter next(list) ;
-  TKey* key ;
-  TObject* obj ;
-  
-  while (( key = (TKey*)next() )) {
-    obj = key->ReadObj() ;
-    if ( obj->InheritsFrom("TH2") || obj->InheritsFrom("TH1"))
+  ofstream recordFile(fileName.c_str());
+  if (!recordFile)
+  {
+    cout<<"WARNING: could not write "<<fileName<<endl;
+    return;
+  }
+  recordFile<<setprecision(17);
+  for (int i=0;i<branchRecords.size();i++)
+  {
+    const BranchRecord &record = branchRecords.at(i);
+    recordFile<<"branch\t"<<record.branch<<"\t"<<record.fingerprint<<"\t"<<record.textStart<<"\t"<<record.textLength<<"\n";
+    for (int j=0;j<record.histograms.size();j++) recordFile<<"histogram\t"<<record.histograms.at(j)<<"\n";
+    for (int j=0;j<record.images.size();j++) recordFile<<"image\t"<<record.images.at(j)<<"\n";
+    for (int j=0;j<record.results.size();j++) recordFile<<BranchResultRecord(record.results.at(j));
+    for (int j=0;j<record.historyValues.size();j++)
     {
-      obj->Write("",TObject::kOverwrite);
+      const HistoryValue &value = record.historyValues.at(j);
+      recordFile<<"history\t"<<value.branch<<"\t"<<value.quantity<<"\t"<<value.value<<"\t"<<value.error<<"\n";
     }
   }
-  fOut->cd();
-  fOut->Close();
-  fIn->Close();
-  remove(fromFile.c_str());
 }
 
 /**
@@ -288,6 +1389,8 @@ bool PlotVariable(string branchName)
     }
   }
   cout<<"Plotting "<<branchName<<":"<<endl;
+  SetProfileBranch(branchName);
+  ProfileScope profile("PlotVariable","total");
   switch (branchName[0])
   {
     case 'h':
@@ -311,6 +1414,7 @@ bool PlotVariable(string branchName)
       break;
     }
   }
+  SetProfileBranch(""); // Anything after this isn't for this branch
 
   return true;
 }
@@ -330,17 +1434,81 @@ map<string,string> LoadConfig(ifstream& configFile)
   {
     getline(configFile, thisLine);
     string key=GetBitBeforeComma(thisLine);
+    // A cut for this branch can go last on the line, as cut=<expression> (the expression can have commas in).
+    // It has to be a field of its own after the title, so a title with "cut=" in isn't mistaken for one
+    size_t cutPos=string::npos;
+    size_t comma=thisLine.find(',');
+    for (int field=1; comma!=string::npos && cutPos==string::npos; field++)
+    {
+      size_t start=thisLine.find_first_not_of(" \t", comma+1);
+      if (field>=2 && start!=string::npos && thisLine.compare(start, 4, "cut=")==0) cutPos=start;
+      comma=thisLine.find(',', comma+1);
+    }
+    if (cutPos!=string::npos)
+    {
+      string cut=thisLine.substr(cutPos+4);
+      boost::trim(cut);
+      if (cut.length()>0) branchCuts[key]=cut;
+      thisLine=thisLine.substr(0,cutPos);
+    }
     configLookup[key]=thisLine; // the remainder of the line
   }
   return configLookup;
 }
 
+/**
+ *  Fill a 1-D histogram from a branch with the same result as TTree::Draw, but without a
+ *  formula and a Fill for every value: the values of the selected entries are collected with
+ *  their weights, BATCH_FILL_BLOCK at a time, and binned together. A plain number with no
+ *  weights doesn't even need reading entry by entry; its baskets are binned whole.
+ *  Returns false if the branch can't be read as numbers; the caller then uses Draw
+ */
+bool BatchFillHistogram(TTree *inputTree, string branchName, TH1 *h)
+{
+  if (WeightFor(inputTree).length()==0 && BulkFillHistogram(inputTree, branchName, h)) return true;
+  BulkBins bins;
+  if (!SetupBins(bins, h)) return false;
+  BranchReader *reader = MakeBranchReader(inputTree, branchName);
+  if (reader==0) return false;
+  TTreeFormula *weightFormula = MakeWeightFormula(inputTree); // 0 if unweighted
+  Long64_t nEntries = SelectedEntries(inputTree);
+  vector<double> values;
+  vector<double> weights;
+  values.reserve(BATCH_FILL_BLOCK);
+  weights.reserve(BATCH_FILL_BLOCK);
+  for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
+  {
+    Long64_t treeEntry = inputTree->GetEntryNumber(iEntry); // Skips entries we aren't using
+    double weight = EventWeight(weightFormula, inputTree, treeEntry);
+    if (weight == 0) continue; // Draw leaves these out altogether
+    for (int i=0;i<reader->Branches().size();i++) reader->Branches().at(i)->GetEntry(treeEntry);
+    for (size_t i=0;i<reader->Size();i++)
+    {
+      values.push_back(reader->Value(i));
+      weights.push_back(weight);
+    }
+    if (values.size() >= BATCH_FILL_BLOCK)
+    {
+      BinValues(values.data(), weightFormula?weights.data():0, values.size(), bins);
+      values.clear();
+      weights.clear();
+    }
+  }
+  BinValues(values.data(), weightFormula?weights.data():0, values.size(), bins);
+  inputTree->ResetBranchAddresses(); // These point at the reader's buffers
+  delete reader;
+  delete weightFormula;
+  PutBins(bins, h);
+  return true;
+}
+
 /**
  *  Make a basic histogram of a variable. The number of bins etc will come from
  *  the config file if there is one, if not we will guess
  */
 void Plot1DHistogram(string branchName)
 {
+  ProfileScope profile("Plot1DHistogram","total");
   int notSetVal=-9999;
   string config="";
   config=configParams[branchName]; // get the config loaded from the file if there is one
@@ -348,14 +1516,6 @@ void Plot1DHistogram(string branchName)
   double lowLimit=0;
   double highLimit=notSetVal;
   string title="";
-  bool hasReferenceBranch=hasValidReference;
-  
-  // Check whether the reference file contains this branch
-  if (hasValidReference)
-  {
-    hasReferenceBranch=reftree->GetBranchStatus(branchName.c_str());
-    if (!hasReferenceBranch) cout<<"WARNING: branch "<<branchName<<" not found in reference file. No comparison plots will be made for this branch"<<endl;
-  }
   
   // Read the config information
   if (config.length()>0)
@@ -404,12 +1564,30 @@ void Plot1DHistogram(string branchName)
   }
   TCanvas *c = new TCanvas (("plot_"+branchName).c_str(),("plot_"+branchName).c_str(),900,600);
   TH1D *h;
-  tree->Draw(branchName.c_str());
+  TH1D *fed = sampleFeed?sampleFeed->CopyHistogram(branchName):0; // Fed events are already binned, so use that binning
+  if (fed)
+  {
+    nbins = fed->GetNbinsX();
+    lowLimit = fed->GetXaxis()->GetXmin();
+    highLimit = fed->GetXaxis()->GetXmax();
+  }
+  else
+  {
+    ProfileScope drawProfile("Draw for default binning","fill");
+    tree->Draw(branchName.c_str());
+  }
   
   if (highLimit == notSetVal)
   {
     // Use the default limits
     TH1D *tmp = (TH1D*) gPad->GetPrimitive("htemp");
+    if (tmp==0)
+    {
+      // Draw doesn't make a histogram if the selected entries have no values
+      cout<<"WARNING: not plotting "<<branchName<<" as the selected entries have no values for it"<<endl;
+      delete c;
+      return;
+    }
     highLimit=tmp->GetXaxis()->GetXmax();
     delete tmp;
     EDataType datatype;
@@ -441,15 +1619,32 @@ void Plot1DHistogram(string branchName)
   h->GetXaxis()->SetTitle(title.c_str());
   h->SetFillColor(kPink-6);
   h->SetFillStyle(1001);
-  tree->Draw((branchName + ">> plt_"+branchName).c_str());
+  bool filled = (fed!=0);
+  if (fed) h->Add(fed);
+  else
+  {
+    ProfileScope batchProfile("Batch fill sample","fill");
+    filled = BatchFillHistogram(tree, branchName, h);
+  }
+  delete fed;
+  if (!filled)
+  {
+    ProfileScope drawProfile("Draw sample","fill");
+    tree->Draw((branchName + ">> plt_"+branchName).c_str(), WeightFor(tree).c_str()); // The selection is used as the weight
+  }
   h->Write("",TObject::kOverwrite);
   h->Draw("HIST");
   
   h->Draw("E SAME");
-  c->SaveAs((plotdir+"/"+branchName+".png").c_str());
-  if (hasReferenceBranch)
+  SaveCanvas(c, plotdir+"/"+branchName+".png");
+  RecordHistogramHistory(branchName, h);
+  
+  // Compare the sample with each reference in turn, using the same binning
+  for (int iRef=0;iRef<references.size();iRef++)
   {
-    TCanvas  *comp_canv= new TCanvas(("compare_"+branchName).c_str(),("compare_"+branchName).c_str(),900,900);
+    SetCurrentReference(iRef);
+    if (!ReferenceHasBranch(branchName)) continue;
+    TCanvas  *comp_canv= new TCanvas(("compare_"+branchName+RefSuffix()).c_str(),("compare_"+branchName+RefSuffix()).c_str(),900,900);
     TPad *p_comp = new TPad("p_comp",
                             "",0.0,0.4,1,1,0);
     
@@ -460,12 +1655,32 @@ void Plot1DHistogram(string branchName)
     
     p_comp->cd();
     // Make the reference plot with the same binning
-    TH1D *href = new TH1D(("ref_"+branchName).c_str(),title.c_str(),nbins,lowLimit,highLimit);
-    if( href->GetSumw2N() == 0 )href->Sumw2();
-    reftree->Draw((branchName + ">> ref_"+branchName).c_str());
+    // (or take it from the reference cache, if it has one with this binning)
+    string cacheName = Form("ref_%s%s_%d_%g_%g",branchName.c_str(),RefSuffix().c_str(),nbins,lowLimit,highLimit);
+    TH1D *href = (TH1D*)GetCachedReference(cacheName, "ref_"+branchName+RefSuffix());
+    if (href)
+    {
+      href->SetTitle(title.c_str());
+    }
+    else
+    {
+      href = new TH1D(("ref_"+branchName+RefSuffix()).c_str(),title.c_str(),nbins,lowLimit,highLimit);
+      if( href->GetSumw2N() == 0 )href->Sumw2();
+      bool filled;
+      {
+        ProfileScope batchProfile("Batch fill reference","fill");
+        filled = BatchFillHistogram(reftree, branchName, href);
+      }
+      if (!filled)
+      {
+        ProfileScope drawProfile("Draw reference","fill");
+        reftree->Draw((branchName + ">> ref_"+branchName+RefSuffix()).c_str(), WeightFor(reftree).c_str());
+      }
+      CacheReference(href, cacheName);
+    }
     
-    // Normalise reference number of events to data
-    Double_t scale = (double)tree->GetEntries()/(double)reftree->GetEntries();
+    // Normalise reference number of events (or summed weights) to data
+    Double_t scale = SampleWeight()/SelectedWeight(reftree);
     href->Scale(scale);
     
     // Save a plot with both on the same axes
@@ -496,14 +1711,19 @@ void Plot1DHistogram(string branchName)
 
     // Add a legend
     TLegend* legend = new TLegend(0.75,0.8,0.9,0.9);
+    legend->SetBit(TObject::kCanDelete); // The pad deletes it
     href->SetFillColor(REF_FILL_COLOR); // change it back so it is included in the legend
     legend->AddEntry(h, "Sample", "lep");
-    legend->AddEntry(href,"Reference", "fl");
+    legend->AddEntry(href,(references.size()>1)?references.at(iRef).label.c_str():"Reference", "fl");
     legend->Draw();
     
     // Calculate some stats
     // Kolmogorov-Smirnov goodness of fit
-    Double_t ks = h->KolmogorovTest(href);
+    Double_t ks;
+    {
+      ProfileScope compareProfile("KolmogorovTest","compare");
+      ks = h->KolmogorovTest(href);
+    }
     Double_t chisq;
     Int_t ndf;
     Double_t p_value = ChiSquared(h, href, chisq, ndf, false);
@@ -511,15 +1731,23 @@ void Plot1DHistogram(string branchName)
     cout<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
     
     // Write to output file
-    textOut<<branchName<<":"<<endl;
-    textOut<<"KS score: "<<ks<<endl;
-    textOut<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+    textOut<<ResultHeading(branchName)<<"\n";
+    textOut<<"KS score: "<<ks<<"\n";
+    textOut<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<"\n";
+    BranchResult &result = StartBranchResult(branchName, "histogram", references.at(iRef).label);
+    result.sampleEntries = SampleEntries();
+    result.referenceEntries = SelectedEntries(reftree);
+    result.ks = ks;
+    result.chisq = chisq;
+    result.ndf = ndf;
+    result.pValue = p_value;
+    ToyPValues(vector<TH1*>(1,h), vector<TH1*>(1,href), false, true, result);
 
 
     // Now make a ratio plot
 
     p_ratio->cd();
-    TH1D *ratio_hist = (TH1D*)h->Clone(("ratio_"+branchName).c_str());
+    TH1D *ratio_hist = (TH1D*)h->Clone(("ratio_"+branchName+RefSuffix()).c_str());
     ratio_hist->SetTitle("");
     ratio_hist->GetXaxis()->SetTitle("");
     ratio_hist->Divide(href);
@@ -535,13 +1763,13 @@ void Plot1DHistogram(string branchName)
     WriteLabel(0.6,0.72, Form("#chi^{2}/NDF: %.1f/%d = %.1f",chisq,ndf,chisq/(double)ndf),0.04);
     WriteLabel(0.6,0.64, Form("(p-value %.2f)",p_value),0.04);
     
-    TLine *line=new TLine(c->GetUxmin(),1.0,c->GetUxmax(),1.0);
-    line->SetLineColor(kRed);
-    line->Draw();
+    TLine line;
+    line.SetLineColor(kRed);
+    line.DrawLine(c->GetUxmin(),1.0,c->GetUxmax(),1.0);
 
-    comp_canv->SaveAs((plotdir+"/compare_"+branchName+".png").c_str());
+    SaveCanvas(comp_canv, plotdir+"/compare_"+branchName+RefSuffix()+".png");
     
-    textOut<<endl;
+    textOut<<"\n";
     delete href;
     delete ratio_hist;
    // delete c_ratio;
@@ -563,6 +1791,7 @@ void Plot1DHistogram(string branchName)
  */
 void PlotCaloMap(string branchName)
 {
+  ProfileScope profile("PlotCaloMap","total");
   
   string config="";
   
@@ -601,66 +1830,93 @@ void PlotCaloMap(string branchName)
     title = BranchNameToEnglish(branchName);
   }
   
-  vector<TH2D*> hists = MakeCaloPlotSet(fullBranchName, branchName, title, false, isAverage, mapBranch);
+  // The distribution of the value in each module, if we are comparing those too
+  CellDistributions *distributions = isAverage?MakeCellDistributions(fullBranchName, config, CaloCellCount()):0;
+  // And how many hits each module has in each interval of time, if we are checking that
+  TimeSlices *slices = isAverage?0:MakeTimeSlices(CaloCellCount());
+  vector<TH2D*> hists = MakeCaloPlotSet(fullBranchName, branchName, title, false, isAverage, mapBranch, distributions, slices);
+  TH2D *hDist = SaveCellDistributions(distributions, "dist_"+branchName, title, false);
+  ReportTimeSlices(slices, branchName, title, false);
   PrintCaloPlots(branchName,title,hists);
+  RecordMapHistory(branchName, hists, isAverage, false);
   
-  // Can we do a comparison to the reference for this plot?
-  if (!hasValidReference) return;
-  if (!reftree->GetBranchStatus(fullBranchName.c_str()))
-  {
-    cout<<"WARNING: branch "<<fullBranchName<<" not found in reference file. No comparison plots will be made for this branch"<<endl;
-    return;
-  }
-  if (isAverage && !reftree->GetBranchStatus(mapBranch.c_str()))
+  // Compare with each reference in turn, if they have this branch
+  for (int iRef=0;iRef<references.size();iRef++)
   {
-    cout<<"WARNING: map branch "<<mapBranch<<" not found in reference file. No comparison plots can be made for the branch "<<branchName<<endl;
-    return;
-  }
-  
-  // Compare to reference now that we have checked that we have one.
-  vector<TH2D*> refHists = MakeCaloPlotSet(fullBranchName, branchName, title, true, isAverage, mapBranch);
+    SetCurrentReference(iRef);
+    if (!ReferenceHasBranch(fullBranchName)) continue;
+    if (isAverage && !reftree->GetBranchStatus(mapBranch.c_str()))
+    {
+      cout<<"WARNING: map branch "<<mapBranch<<" not found in reference file "<<references.at(iRef).fileName<<". No comparison plots can be made for the branch "<<branchName<<endl;
+      continue;
+    }
+    
+    // Compare to reference now that we have checked that we have one.
+    CellDistributions *refDistributions = hDist?CopyBinning(hDist):0;
+    vector<TH2D*> refHists = MakeCaloPlotSet(fullBranchName, branchName, title, true, isAverage, mapBranch, refDistributions);
+    TH2D *hRefDist = SaveCellDistributions(refDistributions, "ref_dist_"+branchName+RefSuffix(), title, true);
 
-  PrintCaloPlots("ref_"+branchName,title,refHists);
-  
+    PrintCaloPlots("ref_"+branchName+RefSuffix(),title,refHists);
+    
 
-  // Calculate some stats
-  // Don't know how to make a Kolmogorov calculation for this set of 6, but we can do a chi-square and look at the pull...
+    // Calculate some stats
+    // Don't know how to make a Kolmogorov calculation for this set of 6, but we can do a chi-square and look at the pull...
 
-  Double_t chisq=0;
-  Int_t ndf=0;
-  for (int i=0;i<hists.size();i++)
-  {
-    // Should be able to calculate the individual chi-squares and then sum them, as long as we remember to sum degrees of freedom too
-    Double_t thisChisq=0;
-    Int_t thisNdf=0;
-    ChiSquared(hists.at(i), refHists.at(i), thisChisq, thisNdf, isAverage);
-    chisq += thisChisq;
-    ndf += thisNdf;
+    Double_t chisq=0;
+    Int_t ndf=0;
+    for (int i=0;i<hists.size();i++)
+    {
+      // Should be able to calculate the individual chi-squares and then sum them, as long as we remember to sum degrees of freedom too
+      Double_t thisChisq=0;
+      Int_t thisNdf=0;
+      ChiSquared(hists.at(i), refHists.at(i), thisChisq, thisNdf, isAverage);
+      chisq += thisChisq;
+      ndf += thisNdf;
+    }
+    
+    Double_t prob = TMath::Prob(chisq, ndf); // Get it from the combined chi square
+    cout<<"P-value: "<<prob<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+    
+    // Write to output file
+    textOut<<ResultHeading(branchName)<<"\n";
+    textOut<<"P-value: "<<prob<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<"\n";
+    BranchResult &result = StartBranchResult(branchName, isAverage?"calorimeter average":"calorimeter map", references.at(iRef).label);
+    result.sampleEntries = SampleEntries();
+    result.referenceEntries = SelectedEntries(reftree);
+    result.chisq = chisq;
+    result.ndf = ndf;
+    result.pValue = prob;
+    ToyPValues(vector<TH1*>(hists.begin(),hists.end()), vector<TH1*>(refHists.begin(),refHists.end()), isAverage, false, result);
+    
+    // Pull plots
+    vector<TH2D*> pullHists = MakeCaloPullPlots(hists,refHists);
+    gStyle->SetPalette(PULL_PALETTE);
+    
+    PrintCaloPlots("pull_"+branchName+RefSuffix(),"Pull: "+title,pullHists);
+    CheckCaloPulls(pullHists,title);
+    gStyle->SetPalette(PALETTE);
+    CompareCellDistributions(hDist, hRefDist, false);
+    delete hRefDist;
+    DeleteHistograms(refHists);
+    DeleteHistograms(pullHists);
+    
+    textOut<<"\n";
+    cout<<endl;
   }
-  
-  Double_t prob = TMath::Prob(chisq, ndf); // Get it from the combined chi square
-  cout<<"P-value: "<<prob<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
-  
-  // Write to output file
-  textOut<<branchName<<":"<<endl;
-  textOut<<"P-value: "<<prob<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
-  
-  // Pull plots
-  vector<TH2D*> pullHists = MakeCaloPullPlots(hists,refHists);
-  gStyle->SetPalette(PULL_PALETTE);
-  
-  PrintCaloPlots("pull_"+branchName,"Pull: "+title,pullHists);
-  CheckCaloPulls(pullHists,title);
-  gStyle->SetPalette(PALETTE);
-  
-  textOut<<endl;
-  cout<<endl;
+  DeleteHistograms(hists);
+  delete hDist;
+}
+
+void DeleteHistograms(vector<TH2D*> hists)
+{
+  for (int i=0;i<hists.size();i++) delete hists.at(i);
 }
 
 // Go through a set of calorimeter pull histograms and report overall pull and
 // any problems
 double CheckCaloPulls(vector<TH2D*> hPulls, string title)
 {
+  ProfileScope profile("CheckCaloPulls","compare");
   bool foundPull=false;
   for (int i=0;i<hPulls.size();i++)
   {
@@ -674,12 +1930,14 @@ double CheckCaloPulls(vector<TH2D*> hPulls, string title)
   if (!foundPull)
   { // If the plots are the same there is no need to make a plot of all pulls
     cout<<"Pull is zero - plots are identical"<<endl;
-    textOut<<"Pull is zero - plots are identical"<<endl;
+    textOut<<"Pull is zero - plots are identical"<<"\n";
+    CurrentBranchResult().identical = true;
     return 0;
   }
   string firstName=hPulls.at(0)->GetName();
+  firstName=firstName.substr(0,firstName.length()-RefSuffix().length()); // Take off the reference label, so we can find the wall name
   int pos=firstName.find_last_of('_');
-  string hPullName="allpulls"+firstName.substr(8,pos-8);
+  string hPullName="allpulls"+firstName.substr(8,pos-8)+RefSuffix();
   
   TH1D *h1Pulls = new TH1D(hPullName.c_str(),(title+" pulls").c_str(),100,-10,10);
   
@@ -704,51 +1962,21 @@ double CheckCaloPulls(vector<TH2D*> hPulls, string title)
         // Report any cells where sample and reference are too different
         if (TMath::Abs(pull) > REPORT_PULLS_OVER ||  std::isnan(pull) )
         {
-          string reportString;
-          // Unfortunately the numbering scheme maps differently to the bin numbers for each wall
-          string intExt="external"; // Translate x coordinate to position for X walls and vetoes
-          string side="French";
-          switch (i)
-          {
-            case 0: // Italy
-              reportString=Form("Italian main wall: module (%d,%d)",20-x,y-1);
-              break;
-            case 1: // France
-              reportString=Form("French main wall: module (%d,%d)",x-1,y-1);
-              break;
-            case 2: // Tunnel
-              if (x>2) side = "Italian"; // Translate x bin to location
-              if (x==2 || x ==3) intExt="internal";
-              reportString=Form("Tunnel X-wall: module %d (",y-1)+side+" side "+intExt+")";
-              break;
-            case 3: // Mountain
-              if (x<3) side = "Italian"; // Translate x bin to location
-              if (x==2 || x ==3) intExt="internal";
-              reportString=Form("Mountain X-wall: module %d (",y-1)+side+" side "+intExt+")";
-              break;
-            case 4: // Top
-              if (y==2) side = "Italian"; // Translate y bin to location
-              reportString=Form("Top veto wall: module %d (",x-1)+side+" side)";
-              break;
-            case 5: // Bottom
-              if (y==1) side = "Italian"; // Translate y bin to location
-              reportString=Form("Bottom veto wall: module %d (",x-1)+side+" side)";
-              break;
-            default:
-              break;
-              reportString=Form("ERROR: pull found for unknown calorimeter wall %d: this is a bug!",i);
-          }
+          string reportString=CaloCellLocation(i,x,y);
+          string location=reportString; // Before we add the pull to it
           if (std::isnan(pull)) reportString += ": not enough data to calculate pull";
           else if (std::isinf(pull)) reportString += ": not enough data to calculate pull";
           else reportString += Form(": pull = %.2f",pull);
           cout<<reportString<<endl;
-          textOut<<reportString<<endl;
+          textOut<<reportString<<"\n";
+          AddFlaggedCell("calorimeter", location, std::isinf(pull)?NAN:pull);
         }
         
       }
     }
   }
   PrintPlotOfPulls(h1Pulls,pullCells,title);
+  delete h1Pulls;
   return totalPull;
 }
 
@@ -759,7 +1987,10 @@ double  PrintPlotOfPulls(TH1D *h1Pulls, int pullCells, string title)
   h1Pulls->GetYaxis()->SetTitle("Frequency");
   
   
-  h1Pulls->Fit("gaus","LQ");
+  {
+    ProfileScope fitProfile("Fit pulls","fit");
+    h1Pulls->Fit("gaus","LQ");
+  }
   TF1 *fit = (TF1*)h1Pulls->GetFunction("gaus");
   double mean=fit->GetParameter(1);
   double rms=fit->GetParameter(2);
@@ -769,10 +2000,16 @@ double  PrintPlotOfPulls(TH1D *h1Pulls, int pullCells, string title)
   // Report fitted mean pulls
   textOut<<"Mean pull:"<<mean<<" +/- "<<meanerr<<" for "<<pullCells<<" modules with data. ";
   cout<<"Mean pull:"<<mean<<" +/- "<<meanerr<<" for "<<pullCells<<" modules with data."<<endl;
-  if (mean < 0)  textOut<<"Note: negative pull indicates sample deficit."<<endl;
-  else textOut<<"Note: positive pull indicates sample excess."<<endl;
+  if (mean < 0)  textOut<<"Note: negative pull indicates sample deficit."<<"\n";
+  else textOut<<"Note: positive pull indicates sample excess."<<"\n";
   cout<<"RMS of pulls "<<rms<<" +/- "<<rmserr<<endl;
-  textOut<<"RMS of pulls "<<rms<<" +/- "<<rmserr<<endl;
+  textOut<<"RMS of pulls "<<rms<<" +/- "<<rmserr<<"\n";
+  BranchResult &result = CurrentBranchResult();
+  result.pullCells = pullCells;
+  result.meanPull = mean;
+  result.meanPullError = meanerr;
+  result.rmsPull = rms;
+  result.rmsPullError = rmserr;
   
   
   h1Pulls->Write("",TObject::kOverwrite);
@@ -785,7 +2022,7 @@ double  PrintPlotOfPulls(TH1D *h1Pulls, int pullCells, string title)
   WriteLabel(.6,.75,Form ("Mean pull %.2f #pm %.2f",mean,meanerr),0.03);
   WriteLabel(.6,.7,Form ("RMS  %.2f #pm %.2f",rms,rmserr),0.03);
   WriteLabel(.15,.84,title+" pulls",0.04);
-  cPull->SaveAs((plotdir+Form("/%s.png",h1Pulls->GetName())).c_str());
+  SaveCanvas(cPull, plotdir+Form("/%s.png",h1Pulls->GetName()));
   delete cPull;
 
   return mean;
@@ -806,13 +2043,38 @@ vector<TH2D*>MakeCaloPullPlots(vector<TH2D*> vSample, vector<TH2D*> vRef)
   return vPull;
 }
 
-vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch)
+vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch, CellDistributions *distributions, TimeSlices *slices)
 {
+  ProfileScope profile(isRef?"MakeCaloPlotSet (reference)":"MakeCaloPlotSet","fill");
   
   vector<TH2D*> hists;
   vector<TH2D*> ave_hists;
   vector<TH2D*> var_hists;
   
+  // A campaign may already have filled the reference histograms for all six walls
+  if (isRef)
+  {
+    vector<TH2D*> cached;
+    for (int i=0; i<6; i++)
+    {
+      string refName = (isAverage?"refave_":"ref_")+branchName+"_"+CALO_WALL[i]+RefSuffix();
+      TH2D *h = (TH2D*)GetCachedReference(refName);
+      if (h==0) break;
+      cached.push_back(h);
+    }
+    if (cached.size()==6)
+    {
+      double scale=SampleWeight()/SelectedWeight(reftree);
+      for (int i=0;i<cached.size();i++)
+      {
+        if (!isAverage) cached.at(i)->Scale(scale); // They are cached before normalising
+        cached.at(i)->Write("",TObject::kOverwrite);
+      }
+      return cached;
+    }
+    for (int i=0;i<cached.size();i++) delete cached.at(i);
+  }
+  
   string prefix = (isRef)?"ref_":"plt_";
   
   for (int i=0; i<6; i++)
@@ -820,19 +2082,20 @@ vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string t
     // Make a histogram to hold the count for each calo location
     string prefix = (isRef)?"ref_":"plt_";
     // The binnings etc are all in the header file
-    TH2D *h = new TH2D((prefix+branchName+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
+    string suffix = (isRef)?RefSuffix():""; // Each reference gets its own histograms
+    TH2D *h = new TH2D((prefix+branchName+"_"+CALO_WALL[i]+suffix).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
     if( h->GetSumw2N() == 0 ) h->Sumw2();
     hists.push_back(h);
     
     // Another for the value to be averaged (if an average plot)
     prefix = (isRef)?"refave_":"ave_";
-    TH2D *m = new TH2D((prefix+branchName+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
+    TH2D *m = new TH2D((prefix+branchName+"_"+CALO_WALL[i]+suffix).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
     if( m->GetSumw2N() == 0 ) m->Sumw2();
     ave_hists.push_back(m);
     
     // And another to histogram the quantity squared, to be used to calculate the error on the mean
     prefix = (isRef)?"refvar_":"var_";
-    TH2D *v = new TH2D((prefix+branchName+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
+    TH2D *v = new TH2D((prefix+branchName+"_"+CALO_WALL[i]+suffix).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
     if( v->GetSumw2N() == 0 ) v->Sumw2();
     var_hists.push_back(v);
   }
@@ -845,146 +2108,176 @@ vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string t
   // And it will have a format something like [1302:0.1.0.10.*]
   std::vector<string> *caloHits = 0;
   
-  TTree *thisTree = (isRef)?reftree->CopyTree(""):tree->CopyTree("");
-  
-  // Count the number of entries in the tree
-  int nEntries = thisTree -> GetEntries();
-  // Map the branches
-  thisTree->SetBranchAddress(mapBranch.c_str(), &caloHits);
-  
-  std::vector<double> *toAverage = 0;
-  if (isAverage)
+  TTree *thisTree = (isRef)?reftree:tree;
+  
+  // Count the number of entries we are using (all of them unless we are sampling, or they were fed)
+  bool fromFeed = (!isRef && sampleFeed);
+  Long64_t nEntries = fromFeed?SampleEntries():SelectedEntries(thisTree);
+  // With --hit-index they have already been decoded, and we don't need to read them at all.
+  // Nor if they were fed, since the feed has already filled its own maps
+  HitIndex *index = fromFeed?0:GetHitIndex(thisTree, mapBranch, isAverage?fullBranchName:"", false);
+  vector<TBranch*> readBranches; // Everything we need to read for each entry
+  BranchReader *toAverage = 0;
+  if (!index && !fromFeed)
   {
-    thisTree->SetBranchAddress(fullBranchName.c_str(), &toAverage);
+    // Map the branches - we read just these, not the whole event
+    TBranch *mapBr = 0;
+    thisTree->SetBranchAddress(mapBranch.c_str(), &caloHits, &mapBr);
+    readBranches.push_back(mapBr);
+  
+    // The values can be stored as vectors or arrays of any type of number
+    if (isAverage)
+    {
+      toAverage = MakeBranchReader(thisTree, fullBranchName);
+      if (toAverage) readBranches.insert(readBranches.end(), toAverage->Branches().begin(), toAverage->Branches().end());
+      else nEntries=0; // Can't read them; the error has been printed
+    }
   }
+  TTreeFormula *weightFormula = MakeWeightFormula(thisTree); // 0 if unweighted
+  TTreeFormula *timeFormula = slices?MakeTimeFormula(thisTree):0;
   
   // Loop through the tree
-  for( int iEntry = 0; iEntry < nEntries; iEntry++ )
-  {
-    thisTree->GetEntry(iEntry);
-    // Populate these with which histogram we will fill and what cell
-    int xValue=0;
-    int yValue=0;
-   // TH2D *whichHistogram=0;
-   // TH2D *whichAverage=0; // this is a tad messy
-    
-    int whichWall=-1;
-    
-    // This should always work, but there is next to no catching of badly formatted
-    // geom ID strings. Are they a possibility?
-    if (caloHits->size()>0)
+  double readSeconds=0; // Time spent reading and unzipping, as opposed to decoding and filling
+  Long64_t bytesAtStart=TFile::GetFileBytesRead();
+  double chunkStart=ProfileSeconds();
+  Long64_t iEntry = 0;
+  // Read a chunk of entries: the only stage that touches the tree
+  ChunkReader readChunk = [&](MapChunk &chunk)
+  {
+    if (iEntry >= nEntries) return false;
+    Long64_t lastEntry = TMath::Min(nEntries, iEntry + PIPELINE_CHUNK_ENTRIES);
+    for (; iEntry < lastEntry; iEntry++)
     {
-      for (int i=0;i<caloHits->size();i++)
+      Long64_t treeEntry = thisTree->GetEntryNumber(iEntry); // Skips entries we aren't sampling
+      ReadMapEntry(treeEntry, readBranches, readSeconds);
+      double weight = EventWeight(weightFormula, thisTree, treeEntry);
+      int interval = slices?slices->Interval(EventTime(timeFormula, thisTree, treeEntry)):-1;
+      TraceLoopChunk(iEntry, nEntries, chunkStart);
+      size_t nHits = caloHits->size();
+      int problems = (isAverage && toAverage->Size() != nHits)?HIT_LENGTH_MISMATCH:0;
+      if (isAverage && toAverage->Size() < nHits) nHits = toAverage->Size(); // Protect against a short list of values
+      for (size_t i=0;i<nHits;i++)
       {
-        string thisHit=caloHits->at(i);
-        
-        if (thisHit.length()>=9)
-        {
-          bool isFrance=(thisHit.substr(8,1)=="1");
-          //Now to decode it
-          string wallType = thisHit.substr(1,4);
-          
-          if (wallType=="1302") // Main walls
-          {
-            
-            //if (isFrance) whichHistogram = hFrance; else whichHistogram = hItaly;
-            if (isFrance) whichWall = FRANCE; else whichWall = ITALY;
-            string useThisToParse = thisHit;
-            
-            // Hacky way to get the bit between the 2nd and 3rd "." characters for x
-            int pos=useThisToParse.find('.');
-            useThisToParse=useThisToParse.substr(pos+1);
-            pos=useThisToParse.find('.');
-            useThisToParse=useThisToParse.substr(pos+1);
-            pos=useThisToParse.find('.');
-            std::string::size_type sz;   // alias of size_t
-            xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-            
-            // and the bit before the next . characters for y
-            useThisToParse=useThisToParse.substr(pos+1);
-            pos=useThisToParse.find_first_of('.');
-            yValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-            
-            // The numbering is from mountain to tunnel
-            // But we draw the Italian side as we see it, with the mountain on the left
-            // So let's flip it around
-            if (!isFrance)xValue = -1 * (xValue + 1);
-            //cout<<iEntry<<" : " <<thisHit<<" : " <<(isFrance?"Fr.":"It")<<" - "<<xValue<<":"<<yValue<<endl;
-          }
-          else if (wallType == "1232") //x walls
-          {
-            bool isTunnel=(thisHit.substr(10,1)=="1");
-//            if (isTunnel) whichHistogram = hTunnel; else whichHistogram = hMountain;
-            if (isTunnel) whichWall=TUNNEL; else whichWall = MOUNTAIN;
-            // Hacky way to get the bit between the 3rd and 4th "." characters for x
-            string useThisToParse = thisHit;
-            int pos=0;
-            for (int j=0;j<3;j++)
-            {
-              int pos=useThisToParse.find('.');
-              useThisToParse=useThisToParse.substr(pos+1);
-            }
-            pos=useThisToParse.find('.');
-            std::string::size_type sz;   // alias of size_t
-            xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-            
-            // and the bit before the next . characters for y
-            useThisToParse=useThisToParse.substr(pos+1);
-            pos=useThisToParse.find_first_of('.');
-            yValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-            if (!isFrance)xValue = -1 * (xValue + 1); // Italy is on the left so reverse these to draw them
-            
-            if (isTunnel) // Switch it so France is on the left for the tunnel side
-            {
-              xValue = -1 * (xValue + 1);
-            }
-            
-            //cout<<iEntry<<" : " <<thisHit<<" : " <<(isFrance?"Fr.":"It")<<" - "<<(isTunnel?"tunnel":"mountain")<<" - "<<xValue<<":"<<yValue<<endl;
-            
-          }
-          else if (wallType == "1252") // veto walls
-          {
-            bool isTop=(thisHit.substr(10,1)=="1");
-//            if (isTop) whichHistogram = hTop; else whichHistogram = hBottom;
-            if (isTop) whichWall = TOP; else whichWall = BOTTOM;
-            string useThisToParse = thisHit;
-            int pos=useThisToParse.find('.');
-            for (int j=0;j<4;j++)
-            {
-              useThisToParse=useThisToParse.substr(pos+1);
-              pos=useThisToParse.find('.');
-            }
-            
-            std::string::size_type sz;   // alias of size_t
-            yValue=((isFrance^isTop)?1:0); // We flip this so that French side is inwards on the print
-            xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-            //cout<<iEntry<<" : " <<(isFrance?"Fr.":"It")<<" "<<(isTop?"top ":"bottom ")<<xValue<<endl;
-          }
-          else
-          {
-            cout<<"WARNING -- Calo hit found with unknown wall type "<<wallType<<endl;
-            continue; // We can't plot it if we don't know where to plot it
-          }
-          
-          // Now we know which histogram and the coordinates so write it
-          if (whichWall>=0)
-          {
-            hists.at(whichWall)->Fill(xValue,yValue);
-            if (isAverage)
-            {
-              ave_hists.at(whichWall)->Fill(xValue,yValue,toAverage->at(i)); // Sum it for now and we will divide out by number of hits
-              var_hists.at(whichWall)->Fill(xValue,yValue, pow(toAverage->at(i),2)  ); // Sum the squares for variance calculation
-            }
-          }
-          else
-          {
-            cout<<"WARNING -- Calo hit found with unknown wall type "<<endl;
-            continue; // We can't plot it if we don't know where to plot it
-          }
-        }// end parsable string
+        chunk.caloHits.push_back(caloHits->at(i));
+        if (isAverage) chunk.values.push_back(toAverage->Value(i));
+      }
+      chunk.EndEvent(weight, interval, problems);
+    }
+    return true;
+  };
+  // Decode the geometry IDs into walls and cells; this is the slow part
+  ChunkDecoder decodeChunk = [](MapChunk &chunk)
+  {
+    size_t nHits = chunk.Hits();
+    chunk.walls.resize(nHits);
+    chunk.xs.resize(nHits);
+    chunk.ys.resize(nHits);
+    chunk.cells.resize(nHits);
+    for (size_t event=0; event<chunk.Events(); event++)
+    {
+      for (size_t i=chunk.offsets[event]; i<chunk.offsets[event+1]; i++)
+      {
+        // Anything we can't place on the map is skipped when filling
+        if (!DecodeCaloHit(chunk.caloHits[i], chunk.walls[i], chunk.xs[i], chunk.ys[i])) chunk.walls[i] = -1;
+        chunk.cells[i] = CaloCellId(chunk.walls[i], chunk.xs[i], chunk.ys[i]);
+        if (chunk.walls[i] < 0) chunk.problems[event] |= HIT_UNPARSEABLE;
+        else if (chunk.cells[i] < 0) chunk.problems[event] |= HIT_OFF_MAP;
+      }
+    }
+    chunk.caloHits.clear(); // Not needed any more
+  };
+  // And fill the histograms, counting the events whose hits had something wrong with them
+  HitProblems problems;
+  auto fillHit = [&](int whichWall, int xValue, int yValue, int cell, double value, double weight, int interval)
+  {
+    // Now we know which histogram and the coordinates so write it
+    hists.at(whichWall)->Fill(xValue,yValue,weight);
+    if (slices) slices->Fill(interval, cell, weight);
+    if (isAverage)
+    {
+      ave_hists.at(whichWall)->Fill(xValue,yValue,value*weight); // Sum it for now and we will divide out by number of hits
+      var_hists.at(whichWall)->Fill(xValue,yValue, pow(value,2)*weight  ); // Sum the squares for variance calculation
+      if (distributions) distributions->Fill(cell, value, weight);
+    }
+  };
+  ChunkFiller fillChunk = [&](const MapChunk &chunk)
+  {
+    for (size_t event=0; event<chunk.Events(); event++)
+    {
+      double weight = chunk.weights[event];
+      int interval = chunk.intervals[event];
+      if (slices) slices->AddEvent(interval, weight);
+      problems.Count(chunk.problems[event]);
+      for (size_t i=chunk.offsets[event]; i<chunk.offsets[event+1]; i++)
+      {
+        if (chunk.cells[i] < 0) continue; // Not on the map, so left out as it is from the hit index
+        fillHit(chunk.walls[i], chunk.xs[i], chunk.ys[i], chunk.cells[i], isAverage?chunk.values[i]:0, weight, interval);
       } // end for each hit
-    } // End if there are calo hits
+    }
+  };
+  if (fromFeed) sampleFeed->AddMap(fullBranchName, hists, ave_hists, var_hists, problems);
+  else if (index)
+  {
+    // The cells and values are used where they are in the index file, without copying them
+    for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
+    {
+      Long64_t treeEntry = thisTree->GetEntryNumber(iEntry); // Skips entries we aren't sampling
+      double weight = EventWeight(weightFormula, thisTree, treeEntry);
+      int interval = slices?slices->Interval(EventTime(timeFormula, thisTree, treeEntry)):-1;
+      TraceLoopChunk(iEntry, nEntries, chunkStart);
+      if (slices) slices->AddEvent(interval, weight);
+      problems.Count(index->problems[treeEntry]);
+      for (Long64_t i=index->offsets[treeEntry]; i<index->offsets[treeEntry+1]; i++)
+      {
+        int whichWall, xValue, yValue;
+        CaloCellPosition(index->cells[i], whichWall, xValue, yValue);
+        if (whichWall < 0) continue; // Couldn't be placed on a wall
+        fillHit(whichWall, xValue, yValue, index->cells[i], isAverage?index->values[i]:0, weight, interval);
+      }
+    }
+    CloseHitIndex(index);
+  }
+  else if (pipelineThreads <= 0)
+  {
+    // On one thread there is nothing to overlap, so each hit is decoded and filled as soon as it is read
+    for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
+    {
+      Long64_t treeEntry = thisTree->GetEntryNumber(iEntry); // Skips entries we aren't sampling
+      ReadMapEntry(treeEntry, readBranches, readSeconds);
+      double weight = EventWeight(weightFormula, thisTree, treeEntry);
+      int interval = slices?slices->Interval(EventTime(timeFormula, thisTree, treeEntry)):-1;
+      TraceLoopChunk(iEntry, nEntries, chunkStart);
+      if (slices) slices->AddEvent(interval, weight);
+      size_t nHits = caloHits->size();
+      int eventProblems = (isAverage && toAverage->Size() != nHits)?HIT_LENGTH_MISMATCH:0;
+      if (isAverage && toAverage->Size() < nHits) nHits = toAverage->Size(); // Protect against a short list of values
+      for (size_t i=0;i<nHits;i++)
+      {
+        int whichWall, xValue, yValue;
+        if (!DecodeCaloHit(caloHits->at(i), whichWall, xValue, yValue))
+        {
+          eventProblems |= HIT_UNPARSEABLE;
+          continue;
+        }
+        int cell = CaloCellId(whichWall, xValue, yValue);
+        if (cell < 0)
+        {
+          eventProblems |= HIT_OFF_MAP;
+          continue; // Left out, as it is from the hit index
+        }
+        fillHit(whichWall, xValue, yValue, cell, isAverage?toAverage->Value(i):0, weight, interval);
+      }
+      problems.Count(eventProblems);
+    }
   }
+  else RunMapPipeline(readChunk, decodeChunk, fillChunk, pipelineThreads, PIPELINE_QUEUE_CHUNKS);
+  AddProfileTime("Read calorimeter branches","io",readSeconds,TFile::GetFileBytesRead()-bytesAtStart);
+  ReportHitProblems(isAverage?fullBranchName:mapBranch, mapBranch, problems, nEntries, isRef);
+  if (thisTree) thisTree->ResetBranchAddresses(); // These point at our local vectors
+  delete caloHits;
+  delete toAverage;
+  delete weightFormula;
+  delete timeFormula;
   if (isAverage)
   {
     for (int i=0;i<hists.size();i++)
@@ -998,11 +2291,12 @@ vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string t
       // Variance on the MEAN is then variance of sample / number of hits
       // Take the square root of that to get the error on the mean, which is what we need here
       // Thank you Glen Cowan, "Statistical data analysis"
+      // With weights, n is the effective number of hits
       for (int x = 1; x<=hists.at(i)->GetNbinsX(); x++)
       {
         for (int y = 1; y<=hists.at(i)->GetNbinsY(); y++)
         {
-          double nHits = hists.at(i)->GetBinContent(x,y);
+          double nHits = EffectiveHits(hists.at(i),x,y);
           if (nHits>1)
           {
             double meanSquared= pow(ave_hists.at(i)->GetBinContent(x,y),2);
@@ -1016,14 +2310,17 @@ vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string t
           }
         }
       }
+      if (isRef) CacheReference(ave_hists.at(i));
       ave_hists.at(i)->Write("",TObject::kOverwrite); // Write the average histograms
+      delete hists.at(i);
+      delete var_hists.at(i);
     }
     return ave_hists;
   }
   else
   {
     // Write the histograms to a file
-    double scale=(double)tree->GetEntries()/thisTree->GetEntries(); // Scale to the main tree, if it is a reference tree - otherwise scale is just 1
+    double scale=isRef?SampleWeight()/SelectedWeight(thisTree):1; // Scale to the sample, if it is a reference tree - otherwise scale is just 1
     for (int i=0;i<hists.size();i++)
     {
       // If count is 0, set uncertainty to 1
@@ -1035,15 +2332,133 @@ vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string t
           if (nHits==0) hists.at(i)->SetBinError(x,y, 1);
         }
       }
-      if (isRef) hists.at(i)->Scale(scale);
-      hists.at(i)->Write("",TObject::kOverwrite);
+      if (isRef) CacheReference(hists.at(i)); // Before normalising, as the sample size can differ between runs
+      if (isRef) hists.at(i)->Scale(scale);
+      hists.at(i)->Write("",TObject::kOverwrite);
+      delete ave_hists.at(i);
+      delete var_hists.at(i);
+    }
+    return hists;
+  }
+  
+  return hists;
+}
+
+
+/**
+ *  Decode a calorimeter geometry ID string, something like [1302:0.1.0.10.*],
+ *  into the wall it is on and its x and y position in that wall's histogram.
+ *  Returns false if the string can't be placed on a wall
+ */
+bool DecodeCaloHit(const string &thisHit, int &whichWall, int &xValue, int &yValue)
+try
+{
+  whichWall=-1;
+  if (thisHit.length()>=9)
+  {
+    bool isFrance=(thisHit.substr(8,1)=="1");
+    //Now to decode it
+    string wallType = thisHit.substr(1,4);
+    
+    if (wallType=="1302") // Main walls
+    {
+      
+      //if (isFrance) whichHistogram = hFrance; else whichHistogram = hItaly;
+      if (isFrance) whichWall = FRANCE; else whichWall = ITALY;
+      string useThisToParse = thisHit;
+      
+      // Hacky way to get the bit between the 2nd and 3rd "." characters for x
+      int pos=useThisToParse.find('.');
+      useThisToParse=useThisToParse.substr(pos+1);
+      pos=useThisToParse.find('.');
+      useThisToParse=useThisToParse.substr(pos+1);
+      pos=useThisToParse.find('.');
+      std::string::size_type sz;   // alias of size_t
+      xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
+      
+      // and the bit before the next . characters for y
+      useThisToParse=useThisToParse.substr(pos+1);
+      pos=useThisToParse.find_first_of('.');
+      yValue = std::stoi (useThisToParse.substr(0,pos),&sz);
+      
+      // The numbering is from mountain to tunnel
+      // But we draw the Italian side as we see it, with the mountain on the left
+      // So let's flip it around
+      if (!isFrance)xValue = -1 * (xValue + 1);
+      //cout<<iEntry<<" : " <<thisHit<<" : " <<(isFrance?"Fr.":"It")<<" - "<<xValue<<":"<<yValue<<endl;
+    }
+    else if (wallType == "1232") //x walls
+    {
+      bool isTunnel=(thisHit.substr(10,1)=="1");
+//            if (isTunnel) whichHistogram = hTunnel; else whichHistogram = hMountain;
+      if (isTunnel) whichWall=TUNNEL; else whichWall = MOUNTAIN;
+      // Hacky way to get the bit between the 3rd and 4th "." characters for x
+      string useThisToParse = thisHit;
+      int pos=0;
+      for (int j=0;j<3;j++)
+      {
+        int pos=useThisToParse.find('.');
+        useThisToParse=useThisToParse.substr(pos+1);
+      }
+      pos=useThisToParse.find('.');
+      std::string::size_type sz;   // alias of size_t
+      xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
+      
+      // and the bit before the next . characters for y
+      useThisToParse=useThisToParse.substr(pos+1);
+      pos=useThisToParse.find_first_of('.');
+      yValue = std::stoi (useThisToParse.substr(0,pos),&sz);
+      if (!isFrance)xValue = -1 * (xValue + 1); // Italy is on the left so reverse these to draw them
+      
+      if (isTunnel) // Switch it so France is on the left for the tunnel side
+      {
+        xValue = -1 * (xValue + 1);
+      }
+      
+      //cout<<iEntry<<" : " <<thisHit<<" : " <<(isFrance?"Fr.":"It")<<" - "<<(isTunnel?"tunnel":"mountain")<<" - "<<xValue<<":"<<yValue<<endl;
+      
+    }
+    else if (wallType == "1252") // veto walls
+    {
+      bool isTop=(thisHit.substr(10,1)=="1");
+//            if (isTop) whichHistogram = hTop; else whichHistogram = hBottom;
+      if (isTop) whichWall = TOP; else whichWall = BOTTOM;
+      string useThisToParse = thisHit;
+      // Column is between the 3rd and 4th "." characters: [1252:module.side.wall.column.*]
+      int pos=useThisToParse.find('.');
+      for (int j=0;j<3;j++)
+      {
+        useThisToParse=useThisToParse.substr(pos+1);
+        pos=useThisToParse.find('.');
+      }
+      
+      std::string::size_type sz;   // alias of size_t
+      yValue=((isFrance^isTop)?1:0); // We flip this so that French side is inwards on the print
+      xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
+      //cout<<iEntry<<" : " <<(isFrance?"Fr.":"It")<<" "<<(isTop?"top ":"bottom ")<<xValue<<endl;
     }
-    return hists;
-  }
-  
-  return hists;
+    else
+    {
+      return false; // We can't plot it if we don't know where to plot it; it is counted as a problem
+    }
+    return (whichWall>=0);
+  }// end parsable string
+  return false;
+}
+catch (exception &e)
+{
+  // A badly formatted geom ID can make any of the substr or stoi calls throw, so it is
+  // counted as one that can't be decoded rather than stopping the job
+  whichWall=-1;
+  return false;
 }
 
+// Decode an encoded tracker cell into its layer (x) and row (y) position on the tracker map
+void DecodeTrackerHit(int encodedHit, int &xValue, int &yValue)
+{
+  yValue=TMath::Abs(encodedHit/100);
+  xValue=encodedHit%100;
+}
 
 
 /**
@@ -1051,20 +2466,11 @@ vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string t
  */
 void PlotTrackerMap(string branchName)
 {
+  ProfileScope profile("PlotTrackerMap","total");
 
   string config="";
   config=configParams[branchName]; // get the config loaded from the file if there is one
   
-  // Can we do a comparison to the reference for this plot?
-  bool hasReferenceBranch=hasValidReference;
-  
-  // Check whether the reference file contains this branch
-  if (hasValidReference)
-  {
-    hasReferenceBranch=reftree->GetBranchStatus(branchName.c_str());
-    if (!hasReferenceBranch) cout<<"WARNING: branch "<<branchName<<" not found in reference file. No comparison plots will be made for this branch"<<endl;
-  }
-  
   string title="";
   // Load the title from the config file
   if (config.length()>0)
@@ -1089,16 +2495,11 @@ void PlotTrackerMap(string branchName)
     mapBranch=branchName.substr(pos+1);
     
     // Check whether the sample file and the reference file contain the map branch
-    if (!tree->GetBranchStatus(mapBranch.c_str()))
+    if (!SampleHasBranch(mapBranch))
     {
       cout<<"WARNING: map branch "<<mapBranch<<" not found in sample file. No plots can be made for the branch "<<branchName<<endl;
       return; // We can't do the plot at all
     }
-    if (hasReferenceBranch) // so far it is alright... but does the reference have the map branch?
-    {
-      hasReferenceBranch=reftree->GetBranchStatus(mapBranch.c_str());
-      if (!hasReferenceBranch) cout<<"WARNING: map branch "<<mapBranch<<" not found in reference file. No comparison plots can be made for the branch "<<branchName<<endl;
-    }
     branchName=branchName.substr(0,pos);
     isAverage=true;
   }
@@ -1111,7 +2512,13 @@ void PlotTrackerMap(string branchName)
 
   // Make the plot
   TCanvas *c = new TCanvas (("plot_"+branchName).c_str(),("plot_"+branchName).c_str(),600,1200);
-  TH2D *h=TrackerMapHistogram(fullBranchName,branchName, title, false, isAverage, mapBranch);
+  // The distribution of the value in each cell, if we are comparing those too
+  CellDistributions *distributions = isAverage?MakeCellDistributions(fullBranchName, config, TrackerCellCount()):0;
+  // And how many hits each cell has in each interval of time, if we are checking that
+  TimeSlices *slices = isAverage?0:MakeTimeSlices(TrackerCellCount());
+  TH2D *h=TrackerMapHistogram(fullBranchName,branchName, title, false, isAverage, mapBranch, distributions, slices);
+  TH2D *hDist = SaveCellDistributions(distributions, "dist_"+branchName, title, false);
+  ReportTimeSlices(slices, branchName, title, true);
   if( h->GetSumw2N() == 0 )h->Sumw2();
   h->Draw("COLZ0");
   c->SetRightMargin(0.15);
@@ -1120,18 +2527,28 @@ void PlotTrackerMap(string branchName)
   
   // Save to a ROOT file and to a PNG
   h->Write("",TObject::kOverwrite);
-  c->SaveAs((plotdir+"/"+branchName+".png").c_str());
+  SaveCanvas(c, plotdir+"/"+branchName+".png");
+  RecordMapHistory(branchName, vector<TH2D*>(1,h), isAverage, true);
   
-  // If there is a reference plot, make a pull plot
-  if (hasReferenceBranch)
+  // Compare with each reference in turn, making a pull plot for each one that has this branch
+  for (int iRef=0;iRef<references.size();iRef++)
   {
-    TH2D *href=TrackerMapHistogram(fullBranchName,branchName, title, true, isAverage, mapBranch);
+    SetCurrentReference(iRef);
+    if (!ReferenceHasBranch(fullBranchName)) continue;
+    if (isAverage && !ReferenceHasBranch(mapBranch)) continue; // the reference needs the map branch too
+    CellDistributions *refDistributions = hDist?CopyBinning(hDist):0;
+    TH2D *href=TrackerMapHistogram(fullBranchName,branchName, title, true, isAverage, mapBranch, refDistributions);
+    TH2D *hRefDist = SaveCellDistributions(refDistributions, "ref_dist_"+branchName+RefSuffix(), title, true);
     if( href->GetSumw2N() == 0 )href->Sumw2();
     
-    double scale=(double)tree->GetEntries()/(double)reftree->GetEntries();
+    double scale=SampleWeight()/SelectedWeight(reftree);
     if (!isAverage) href->Scale(scale); // Normalise it if it is a plot of counts. Don't normalise it if it is an average plot; the number of entries shouldn't matter
 
-    Double_t ks = h->KolmogorovTest(href);
+    Double_t ks;
+    {
+      ProfileScope compareProfile("KolmogorovTest","compare");
+      ks = h->KolmogorovTest(href);
+    }
     Double_t chisq;
     Int_t ndf;
     Double_t p_value=ChiSquared(h, href, chisq, ndf, isAverage);
@@ -1140,9 +2557,17 @@ void PlotTrackerMap(string branchName)
     cout<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
     
     // Write to output file
-    textOut<<branchName<<":"<<endl;
-    textOut<<"KS score: "<<ks<<endl;
-    textOut<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+    textOut<<ResultHeading(branchName)<<"\n";
+    textOut<<"KS score: "<<ks<<"\n";
+    textOut<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<"\n";
+    BranchResult &result = StartBranchResult(branchName, isAverage?"tracker average":"tracker map", references.at(iRef).label);
+    result.sampleEntries = SampleEntries();
+    result.referenceEntries = SelectedEntries(reftree);
+    result.ks = ks;
+    result.chisq = chisq;
+    result.ndf = ndf;
+    result.pValue = p_value;
+    ToyPValues(vector<TH1*>(1,h), vector<TH1*>(1,href), isAverage, true, result);
     
     TH2D *hPull = PullPlot2D(h,href);
     CheckTrackerPull(hPull,title);
@@ -1152,14 +2577,18 @@ void PlotTrackerMap(string branchName)
     OverlayWhiteForNaN(hPull);
     AnnotateTrackerMap();
     hPull->Write("",TObject::kOverwrite);
-    c->SaveAs((plotdir+"/pull_"+branchName+".png").c_str());
+    SaveCanvas(c, plotdir+"/pull_"+branchName+RefSuffix()+".png");
     
     gStyle->SetPalette(PALETTE);
     delete hPull;
-    textOut<<endl;
+    delete href;
+    CompareCellDistributions(hDist, hRefDist, true);
+    delete hRefDist;
+    textOut<<"\n";
   }
   
   delete h;
+  delete hDist;
   delete c;
 
 }
@@ -1168,10 +2597,10 @@ void PlotTrackerMap(string branchName)
 void AnnotateTrackerMap()
 {
     // Annotate to make it clear what the detector layout is
-    TLine *foil=new TLine(0,0,0,113);
-    foil->SetLineColor(kGray);
-    foil->SetLineWidth(5);
-    foil->Draw("SAME");
+    TLine foil; // DrawLine draws a copy that belongs to the pad
+    foil.SetLineColor(kGray);
+    foil.SetLineWidth(5);
+    foil.DrawLine(0,0,0,113);
   
     // Decorate the print
     WriteLabel(.16,.5,"Italy");
@@ -1183,11 +2612,12 @@ void AnnotateTrackerMap()
 // Calculate the pull between two 2d histograms
 TH2D *PullPlot2D(TH2D *hSample, TH2D *hRef )
 {
+  ProfileScope profile("PullPlot2D","compare");
   
   if( hSample->GetSumw2N() == 0 )  hSample->Sumw2();
   if( hRef->GetSumw2N() == 0 )hRef->Sumw2();
   TH2D *hPull = (TH2D*)hSample->Clone();
-  hPull->SetName(Form("pull_%s",hPull->GetName()));
+  hPull->SetName(Form("pull_%s%s",hPull->GetName(),RefSuffix().c_str()));
   hPull->SetTitle(Form("Pull: %s",hPull->GetTitle()));
   hPull->ClearUnderflowAndOverflow (); // There shouldn't be anything in them anyway but let's be sure
   
@@ -1219,6 +2649,7 @@ TH2D *PullPlot2D(TH2D *hSample, TH2D *hRef )
 // any problems
 double CheckTrackerPull(TH2D *hPull, string title)
 {
+  ProfileScope profile("CheckTrackerPull","compare");
   bool problemPulls=false;
   double totalPull=0;
   int pullCells=0;
@@ -1242,22 +2673,21 @@ double CheckTrackerPull(TH2D *hPull, string title)
       }
       else
       {
-        if (x > MAX_TRACKER_LAYERS)
-          textOut<<"Layer "<<x - MAX_TRACKER_LAYERS<<" (France), row "<<y<<": not enough data to calculate pull"<<endl;
-        else textOut<<"Layer "<< MAX_TRACKER_LAYERS + 1 - x<<" (Italy), row "<<y<<": not enough data to calculate pull"<<endl;      }
+        textOut<<TrackerCellLocation(x,y)<<": not enough data to calculate pull"<<"\n";
+        AddFlaggedCell("tracker", TrackerCellLocation(x,y), NAN);
+      }
       // Report any cells where sample and reference are too different
       if (TMath::Abs(pull) > REPORT_PULLS_OVER)
       {
-        if (x > MAX_TRACKER_LAYERS)
-          textOut<<"Layer "<<x - MAX_TRACKER_LAYERS<<" (France), row "<<y<<": pull = "<<pull<<endl;
-        else textOut<<"Layer "<< MAX_TRACKER_LAYERS + 1 - x<<" (Italy), row "<<y<<": pull = "<<pull<<endl;
+        textOut<<TrackerCellLocation(x,y)<<": pull = "<<pull<<"\n";
+        AddFlaggedCell("tracker", TrackerCellLocation(x,y), pull);
         problemPulls=true;
       }
     }
   }
   if (problemPulls)
   {
-    textOut<<"Layers are numbered 1 to 9, with 1 nearest the foil. Rows count from mountain (1) to tunnel ("<<MAX_TRACKER_ROWS<<")."<<endl;
+    textOut<<"Layers are numbered 1 to 9, with 1 nearest the foil. Rows count from mountain (1) to tunnel ("<<MAX_TRACKER_ROWS<<")."<<"\n";
   }
   
   // Check whether the distributions are identical (all pulls 0)
@@ -1265,30 +2695,587 @@ double CheckTrackerPull(TH2D *hPull, string title)
   if ( (hPull->GetBinContent(hPull->GetMaximumBin())) == 0 && (hPull->GetBinContent(hPull->GetMinimumBin())) == 0)
   {
     cout<<"Pull is zero - plots are identical"<<endl;
-    textOut<<"Pull is zero - plots are identical"<<endl;
+    textOut<<"Pull is zero - plots are identical"<<"\n";
+    CurrentBranchResult().identical = true;
   }
   else
   {
     // If not, plot all the pulls and fit to a Gaussian
     PrintPlotOfPulls(h1Pulls,pullCells,title);
   }
+  delete h1Pulls;
   return totalPull;
 }
 
+// Add the mean and RMS of a sample histogram to the history
+void RecordHistogramHistory(string branchName, TH1D *hist)
+{
+  if (historyFileName.length()==0) return;
+  AddHistoryValue(branchName, "mean", hist->GetMean(), hist->GetMeanError());
+  AddHistoryValue(branchName, "rms", hist->GetRMS(), hist->GetRMSError());
+}
+
+/**
+ *  Add the value in every cell of a sample map to the history (one histogram for the tracker,
+ *  one per wall for the calorimeter). Counts are per event, so runs of different sizes can be
+ *  compared, and there is a total for the whole map. Cells of an average map with nothing to
+ *  average over are left out
+ */
+void RecordMapHistory(string branchName, vector<TH2D*> hists, bool isAverage, bool isTracker)
+{
+  if (historyFileName.length()==0) return;
+  double nEntries = SampleWeight(); // Summed weights, if the events are weighted
+  if (nEntries <= 0) return;
+  double totalHits = 0;
+  double totalErrorSquared = 0;
+  for (int i=0;i<hists.size();i++)
+  {
+    TH2D *hist = hists.at(i);
+    for (int x=1;x<=hist->GetNbinsX();x++)
+    {
+      for (int y=1;y<=hist->GetNbinsY();y++)
+      {
+        string location = isTracker?TrackerCellLocation(x,y):CaloCellLocation(i,x,y);
+        double content = hist->GetBinContent(x,y);
+        double error = hist->GetBinError(x,y);
+        if (isAverage)
+        {
+          if (content==0 && error==0) continue;
+          AddHistoryValue(branchName, location, content, error);
+        }
+        else
+        {
+          if (content==0) error=0; // It was set to 1 for the pulls
+          totalHits += content;
+          totalErrorSquared += error * error;
+          AddHistoryValue(branchName, location, content / nEntries, error / nEntries);
+        }
+      }
+    }
+  }
+  if (!isAverage) AddHistoryValue(branchName, "hits per event", totalHits / nEntries, TMath::Sqrt(totalErrorSquared) / nEntries);
+}
+
+// Describe a bin of one of the calorimeter wall maps as a detector location, e.g. "French main wall: module (3,5)"
+string CaloCellLocation(int wall, int x, int y)
+{
+  string reportString;
+  // Unfortunately the numbering scheme maps differently to the bin numbers for each wall
+  string intExt="external"; // Translate x coordinate to position for X walls and vetoes
+  string side="French";
+  switch (wall)
+  {
+    case 0: // Italy
+      reportString=Form("Italian main wall: module (%d,%d)",20-x,y-1);
+      break;
+    case 1: // France
+      reportString=Form("French main wall: module (%d,%d)",x-1,y-1);
+      break;
+    case 2: // Tunnel
+      if (x>2) side = "Italian"; // Translate x bin to location
+      if (x==2 || x ==3) intExt="internal";
+      reportString=Form("Tunnel X-wall: module %d (",y-1)+side+" side "+intExt+")";
+      break;
+    case 3: // Mountain
+      if (x<3) side = "Italian"; // Translate x bin to location
+      if (x==2 || x ==3) intExt="internal";
+      reportString=Form("Mountain X-wall: module %d (",y-1)+side+" side "+intExt+")";
+      break;
+    case 4: // Top
+      if (y==2) side = "Italian"; // Translate y bin to location
+      reportString=Form("Top veto wall: module %d (",x-1)+side+" side)";
+      break;
+    case 5: // Bottom
+      if (y==1) side = "Italian"; // Translate y bin to location
+      reportString=Form("Bottom veto wall: module %d (",x-1)+side+" side)";
+      break;
+    default:
+      break;
+      reportString=Form("ERROR: pull found for unknown calorimeter wall %d: this is a bug!",wall);
+  }
+  return reportString;
+}
+
+// Describe a tracker map bin as a detector location, e.g. "Layer 3 (France), row 50"
+string TrackerCellLocation(int x, int y)
+{
+  if (x > MAX_TRACKER_LAYERS) return Form("Layer %d (France), row %d", x - MAX_TRACKER_LAYERS, y);
+  return Form("Layer %d (Italy), row %d", MAX_TRACKER_LAYERS + 1 - x, y);
+}
+
+// Dense cell numbers for the per-cell value distributions: every tracker cell, layer by layer
+int TrackerCellCount()
+{
+  return 2 * MAX_TRACKER_LAYERS * MAX_TRACKER_ROWS;
+}
+
+// The cell number of a decoded tracker hit, or -1 if it is off the map
+int TrackerCellId(int xValue, int yValue)
+{
+  if (xValue < -MAX_TRACKER_LAYERS || xValue >= MAX_TRACKER_LAYERS || yValue < 0 || yValue >= MAX_TRACKER_ROWS) return -1;
+  return (xValue + MAX_TRACKER_LAYERS) * MAX_TRACKER_ROWS + yValue;
+}
+
+// And every module on the 6 calorimeter walls, wall by wall
+int CaloCellCount()
+{
+  int nCells = 0;
+  for (int wall=0; wall<6; wall++) nCells += CALO_XBINS[wall] * CALO_YBINS[wall];
+  return nCells;
+}
+
+// The cell number of a decoded calorimeter hit, or -1 if it is off its wall
+int CaloCellId(int wall, int xValue, int yValue)
+{
+  if (wall < 0 || wall >= 6) return -1;
+  int x = xValue - CALO_XLO[wall];
+  if (x < 0 || x >= CALO_XBINS[wall] || yValue < 0 || yValue >= CALO_YBINS[wall]) return -1;
+  int firstCell = 0;
+  for (int i=0; i<wall; i++) firstCell += CALO_XBINS[i] * CALO_YBINS[i];
+  return firstCell + x * CALO_YBINS[wall] + yValue;
+}
+
+// Describe a cell number as a detector location
+string CellIdLocation(int cell, bool isTracker)
+{
+  if (isTracker) return TrackerCellLocation(cell / MAX_TRACKER_ROWS + 1, cell % MAX_TRACKER_ROWS + 1);
+  for (int wall=0; wall<6; wall++)
+  {
+    int wallCells = CALO_XBINS[wall] * CALO_YBINS[wall];
+    if (cell < wallCells) return CaloCellLocation(wall, cell / CALO_YBINS[wall] + 1, cell % CALO_YBINS[wall] + 1);
+    cell -= wallCells;
+  }
+  return Form("unknown cell %d", cell);
+}
+
+// Where a tracker cell number is on the map: the other way round from TrackerCellId
+void TrackerCellPosition(int cell, int &xValue, int &yValue)
+{
+  xValue = cell / MAX_TRACKER_ROWS - MAX_TRACKER_LAYERS;
+  yValue = cell % MAX_TRACKER_ROWS;
+}
+
+// And a calorimeter one, from CaloCellId. The wall is -1 if it isn't a cell
+void CaloCellPosition(int cell, int &wall, int &xValue, int &yValue)
+{
+  for (wall=0; wall<6; wall++)
+  {
+    int wallCells = CALO_XBINS[wall] * CALO_YBINS[wall];
+    if (cell >= 0 && cell < wallCells)
+    {
+      xValue = cell / CALO_YBINS[wall] + CALO_XLO[wall];
+      yValue = cell % CALO_YBINS[wall];
+      return;
+    }
+    cell -= wallCells;
+  }
+  wall = -1;
+}
+
+/**
+ *  The decoded hits of a map branch (with the values of the branch being averaged, if any)
+ *  for every entry of a tree, from --hit-index. The file is named after the fingerprints of
+ *  the branches, so it is made the first time a file is validated, and used by every later
+ *  run on the same file, whatever the references, config or selection. Returns 0 if we aren't
+ *  keeping an index, or the tree isn't in a file we can fingerprint
+ */
+HitIndex *GetHitIndex(TTree *inputTree, string mapBranch, string valueBranch, bool isTracker)
+{
+  if (hitIndexDir.length()==0) return 0;
+  string mapFingerprint = CachedBranchFingerprint(inputTree, mapBranch);
+  string valueFingerprint = (valueBranch.length()>0)?CachedBranchFingerprint(inputTree, valueBranch):"";
+  if (mapFingerprint.length()==0 || (valueBranch.length()>0 && valueFingerprint.length()==0)) return 0;
+  string fileName = hitIndexDir+"/"+FingerprintString(string(isTracker?"tracker ":"calo ")+mapFingerprint+" "+valueFingerprint)+".hitidx";
+
+  HitIndex *index = OpenHitIndex(fileName);
+  if (index==0)
+  {
+    boost::filesystem::create_directories(hitIndexDir);
+    if (!BuildHitIndex(inputTree, mapBranch, valueBranch, isTracker, fileName)) return 0;
+    index = OpenHitIndex(fileName);
+    if (index==0) return 0;
+  }
+  if (index->nEvents != inputTree->GetEntries() || (valueBranch.length()>0 && index->values==0))
+  {
+    cout<<"WARNING: hit index "<<fileName<<" doesn't match "<<mapBranch<<"; decoding it instead"<<endl;
+    CloseHitIndex(index);
+    return 0;
+  }
+  return index;
+}
+
+// Decode every entry of a map branch into a new index file
+bool BuildHitIndex(TTree *inputTree, string mapBranch, string valueBranch, bool isTracker, string fileName)
+{
+  ProfileScope profile("Build hit index","io");
+  bool hasValues = (valueBranch.length()>0);
+  BranchReader *trackerHits = 0;
+  std::vector<string> *caloHits = 0;
+  BranchReader *values = 0;
+  vector<TBranch*> readBranches;
+  bool good = true;
+  if (isTracker)
+  {
+    trackerHits = MakeBranchReader(inputTree, mapBranch);
+    if (trackerHits) readBranches = trackerHits->Branches();
+    else good = false;
+  }
+  else
+  {
+    TBranch *mapBr = 0;
+    inputTree->SetBranchAddress(mapBranch.c_str(), &caloHits, &mapBr);
+    if (mapBr) readBranches.push_back(mapBr);
+    else good = false;
+  }
+  if (hasValues)
+  {
+    values = MakeBranchReader(inputTree, valueBranch);
+    if (values) readBranches.insert(readBranches.end(), values->Branches().begin(), values->Branches().end());
+    else good = false;
+  }
+
+  HitIndexWriter *writer = good?new HitIndexWriter(fileName, hasValues):0;
+  good = good && writer->IsValid();
+  Long64_t nEntries = good?inputTree->GetEntries():0;
+  double readSeconds=0;
+  for (Long64_t treeEntry=0; treeEntry<nEntries; treeEntry++)
+  {
+    ReadMapEntry(treeEntry, readBranches, readSeconds);
+    size_t nHits = isTracker?trackerHits->Size():caloHits->size();
+    int problems = 0;
+    if (hasValues && values->Size() != nHits) problems |= HIT_LENGTH_MISMATCH;
+    if (hasValues && values->Size() < nHits) nHits = values->Size(); // Protect against a short list of values, as when filling
+    for (size_t i=0; i<nHits; i++)
+    {
+      int wall = 0;
+      int xValue = 0;
+      int yValue = 0;
+      int cell = -1;
+      if (isTracker)
+      {
+        DecodeTrackerHit((int)trackerHits->Value(i), xValue, yValue);
+        cell = TrackerCellId(xValue, yValue);
+        if (cell < 0) problems |= HIT_OFF_MAP;
+      }
+      else if (DecodeCaloHit(caloHits->at(i), wall, xValue, yValue))
+      {
+        cell = CaloCellId(wall, xValue, yValue);
+        if (cell < 0) problems |= HIT_OFF_MAP;
+      }
+      else problems |= HIT_UNPARSEABLE;
+      writer->AddHit(cell, hasValues?values->Value(i):0);
+    }
+    writer->EndEvent(problems);
+  }
+  inputTree->ResetBranchAddresses(); // These point at our local vectors
+  delete trackerHits;
+  delete caloHits;
+  delete values;
+  AddProfileTime("Read map branches for the hit index","io",readSeconds,0);
+  good = good && writer->Finish();
+  delete writer;
+  if (good) cout<<"Wrote hit index for "<<mapBranch<<" ("<<nEntries<<" entries) to "<<fileName<<endl;
+  return good;
+}
+
+/**
+ *  Set up the distributions of an averaged value in each cell, if --cell-distributions is on.
+ *  The binning can follow the title in the config file (bins, low, high). If it doesn't, the
+ *  range is taken from the values in the sample, and the reference uses the same binning.
+ *  Returns 0 if we aren't making them
+ */
+CellDistributions *MakeCellDistributions(string fullBranchName, string config, int nCells)
+{
+  if (cellDistributionBins <= 0 || sampleFeed) return 0; // Fed values aren't kept to fill them from
+  int nBins = cellDistributionBins;
+  double low = 0;
+  double high = 0;
+  try
+  {
+    int configBins = std::stoi(GetBitBeforeComma(config));
+    low = std::stod(GetBitBeforeComma(config));
+    high = std::stod(GetBitBeforeComma(config));
+    if (configBins > 0) nBins = configBins;
+  }
+  catch (exception &e)
+  {
+    high = low; // Not given, so work it out
+  }
+  if (high <= low && !ValueRange(tree, fullBranchName, low, high)) return 0;
+  CellDistributions *distributions = new CellDistributions();
+  distributions->Setup(nCells, nBins, low, high);
+  return distributions;
+}
+
+// Empty distributions with the same cells and binning as a filled one
+CellDistributions *CopyBinning(TH2D *hDist)
+{
+  CellDistributions *distributions = new CellDistributions();
+  distributions->Setup(hDist->GetNbinsX(), hDist->GetNbinsY(), hDist->GetYaxis()->GetXmin(), hDist->GetYaxis()->GetXmax());
+  return distributions;
+}
+
+/**
+ *  The range of the values in a branch over the entries we are using, with a little room at
+ *  the top so the largest value isn't in the overflow. Only reads that branch.
+ *  Returns false if there are no values
+ */
+bool ValueRange(TTree *inputTree, string branchName, double &low, double &high)
+{
+  ProfileScope profile("Find value range","io");
+  BranchReader *values = MakeBranchReader(inputTree, branchName);
+  if (values==0) return false;
+  bool found = false;
+  double readSeconds = 0;
+  Long64_t nEntries = SelectedEntries(inputTree);
+  for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
+  {
+    ReadMapEntry(inputTree->GetEntryNumber(iEntry), values->Branches(), readSeconds);
+    for (size_t i=0; i<values->Size(); i++)
+    {
+      double value = values->Value(i);
+      if (std::isnan(value) || std::isinf(value)) continue;
+      if (!found || value < low) low = value;
+      if (!found || value > high) high = value;
+      found = true;
+    }
+  }
+  inputTree->ResetBranchAddresses();
+  delete values;
+  if (!found)
+  {
+    cout<<"WARNING: no values in "<<branchName<<", so its distribution in each cell can't be compared"<<endl;
+    return false;
+  }
+  if (high <= low) high = low + 1;
+  else high += (high - low) / 1000.;
+  return true;
+}
+
+/**
+ *  Turn the filled distributions into a histogram (cell against value) and save it. For a
+ *  reference, one from the reference cache is used if it is there, and a new one is cached.
+ *  Takes ownership of the distributions; returns 0 if there weren't any
+ */
+TH2D *SaveCellDistributions(CellDistributions *distributions, string name, string title, bool isRef)
+{
+  if (distributions==0) return 0;
+  TH2D *hist = isRef?(TH2D*)GetCachedReference(name):0; // Empty distributions if the map came from the cache
+  if (hist==0)
+  {
+    hist = distributions->ToHistogram(name, title);
+    if (isRef) CacheReference(hist);
+  }
+  delete distributions;
+  hist->Write("",TObject::kOverwrite);
+  return hist;
+}
+
+/**
+ *  Compare the shape of the value distribution in each cell of the sample with the reference,
+ *  and report the cells where they differ by more than REPORT_PULLS_OVER sigma. Only cells
+ *  with at least MIN_CELL_DISTRIBUTION_HITS sample hits are compared
+ */
+void CompareCellDistributions(TH2D *hSample, TH2D *hRef, bool isTracker)
+{
+  if (hSample==0 || hRef==0) return;
+  ProfileScope profile("CompareCellDistributions","compare");
+  double pThreshold = TMath::Prob(REPORT_PULLS_OVER * REPORT_PULLS_OVER, 1); // Same as the pulls
+  int comparedCells = 0;
+  double totalChisq = 0;
+  int totalNdf = 0;
+  vector<string> reports;
+  for (int cellBin=1; cellBin<=hSample->GetNbinsX(); cellBin++)
+  {
+    double chisq, sampleHits;
+    int ndf;
+    double pValue = CellDistributionChiSquared(hSample, hRef, cellBin, chisq, ndf, sampleHits);
+    if (std::isnan(pValue) || sampleHits < MIN_CELL_DISTRIBUTION_HITS) continue;
+    comparedCells++;
+    totalChisq += chisq;
+    totalNdf += ndf;
+    if (pValue >= pThreshold) continue;
+    string location = CellIdLocation(cellBin - 1, isTracker);
+    double sigma = (pValue > 0)?TMath::NormQuantile(1 - pValue / 2):INFINITY;
+    reports.push_back(Form("%s: chi-square %g / %d DoF, p-value %g", location.c_str(), chisq, ndf, pValue));
+    AddFlaggedCell(isTracker?"tracker":"calorimeter", location+" (value distribution)", sigma);
+  }
+  textOut<<"Value distributions compared in "<<comparedCells<<" cells: chi-square "<<totalChisq<<" / "<<totalNdf<<" DoF, "<<reports.size()<<" cells differ by more than "<<REPORT_PULLS_OVER<<" sigma"<<"\n";
+  for (int i=0;i<reports.size();i++) textOut<<"  Value distribution differs in "<<reports.at(i)<<"\n";
+  cout<<"Value distributions: "<<reports.size()<<" of "<<comparedCells<<" cells differ by more than "<<REPORT_PULLS_OVER<<" sigma"<<endl;
+}
+
+/**
+ *  Find the range of the --time-branch over the sample entries we are using, which is split
+ *  into the intervals for every map. Only reads that branch. Returns false (with a warning)
+ *  if it can't be used
+ */
+bool FindTimeRange()
+{
+  ProfileScope profile("Find time range","io");
+  TTreeFormula *timeFormula = MakeTimeFormula(tree);
+  if (timeFormula==0) return false;
+  bool found = false;
+  Long64_t nEntries = SelectedEntries(tree);
+  for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
+  {
+    double time = EventTime(timeFormula, tree, tree->GetEntryNumber(iEntry));
+    if (std::isnan(time)) continue;
+    if (!found || time < firstTime) firstTime = time;
+    if (!found || time > lastTime) lastTime = time;
+    found = true;
+  }
+  delete timeFormula;
+  if (!found)
+  {
+    cout<<"WARNING: no values of "<<timeBranch<<" in the sample. Not splitting maps into intervals"<<endl;
+    return false;
+  }
+  cout<<"Splitting maps into "<<timeSlices<<" intervals of "<<timeBranch<<", from "<<firstTime<<" to "<<lastTime<<endl;
+  return true;
+}
+
+// Compile the --time-branch for a tree. Returns 0 (with a warning) if it can't be used
+TTreeFormula *MakeTimeFormula(TTree *inputTree)
+{
+  TTreeFormula *timeFormula = new TTreeFormula("time", timeBranch.c_str(), inputTree);
+  if (timeFormula->GetNdim() == 0)
+  {
+    cout<<"WARNING: could not use the time branch "<<timeBranch<<" for "<<TreeSourceName(inputTree)<<". Not splitting maps into intervals"<<endl;
+    delete timeFormula;
+    return 0;
+  }
+  return timeFormula;
+}
+
+// The time (or run number) of an entry, or NAN if there isn't one
+double EventTime(TTreeFormula *timeFormula, TTree *inputTree, Long64_t treeEntry)
+{
+  if (timeFormula==0) return NAN;
+  inputTree->LoadTree(treeEntry);
+  if (timeFormula->GetNdata() < 1) return NAN;
+  return timeFormula->EvalInstance(0);
+}
+
+// Empty time slices for a map with this many cells, or 0 if we aren't splitting maps up
+TimeSlices *MakeTimeSlices(int nCells)
+{
+  if (!timeSlicesEnabled) return 0;
+  TimeSlices *slices = new TimeSlices();
+  slices->Setup(timeSlices, nCells, firstTime, lastTime);
+  return slices;
+}
+
+/**
+ *  Save a plot of the hits per event in each cell (x) and interval (y), and report the cells
+ *  whose rate isn't steady over the intervals, beyond REPORT_PULLS_OVER sigma, with any
+ *  intervals where they had no hits at all. Takes ownership of the slices
+ */
+void ReportTimeSlices(TimeSlices *slices, string branchName, string title, bool isTracker)
+{
+  if (slices==0) return;
+  ProfileScope profile("ReportTimeSlices","compare");
+  TH2D *hist = slices->ToHistogram("slices_"+branchName, title+" per event");
+  hist->GetYaxis()->SetTitle(timeBranch.c_str());
+  hist->Write("",TObject::kOverwrite);
+  TCanvas *c = new TCanvas(("slices_"+branchName).c_str(),("slices_"+branchName).c_str(),1200,600);
+  c->SetRightMargin(0.15);
+  hist->Draw("COLZ");
+  SaveCanvas(c, plotdir+"/slices_"+branchName+".png");
+  delete c;
+  delete hist;
+  
+  double pThreshold = TMath::Prob(REPORT_PULLS_OVER * REPORT_PULLS_OVER, 1); // Same as the pulls
+  int checkedCells = 0;
+  double totalChisq = 0;
+  int totalNdf = 0;
+  vector<string> reports;
+  BranchResult &result = StartBranchResult(branchName, isTracker?"tracker stability":"calorimeter stability");
+  for (int cell=0; cell<slices->nCells; cell++)
+  {
+    double chisq;
+    int ndf;
+    vector<int> emptyIntervals;
+    double pValue = slices->CellStability(cell, chisq, ndf, emptyIntervals);
+    if (std::isnan(pValue)) continue;
+    checkedCells++;
+    totalChisq += chisq;
+    totalNdf += ndf;
+    if (pValue >= pThreshold && emptyIntervals.empty()) continue;
+    string location = CellIdLocation(cell, isTracker);
+    string report = Form("%s: chi-square %g / %d DoF, p-value %g", location.c_str(), chisq, ndf, pValue);
+    if (!emptyIntervals.empty())
+    {
+      report += "; no hits in interval";
+      for (int i=0;i<emptyIntervals.size();i++) report += Form(" %d",emptyIntervals.at(i)+1);
+    }
+    reports.push_back(report);
+    double sigma = (pValue > 0)?TMath::NormQuantile(1 - pValue / 2):INFINITY;
+    AddFlaggedCell(isTracker?"tracker":"calorimeter", location+" (stability)", sigma);
+  }
+  result.sampleEntries = SampleEntries();
+  result.chisq = totalChisq;
+  result.ndf = totalNdf;
+  result.pValue = (totalNdf>0)?TMath::Prob(totalChisq, totalNdf):NAN;
+  
+  textOut<<branchName<<" over "<<slices->nIntervals<<" intervals of "<<timeBranch<<" ("<<slices->first<<" to "<<slices->last<<"):"<<"\n";
+  textOut<<"Stability of "<<checkedCells<<" cells: chi-square "<<totalChisq<<" / "<<totalNdf<<" DoF, "<<reports.size()<<" cells are not steady"<<"\n";
+  for (int i=0;i<reports.size();i++) textOut<<"  Not steady: "<<reports.at(i)<<"\n";
+  textOut<<"\n";
+  cout<<"Stability over "<<timeBranch<<": "<<reports.size()<<" of "<<checkedCells<<" cells are not steady"<<endl;
+  delete slices;
+}
+
+/**
+ *  Say how many of the events used for a map had hits with something wrong with them. They
+ *  are still used; only the hits that can't be placed on the map (and any hits without a
+ *  value to average, or values without a hit) are left out. The hits themselves are the map
+ *  branch's, so their problems are only reported for it, not again for every branch
+ *  averaged over it
+ */
+void ReportHitProblems(string branchName, string mapBranch, const HitProblems &problems, Long64_t nEntries, bool isRef)
+{
+  if (!problems.Any()) return;
+  string which = isRef?"reference "+references.at(currentReference).label:"sample";
+  bool isAverage = (branchName != mapBranch);
+  vector<string> reports;
+  if (problems.lengthMismatch > 0) reports.push_back(Form("%lld events where %s doesn't have one value for each hit in %s", problems.lengthMismatch, branchName.c_str(), mapBranch.c_str()));
+  if (problems.unparseable > 0 && !isAverage) reports.push_back(Form("%lld events with locations in %s that couldn't be decoded", problems.unparseable, mapBranch.c_str()));
+  if (problems.offMap > 0 && !isAverage) reports.push_back(Form("%lld events with hits in %s outside the map", problems.offMap, mapBranch.c_str()));
+  for (int i=0;i<reports.size();i++)
+  {
+    cout<<"WARNING: "<<branchName<<" ("<<which<<", "<<nEntries<<" events): "<<reports.at(i)<<endl;
+    textOut<<"Problem with "<<branchName<<" ("<<which<<", "<<nEntries<<" events): "<<reports.at(i)<<"\n";
+  }
+}
+
 // Make the tracker map histogram (either counts or averages, depending on whether there is a map branch)
 // The formatting and decision-making about what goes into the histogram is done separately,
 // this just loops the tree and fills the histogram
-TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch)
+TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch, CellDistributions *distributions, TimeSlices *slices)
 {
+  ProfileScope profile(isRef?"TrackerMapHistogram (reference)":"TrackerMapHistogram","fill");
   TTree *inputTree = (isRef?reftree:tree);
 
+  // A campaign may already have filled this reference histogram
+  string refName = "ref_"+string(isAverage?"ave_":"plt_")+branchName+RefSuffix();
+  if (isRef)
+  {
+    TH2D *cached = (TH2D*)GetCachedReference(refName);
+    if (cached)
+    {
+      cached->SetTitle(title.c_str());
+      return cached;
+    }
+  }
+
   string tmpName="plt_"+branchName;
-  if (isRef) tmpName = "ref_"+tmpName;
+  if (isRef) tmpName = "ref_"+tmpName+RefSuffix(); // Each reference gets its own histograms
     TH2D *h = new TH2D(tmpName.c_str(),title.c_str(),MAX_TRACKER_LAYERS*2,MAX_TRACKER_LAYERS*-1,MAX_TRACKER_LAYERS,MAX_TRACKER_ROWS,0,MAX_TRACKER_ROWS); // Map of the tracker
   if( h->GetSumw2N() == 0 )h->Sumw2(); // Important to get errors right
   
     tmpName="ave_"+branchName;
-    if (isRef) tmpName = "ref_"+tmpName;
+    if (isRef) tmpName = "ref_"+tmpName+RefSuffix();
     TH2D *hAve = new TH2D(tmpName.c_str(),title.c_str(),MAX_TRACKER_LAYERS*2,MAX_TRACKER_LAYERS*-1,MAX_TRACKER_LAYERS,MAX_TRACKER_ROWS,0,MAX_TRACKER_ROWS); // Map of the tracker
   
     if( hAve->GetSumw2N() == 0 )hAve->Sumw2(); // Important to get errors right
@@ -1301,45 +3288,169 @@ TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title
     // This decodes the encoded tracker map to extract the x and y positions
   
     // Unfortunately it is not so easy to make the averages plot so we need to loop the tuple
-    std::vector<int> *trackerHits = 0;
-    std::vector<double> *toAverageTrk = 0;
-    TTree *thisTree=inputTree->CopyTree("");
-    thisTree->SetBranchAddress(mapBranch.c_str(), &trackerHits);
-
-    if (isAverage)
+    // The hits and the values can be stored as vectors or arrays of any type of number
+    // With --hit-index they have already been decoded, and we don't need to read them at all.
+    // Nor if they were fed, since the feed has already filled its own maps
+    bool fromFeed = (!isRef && sampleFeed);
+    HitIndex *index = fromFeed?0:GetHitIndex(inputTree, mapBranch, isAverage?fullBranchName:"", true);
+    BranchReader *trackerHits = 0;
+    BranchReader *toAverageTrk = 0;
+    vector<TBranch*> readBranches; // Everything we need to read for each entry
+    if (!index && !fromFeed)
     {
-      thisTree->SetBranchAddress(fullBranchName.c_str(), &toAverageTrk);
+      trackerHits = MakeBranchReader(inputTree, mapBranch);
+      if (trackerHits) readBranches = trackerHits->Branches();
+      if (isAverage)
+      {
+        toAverageTrk = MakeBranchReader(inputTree, fullBranchName);
+        if (toAverageTrk) readBranches.insert(readBranches.end(), toAverageTrk->Branches().begin(), toAverageTrk->Branches().end());
+      }
     }
+    TTreeFormula *weightFormula = MakeWeightFormula(inputTree); // 0 if unweighted
+    TTreeFormula *timeFormula = slices?MakeTimeFormula(inputTree):0;
 
     // Now we can fill the two plots
-    // Loop through the tree
-  
-    int nEntries = thisTree -> GetEntries();
-    for( int iEntry = 0; iEntry < nEntries; iEntry++ )
+    // Loop through the tree, reading only the branches we need
+  
+    Long64_t nEntries = fromFeed?SampleEntries():SelectedEntries(inputTree);
+    if (!index && !fromFeed && (trackerHits==0 || (isAverage && toAverageTrk==0))) nEntries=0; // Can't read them; the error has been printed
+    double readSeconds=0; // Time spent reading and unzipping, as opposed to decoding and filling
+    Long64_t bytesAtStart=TFile::GetFileBytesRead();
+    double chunkStart=ProfileSeconds();
+    Long64_t iEntry = 0;
+    // Read a chunk of entries: the only stage that touches the tree
+    ChunkReader readChunk = [&](MapChunk &chunk)
     {
-      thisTree->GetEntry(iEntry);
-      // Populate these with which histogram we will fill and what cell
-      int xValue=0;
-      int yValue=0;
-      if (trackerHits->size()>0)
+      if (iEntry >= nEntries) return false;
+      Long64_t lastEntry = TMath::Min(nEntries, iEntry + PIPELINE_CHUNK_ENTRIES);
+      for (; iEntry < lastEntry; iEntry++)
       {
-        for (int i=0;i<trackerHits->size();i++)
+        Long64_t treeEntry = inputTree->GetEntryNumber(iEntry); // Skips entries we aren't sampling
+        ReadMapEntry(treeEntry, readBranches, readSeconds);
+        double weight = EventWeight(weightFormula, inputTree, treeEntry);
+        int interval = slices?slices->Interval(EventTime(timeFormula, inputTree, treeEntry)):-1;
+        TraceLoopChunk(iEntry, nEntries, chunkStart);
+        size_t nHits = trackerHits->Size();
+        int problems = (isAverage && toAverageTrk->Size() != nHits)?HIT_LENGTH_MISMATCH:0;
+        if (isAverage && toAverageTrk->Size() < nHits) nHits = toAverageTrk->Size(); // Protect against a short list of values
+        for (size_t i=0;i<nHits;i++)
         {
-          yValue=TMath::Abs(trackerHits->at(i)/100);
-          xValue=trackerHits->at(i)%100;
-          if (isAverage && !std::isnan(toAverageTrk->at(i)))
-          {
-            hAve->Fill(xValue,yValue,toAverageTrk->at(i)); // Ignore the uncertainties
-            hQuantitySquared->Fill(xValue,yValue,pow(toAverageTrk->at(i),2)); // We will use this to calculate uncertainty
-            h->Fill(xValue,yValue); // Only fill this if there is something to average over! We don't want to divide by a denominator that includes hits with no useful info. Obviously the best thing would be to not put that stuff in the tuple in the first place, but this works as a protection in case you do
-          }
-          if (!isAverage)
+          chunk.trackerHits.push_back((int)trackerHits->Value(i));
+          if (isAverage) chunk.values.push_back(toAverageTrk->Value(i));
+        }
+        chunk.EndEvent(weight, interval, problems);
+      }
+      return true;
+    };
+    // Work out which cell each hit is in
+    ChunkDecoder decodeChunk = [](MapChunk &chunk)
+    {
+      size_t nHits = chunk.Hits();
+      chunk.xs.resize(nHits);
+      chunk.ys.resize(nHits);
+      chunk.cells.resize(nHits);
+      for (size_t event=0; event<chunk.Events(); event++)
+      {
+        for (size_t i=chunk.offsets[event]; i<chunk.offsets[event+1]; i++)
+        {
+          DecodeTrackerHit(chunk.trackerHits[i], chunk.xs[i], chunk.ys[i]);
+          chunk.cells[i] = TrackerCellId(chunk.xs[i], chunk.ys[i]);
+          if (chunk.cells[i] < 0) chunk.problems[event] |= HIT_OFF_MAP;
+        }
+      }
+    };
+    // And fill the histograms, counting the events whose hits had something wrong with them
+    HitProblems problems;
+    auto fillHit = [&](int xValue, int yValue, int cell, double value, double weight, int interval)
+    {
+      if (isAverage && !std::isnan(value))
+      {
+        hAve->Fill(xValue,yValue,value*weight); // Ignore the uncertainties
+        hQuantitySquared->Fill(xValue,yValue,pow(value,2)*weight); // We will use this to calculate uncertainty
+        if (distributions) distributions->Fill(cell, value, weight);
+        h->Fill(xValue,yValue,weight); // Only fill this if there is something to average over! We don't want to divide by a denominator that includes hits with no useful info. Obviously the best thing would be to not put that stuff in the tuple in the first place, but this works as a protection in case you do
+      }
+      if (!isAverage)
+      {
+        h->Fill(xValue,yValue,weight); // We will take the lot!
+        if (slices) slices->Fill(interval, cell, weight);
+      }
+    };
+    ChunkFiller fillChunk = [&](const MapChunk &chunk)
+    {
+      for (size_t event=0; event<chunk.Events(); event++)
+      {
+        double weight = chunk.weights[event];
+        int interval = chunk.intervals[event];
+        if (slices) slices->AddEvent(interval, weight);
+        problems.Count(chunk.problems[event]);
+        for (size_t i=chunk.offsets[event]; i<chunk.offsets[event+1]; i++)
+        {
+          if (chunk.cells[i] < 0) continue; // Not on the map, so left out as it is from the hit index
+          fillHit(chunk.xs[i], chunk.ys[i], chunk.cells[i], isAverage?chunk.values[i]:0, weight, interval);
+        }
+      }
+    };
+    if (fromFeed) sampleFeed->AddMap(fullBranchName, vector<TH2D*>(1,h), vector<TH2D*>(1,hAve), vector<TH2D*>(1,hQuantitySquared), problems);
+    else if (index)
+    {
+      // The cells and values are used where they are in the index file, without copying them
+      for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
+      {
+        Long64_t treeEntry = inputTree->GetEntryNumber(iEntry); // Skips entries we aren't sampling
+        double weight = EventWeight(weightFormula, inputTree, treeEntry);
+        int interval = slices?slices->Interval(EventTime(timeFormula, inputTree, treeEntry)):-1;
+        TraceLoopChunk(iEntry, nEntries, chunkStart);
+        if (slices) slices->AddEvent(interval, weight);
+        problems.Count(index->problems[treeEntry]);
+        for (Long64_t i=index->offsets[treeEntry]; i<index->offsets[treeEntry+1]; i++)
+        {
+          int cell = index->cells[i];
+          if (cell < 0) continue; // Off the map
+          int xValue, yValue;
+          TrackerCellPosition(cell, xValue, yValue);
+          fillHit(xValue, yValue, cell, isAverage?index->values[i]:0, weight, interval);
+        }
+      }
+      CloseHitIndex(index);
+    }
+    else if (pipelineThreads <= 0)
+    {
+      // On one thread there is nothing to overlap, so each hit is decoded and filled as soon as it is read
+      for (Long64_t iEntry = 0; iEntry < nEntries; iEntry++)
+      {
+        Long64_t treeEntry = inputTree->GetEntryNumber(iEntry); // Skips entries we aren't sampling
+        ReadMapEntry(treeEntry, readBranches, readSeconds);
+        double weight = EventWeight(weightFormula, inputTree, treeEntry);
+        int interval = slices?slices->Interval(EventTime(timeFormula, inputTree, treeEntry)):-1;
+        TraceLoopChunk(iEntry, nEntries, chunkStart);
+        if (slices) slices->AddEvent(interval, weight);
+        size_t nHits = trackerHits->Size();
+        int eventProblems = (isAverage && toAverageTrk->Size() != nHits)?HIT_LENGTH_MISMATCH:0;
+        if (isAverage && toAverageTrk->Size() < nHits) nHits = toAverageTrk->Size(); // Protect against a short list of values
+        for (size_t i=0;i<nHits;i++)
+        {
+          int xValue, yValue;
+          DecodeTrackerHit((int)trackerHits->Value(i), xValue, yValue);
+          int cell = TrackerCellId(xValue, yValue);
+          if (cell < 0)
           {
-            h->Fill(xValue,yValue); // We will take the lot!
+            eventProblems |= HIT_OFF_MAP;
+            continue; // Left out, as it is from the hit index
           }
+          fillHit(xValue, yValue, cell, isAverage?toAverageTrk->Value(i):0, weight, interval);
         }
+        problems.Count(eventProblems);
       }
-    } // Loop all entries
+    }
+    else RunMapPipeline(readChunk, decodeChunk, fillChunk, pipelineThreads, PIPELINE_QUEUE_CHUNKS);
+    AddProfileTime("Read tracker branches","io",readSeconds,TFile::GetFileBytesRead()-bytesAtStart);
+    ReportHitProblems(isAverage?fullBranchName:mapBranch, mapBranch, problems, nEntries, isRef);
+    if (inputTree) inputTree->ResetBranchAddresses(); // These point at our local vectors
+    delete trackerHits;
+    delete toAverageTrk;
+    delete weightFormula;
+    delete timeFormula;
 
     if (isAverage)
     {
@@ -1351,11 +3462,12 @@ TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title
       // Variance on the MEAN is then variance of sample / number of hits
       // Take the square root of that to get the error on the mean, which is what we need here
       // Thank you Glen Cowan, "Statistical data analysis"
+      // With weights, n is the effective number of hits
       for (int x = 1; x<=h->GetNbinsX(); x++)
       {
         for (int y = 1; y<=h->GetNbinsY(); y++)
         {
-          double nHits = h->GetBinContent(x,y);
+          double nHits = EffectiveHits(h,x,y);
           if (nHits>1)
           {
             double meanSquared= pow(hAve->GetBinContent(x,y),2);
@@ -1369,6 +3481,7 @@ TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title
           }
         }
       }
+      delete h;
       h=hAve; // overwrite the temp plot with the one we actually want to save
     }
     else
@@ -1381,19 +3494,61 @@ TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title
           if (nHits==0) h->SetBinError(x,y, 1);
         }
       }
+      delete hAve;
     }
+    delete hQuantitySquared;
   h->GetYaxis()->SetTitle("Row");
   h->GetXaxis()->SetTitle("Layer");
+  if (isRef) CacheReference(h, refName);
   return h;
 }
 
+/**
+ *  Read one entry of a map branch, and of the branch to average if there is one
+ *  (and of any branch with the size of one of them). Adds the time it took to readSeconds.
+ *  When tracing, a read that had to fetch a new basket from the file gets its own span
+ */
+void ReadMapEntry(Long64_t treeEntry, const vector<TBranch*> &branches, double &readSeconds)
+{
+  double start = ProfileSeconds();
+  Long64_t bytesBefore = TFile::GetFileBytesRead();
+  for (int i=0;i<branches.size();i++) branches.at(i)->GetEntry(treeEntry);
+  double elapsed = ProfileSeconds() - start;
+  readSeconds += elapsed;
+  if (IsTracing())
+  {
+    Long64_t bytes = TFile::GetFileBytesRead() - bytesBefore;
+    if (bytes > 0) AddTraceSpan("Read basket", "io", start, elapsed, bytes, Form("entry %lld", treeEntry));
+  }
+}
+
+// When tracing, mark off the event loop in chunks of TRACE_CHUNK_ENTRIES entries
+void TraceLoopChunk(Long64_t iEntry, Long64_t nEntries, double &chunkStart)
+{
+  if (!IsTracing()) return;
+  if ((iEntry + 1) % TRACE_CHUNK_ENTRIES != 0 && iEntry + 1 != nEntries) return;
+  Long64_t firstEntry = (iEntry / TRACE_CHUNK_ENTRIES) * TRACE_CHUNK_ENTRIES;
+  double now = ProfileSeconds();
+  AddTraceSpan("Event loop chunk", "fill", chunkStart, now - chunkStart, 0, Form("entries %lld to %lld", firstEntry, iEntry));
+  chunkStart = now;
+}
+
+// Save a canvas to an image file, timing how long the rendering takes
+void SaveCanvas(TCanvas *canvas, string fileName)
+{
+  ProfileScope profile("SaveAs","render");
+  canvas->SaveAs(fileName.c_str());
+  savedImages.push_back(fileName);
+}
+
 // Just a quick routine to write text at a (x,y) coordinate
+// DrawLatex draws a copy, which belongs to the pad and is deleted with it
 void WriteLabel(double x, double y, string text, double size)
 {
-  TLatex *txt=new TLatex();
-  txt->SetTextSize(size);
-  txt->SetNDC();
-  txt->DrawLatex(x,y,text.c_str());
+  TLatex txt;
+  txt.SetTextSize(size);
+  txt.SetNDC();
+  txt.DrawLatex(x,y,text.c_str());
 }
 
 /**
@@ -1466,12 +3621,12 @@ void OverlayWhiteForNaN(TH2D *hist)
         Double_t y1 = hist->GetYaxis()->GetBinLowEdge(y);
         Double_t y2 = hist->GetYaxis()->GetBinUpEdge(y);
         
-        TBox *box2 = new TBox(x1, y1, x2, y2);
-        box2->SetFillStyle(1001);
-        box2->SetFillColor(kWhite);
-        box2->SetLineColor(kWhite);
-        box2->SetLineWidth(0);
-        box2->Draw();
+        TBox box2; // DrawBox draws a copy that belongs to the pad
+        box2.SetFillStyle(1001);
+        box2.SetFillColor(kWhite);
+        box2.SetLineColor(kWhite);
+        box2.SetLineWidth(0);
+        box2.DrawBox(x1, y1, x2, y2);
       }
     }
   }
@@ -1480,6 +3635,7 @@ void OverlayWhiteForNaN(TH2D *hist)
 // Arrange all the bits of calorimeter on a canvas
 void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
 {
+  ProfileScope profile("PrintCaloPlots","render");
   if (histos.size() !=6)
   {
     cout<<"Unable to print calorimeter map for "<<branchName<<" as we do not have 6 input histograms"<<endl;
@@ -1587,11 +3743,11 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
   hMountain->Draw("COL0");
   OverlayWhiteForNaN(hMountain);
   WriteLabel(.2,.95,"Mountain",0.15);
-  // Draw on the source foil
-  TLine *foil=new TLine(0,0,0,16);
-  foil->SetLineColor(kGray+3);
-  foil->SetLineWidth(5);
-  foil->Draw("SAME");
+  // Draw on the source foil (each pad gets its own copy, which it deletes)
+  TLine foil;
+  foil.SetLineColor(kGray+3);
+  foil.SetLineWidth(5);
+  foil.DrawLine(0,0,0,16);
   
   // Tunnel x wall
   pTunnel->cd();
@@ -1605,7 +3761,7 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
   hTunnel->Draw("COL0");
   OverlayWhiteForNaN(hTunnel);
   WriteLabel(.25,.95,"Tunnel",0.15);
-  foil->Draw("SAME");
+  foil.DrawLine(0,0,0,16);
   
   // Top veto wall
   pTop->cd();
@@ -1614,10 +3770,10 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
 
   hTop->GetXaxis()->SetLabelSize(0.1);
   hTop->GetYaxis()->SetLabelSize(0.15);
-  TLine *foilveto=new TLine(0,1,16,1);
-  foilveto->SetLineColor(kGray+3);
-  foilveto->SetLineWidth(5);
-  foilveto->Draw("SAME");
+  TLine foilveto;
+  foilveto.SetLineColor(kGray+3);
+  foilveto.SetLineWidth(5);
+  foilveto.DrawLine(0,1,16,1);
   WriteLabel(.42,.2,"Top",0.2);
   
   
@@ -1627,20 +3783,61 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
   hBottom->GetYaxis()->SetLabelSize(0.15);
   hBottom->Draw("COL0");
   OverlayWhiteForNaN(hBottom);
-  foilveto->Draw("SAME");
+  foilveto.DrawLine(0,1,16,1);
   WriteLabel(.42,.6,"Bottom",0.2);
   
   pTitle->cd();
   WriteLabel(.1,.5,title,0.2);
   
-  c->SaveAs((plotdir+"/"+branchName+".png").c_str());
+  SaveCanvas(c, plotdir+"/"+branchName+".png");
   
   delete c;
   return;
 }
 
+/**
+ *  Empirical p-values from --toys, for when the chi-square probability can't be trusted, as in
+ *  sparse maps or averages of few hits: the fraction of toys, thrown with the sample and
+ *  reference agreeing, that disagree at least as much as the real ones. The toys' chi-square
+ *  probabilities are compared with the real one, rather than their chi-squares, as the number
+ *  of bins that can be used changes from toy to toy. Only done if there are toys to throw
+ */
+void ToyPValues(const vector<TH1*> &samples, const vector<TH1*> &refs, bool isAverage, bool withKS, BranchResult &result)
+{
+  if (toys <= 0) return;
+  ProfileScope profile("Toys","compare");
+  double observedProb;
+  double observedDistance;
+  ObservedToyStatistics(samples, refs, withKS, observedProb, observedDistance);
+  ToyComparison comparison = MakeToyComparison(samples, refs, isAverage);
+  vector<double> chisqProbs;
+  vector<double> ksDistances;
+  RunToys(comparison, toys, withKS, sampleSeed, ToyThreads(), chisqProbs, ksDistances);
+
+  int nExtreme = 0;
+  for (int i=0;i<chisqProbs.size();i++) if (chisqProbs.at(i) <= observedProb) nExtreme++;
+  result.toyPValue = (nExtreme + 1.) / (toys + 1.);
+  cout<<"Toy p-value: "<<result.toyPValue<<" from "<<toys<<" toys"<<endl;
+  textOut<<"Toy p-value: "<<result.toyPValue<<" from "<<toys<<" toys"<<"\n";
+  if (!withKS || std::isnan(observedDistance)) return;
+  nExtreme = 0;
+  for (int i=0;i<ksDistances.size();i++) if (ksDistances.at(i) >= observedDistance) nExtreme++;
+  result.toyKSPValue = (nExtreme + 1.) / (toys + 1.);
+  cout<<"Toy KS p-value: "<<result.toyKSPValue<<endl;
+  textOut<<"Toy KS p-value: "<<result.toyKSPValue<<"\n";
+}
+
+// The threads to throw toys on: as many as --threads, or one per core
+int ToyThreads()
+{
+  if (threads > 0) return threads;
+  int cores = thread::hardware_concurrency();
+  return (cores > 0)?cores:1;
+}
+
 double ChiSquared(TH1 *h1, TH1 *h2, double &chisq, int &ndf, bool isAverage)
 {
+  ProfileScope profile("ChiSquared","compare");
   // Calculate a chi squared per degree of freedom
   chisq=0;
   ndf=0;
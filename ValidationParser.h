@@ -1,3 +1,5 @@
+#ifndef VALIDATION_PARSER_H
+#define VALIDATION_PARSER_H
 
 // Standard Library
 #include <iostream>
@@ -8,11 +10,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <cstdio>
 #include <memory>
 #include <stdexcept>
 #include <string>
 #include <array>
+#include <set>
 
 // ROOT
 #include "TFile.h"
@@ -31,70 +35,306 @@
 #include "TPaveText.h"
 #include "TLatex.h"
 #include "TF1.h"
+#include "TEntryList.h"
+#include "TTreeFormula.h"
+#include "TRandom3.h"
+#include "TNamed.h"
+#include "TKey.h"
+#include "TTreeCacheUnzip.h"
+
+// Timing and memory profile
+#include "ValidationProfiler.h"
+
+// Structured results
+#include "ValidationResults.h"
+
+// The library interface
+#include "ValidationSession.h"
+
+// History of results across runs
+#include "ValidationHistory.h"
+
+// Fingerprints of the branch contents, to skip unchanged branches
+#include "ValidationFingerprint.h"
+
+// Reading branches of numbers of any type
+#include "ValidationBranchReader.h"
+
+// Distributions of the values in each cell of a map
+#include "ValidationCellDistributions.h"
+
+// Maps split into intervals of time
+#include "ValidationTimeSlices.h"
+
+// Reading, decoding and filling maps on separate threads
+#include "ValidationPipeline.h"
+
+// Decoded map hits kept in a file, to be read back by later runs
+#include "ValidationHitIndex.h"
+
+// Filling histograms of plain number branches a basket at a time
+#include "ValidationBulkFill.h"
+
+// Empirical p-values from toys
+#include "ValidationToys.h"
 
 
 using namespace std;
 
-string treeName="Validation";
+extern string treeName;
 
 // Colour palettes for 1-D histogram comparisons
-int REF_FILL_COLOR=kRed-10;
-int REF_LINE_COLOR=kRed;
-int REF_FILL_STYLE=1001;
+extern int REF_FILL_COLOR;
+extern int REF_LINE_COLOR;
+extern int REF_FILL_STYLE;
 
 // Tracker geometry
-int MAX_TRACKER_LAYERS=9;
-int MAX_TRACKER_ROWS=113;
+extern int MAX_TRACKER_LAYERS;
+extern int MAX_TRACKER_ROWS;
 
 // Palettes for general plots and for pull plots
 // (where we want different colours for positive and negative values)
-int PALETTE = kBird;
-int PULL_PALETTE=kThermometer;
+extern int PALETTE;
+extern int PULL_PALETTE;
 
 // For 2-D comparisons - report if the magnitude of the pull
 // (difference between sample and reference) for a cell
 // is more than this many sigma
-double REPORT_PULLS_OVER=3.;
+extern double REPORT_PULLS_OVER;
+
+// Only compare the distribution of values in a cell if the sample has at least this many hits there
+extern double MIN_CELL_DISTRIBUTION_HITS;
+
+// When writing a trace, mark the event loops off in chunks of this many entries
+extern Long64_t TRACE_CHUNK_ENTRIES;
+
+// The map event loops pass entries between their stages in chunks of this many
+extern Long64_t PIPELINE_CHUNK_ENTRIES;
+// And each queue between the stages holds at most this many chunks
+extern int PIPELINE_QUEUE_CHUNKS;
+
+// 1-D histograms that can't be filled a basket at a time are filled in blocks of this many values
+extern size_t BATCH_FILL_BLOCK;
+
+// With --memory-limit, the tree caches share this fraction of the limit
+extern double MEMORY_LIMIT_CACHE_FRACTION;
+
+// An h_ branch fed without a binning takes its range from its first this-many values
+extern int FEED_RANGE_VALUES;
 
 // Calorimeter dimensions
 
-int MAINWALL_WIDTH = 20;
-int MAINWALL_HEIGHT = 13;
-int XWALL_DEPTH = 4;
-int XWALL_HEIGHT = 16;
-int VETO_DEPTH = 2;
-int VETO_WIDTH = 16;
+extern int MAINWALL_WIDTH;
+extern int MAINWALL_HEIGHT;
+extern int XWALL_DEPTH;
+extern int XWALL_HEIGHT;
+extern int VETO_DEPTH;
+extern int VETO_WIDTH;
 
 // 6 walls for the calorimeters, the order matters
 enum WALL  {ITALY, FRANCE, TUNNEL, MOUNTAIN, TOP, BOTTOM};
-string CALO_WALL[6] = {"Italy","France","Tunnel","Mountain","Top","Bottom"};
-int CALO_XBINS[6] = {MAINWALL_WIDTH,MAINWALL_WIDTH,XWALL_DEPTH,XWALL_DEPTH,VETO_WIDTH,VETO_WIDTH};
-int CALO_XLO[6] = {-1*MAINWALL_WIDTH,0,-1 * XWALL_DEPTH/2,-1 * XWALL_DEPTH/2,0,0};
-int CALO_XHI[6] = {0,MAINWALL_WIDTH,XWALL_DEPTH/2,XWALL_DEPTH/2,VETO_WIDTH,VETO_WIDTH};
-int CALO_YBINS[6] = {MAINWALL_HEIGHT,MAINWALL_HEIGHT,XWALL_HEIGHT,XWALL_HEIGHT,VETO_DEPTH,VETO_DEPTH}; // They are all zero to nbins in the y direction
-
-int main(int argc, char **argv);
-void ParseRootFile(string rootFileName, string configFileName="", string refFileName="", string tempDirName="", string plotDirName="");
+extern string CALO_WALL[6];
+extern int CALO_XBINS[6];
+extern int CALO_XLO[6];
+extern int CALO_XHI[6];
+extern int CALO_YBINS[6]; // They are all zero to nbins in the y direction
+
+// A reference file to compare the sample with
+struct Reference
+{
+  string fileName;
+  string label; // Added to plot names when there is more than one reference
+  TTree *tree;
+  TFile *file=0; // The file it was opened from, which we close; 0 for a tree in memory
+  string hash;
+};
+
+// What a branch needed and made, so a later run can reuse it if none of that has changed
+struct BranchRecord
+{
+  string branch;
+  string fingerprint; // Of the data and settings it depends on
+  Long64_t textStart=0; // Its part of ValidationResults.txt
+  Long64_t textLength=0;
+  string text;
+  vector<string> histograms;
+  vector<string> images;
+  vector<BranchResult> results;
+  vector<HistoryValue> historyValues;
+};
+
+// The state of the validation, in ValidationParser.cxx
+extern bool hasConfig;
+extern bool hasValidReference;
+extern TTree *tree;
+extern ValidationFeed *sampleFeed;
+extern TTree *reftree;
+extern vector<Reference> references;
+extern int currentReference;
+extern map<string,string> configParams;
+extern string plotdir;
+extern ofstream textOut;
+extern RunSummary runSummary;
+
+// Quick-look sampling: the same selection is applied to sample and reference
+extern Long64_t maxEntries;
+extern int prescale;
+extern double sampleFraction;
+extern unsigned int sampleSeed;
+
+// Selection cuts: only events passing them are used
+extern string eventCut;
+extern map<string,string> branchCuts;
+extern map<TTree*,TEntryList*> baseEntryLists;
+extern map<pair<TTree*,string>,TEntryList*> cutEntryLists;
+extern map<TEntryList*,string> selectionFingerprints;
+
+// Per-event weights: every histogram is filled with them, and references are normalised by their sum
+extern string weightExpression;
+extern map<TTree*,bool> weightUsable;
+extern map<pair<TTree*,TEntryList*>,double> selectedWeights;
+
+// Per-cell distributions of the values in average maps
+extern int cellDistributionBins;
+
+// Splitting the sample's maps into intervals of time, to see cells that stop working
+extern string timeBranch;
+extern int timeSlices;
+extern double firstTime;
+extern double lastTime;
+extern bool timeSlicesEnabled;
+
+// --pipeline: threads decoding the maps, while another reads them; 0 to do it all on one thread
+extern int pipelineThreads;
+// --threads: all the threads we may use, including ROOT's for unzipping baskets; -1 for ROOT not to use any
+extern int threads;
+
+// --toys: how many toy samples and references to throw for empirical p-values; 0 for none
+extern int toys;
+
+// --hit-index: a directory of decoded map hits, kept between runs so they are only decoded once ("" for none)
+extern string hitIndexDir;
+
+// --memory-limit: release everything a branch used before starting the next, to keep under this many MB (0 for no limit)
+extern long memoryLimitMB;
+
+// Reference histograms shared between runs, so a campaign only fills them once
+extern string referenceCacheName;
+extern TFile *referenceCache;
+extern TFile *newReferenceCache;
+extern string newReferenceCacheName;
+
+// History of summary values from earlier runs, to look for slow drifts
+extern string historyFileName;
+extern int historyWindow;
+
+// Reusing the outputs of branches that haven't changed since the last run into the same output directory
+extern bool reuseUnchanged;
+extern map<string,BranchRecord> priorBranches;
+extern vector<BranchRecord> branchRecords;
+extern TFile *priorHistograms;
+extern vector<string> savedImages;
+extern map<pair<TTree*,string>,string> branchFingerprints;
+
+bool IsSampling();
+bool HasSelection();
+bool MakeSelectionEntryList(TTree *inputTree, string listName);
+TTreeFormula *CompileCut(string cut, TTree *inputTree, string name);
+bool PassesCut(TTreeFormula *formula, TTree *inputTree, Long64_t entry);
+string BranchCut(string branchName);
+bool ApplyBranchCut(string branchName);
+void RemoveBranchCut();
+string SelectionFingerprint(TTree *inputTree);
+Long64_t SelectedEntries(TTree *inputTree);
+Long64_t SampleEntries();
+double SampleWeight();
+bool SampleHasBranch(string branchName);
+string WeightFor(TTree *inputTree);
+TTreeFormula *MakeWeightFormula(TTree *inputTree);
+double EventWeight(TTreeFormula *weightFormula, TTree *inputTree, Long64_t treeEntry);
+double SelectedWeight(TTree *inputTree);
+double EffectiveHits(TH2D *counts, int x, int y);
+bool ParseRootFile(string rootFileName, string configFileName="", vector<string> refFileNames=vector<string>(), string tempDirName="", string plotDirName="");
+string FileHash(string fileName);
+string TreeSourceName(TTree *inputTree);
+void ReleaseSelections();
+void StartImplicitMT();
+void LimitTreeCaches();
+void ReleaseBranchMemory(string branchName, TFile *outputFile);
+void ReportPeakMemory();
+bool AddReference(string refFileName);
+void SetCurrentReference(int index);
+string RefSuffix();
+string ResultHeading(string branchName);
+bool ReferenceHasBranch(string branchName);
+string ReferenceCacheKey();
+void OpenReferenceCache();
+void CloseReferenceCache();
+TH1 *GetCachedReference(string cacheName, string histName="");
+void CacheReference(TH1 *hist, string cacheName="");
+void ProcessBranch(string branchName, TFile *outputFile);
+set<string> KeyNames(TFile *file);
+string OutputSettings();
+string CachedBranchFingerprint(TTree *inputTree, string branchName);
+string InputFingerprint(string branchName);
+bool ReusePriorBranch(BranchRecord &record, TFile *outputFile);
+void LoadPriorRun();
+void WriteBranchRecords(string fileName);
 bool PlotVariable(string branchName);
 map<string,string> LoadConfig(ifstream& configFile);
 string GetBitBeforeComma(string& input);
+bool BatchFillHistogram(TTree *inputTree, string branchName, TH1 *h);
 void Plot1DHistogram(string branchName);
 void PlotTrackerMap(string branchName);
 void PlotCaloMap(string branchName);
 string BranchNameToEnglish(string branchname);
 void WriteLabel(double x, double y, string text, double size=0.05);
+void SaveCanvas(TCanvas *canvas, string fileName);
+void ReadMapEntry(Long64_t treeEntry, const vector<TBranch*> &branches, double &readSeconds);
+void TraceLoopChunk(Long64_t iEntry, Long64_t nEntries, double &chunkStart);
 void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos);
 
 string exec(const char* cmd);
 string FirstWordOf(string input);
-TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch = "");
+void ReportHitProblems(string branchName, string mapBranch, const HitProblems &problems, Long64_t nEntries, bool isRef);
+TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch = "", CellDistributions *distributions = 0, TimeSlices *slices = 0);
 TH2D *PullPlot2D(TH2D *hSample, TH2D *hRef);
 void AnnotateTrackerMap();
 double CheckTrackerPull(TH2D *hPull, string title);
-vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch = "");
+string TrackerCellLocation(int x, int y);
+string CaloCellLocation(int wall, int x, int y);
+void RecordHistogramHistory(string branchName, TH1D *hist);
+void RecordMapHistory(string branchName, vector<TH2D*> hists, bool isAverage, bool isTracker);
+int TrackerCellCount();
+int TrackerCellId(int xValue, int yValue);
+int CaloCellCount();
+int CaloCellId(int wall, int xValue, int yValue);
+string CellIdLocation(int cell, bool isTracker);
+void TrackerCellPosition(int cell, int &xValue, int &yValue);
+void CaloCellPosition(int cell, int &wall, int &xValue, int &yValue);
+HitIndex *GetHitIndex(TTree *inputTree, string mapBranch, string valueBranch, bool isTracker);
+bool BuildHitIndex(TTree *inputTree, string mapBranch, string valueBranch, bool isTracker, string fileName);
+CellDistributions *MakeCellDistributions(string fullBranchName, string config, int nCells);
+CellDistributions *CopyBinning(TH2D *hDist);
+bool ValueRange(TTree *inputTree, string branchName, double &low, double &high);
+TH2D *SaveCellDistributions(CellDistributions *distributions, string name, string title, bool isRef);
+void CompareCellDistributions(TH2D *hSample, TH2D *hRef, bool isTracker);
+bool FindTimeRange();
+TTreeFormula *MakeTimeFormula(TTree *inputTree);
+double EventTime(TTreeFormula *timeFormula, TTree *inputTree, Long64_t treeEntry);
+TimeSlices *MakeTimeSlices(int nCells);
+void ReportTimeSlices(TimeSlices *slices, string branchName, string title, bool isTracker);
+bool DecodeCaloHit(const string &thisHit, int &whichWall, int &xValue, int &yValue);
+void DecodeTrackerHit(int encodedHit, int &xValue, int &yValue);
+vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch = "", CellDistributions *distributions = 0, TimeSlices *slices = 0);
 vector<TH2D*>MakeCaloPullPlots(vector<TH2D*> vSample, vector<TH2D*> vRef);
 double CheckCaloPulls(vector<TH2D*> hPulls, string title="");
+void DeleteHistograms(vector<TH2D*> hists);
 void OverlayWhiteForNaN(TH2D *hist);
+void ToyPValues(const vector<TH1*> &samples, const vector<TH1*> &refs, bool isAverage, bool withKS, BranchResult &result);
+int ToyThreads();
 double ChiSquared(TH1 *h1, TH1 *h2, double &chisq, int &ndf, bool isAverage);
 double  PrintPlotOfPulls(TH1D *h1Pulls, int pullCells, string title);
 void MoveHistograms(string fromFile, string toFile);
+
+#endif
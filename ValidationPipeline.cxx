@@ -0,0 +1,78 @@
+#include "ValidationPipeline.h"
+
+/**
+ *  Run the events of a map through reading, decoding and filling, a chunk at a time.
+ *  With no decoder threads, each chunk goes through all three in turn on this thread.
+ *  Otherwise one thread reads, so waiting for the file overlaps with the work on earlier
+ *  chunks; nDecoders threads decode; and this thread fills, as the histograms can only be
+ *  filled from one thread. Each decoder has its own pair of queues, holding at most
+ *  queueChunks chunks each, and the chunks are dealt out and collected in turn, so they are
+ *  filled in the same order as they were read
+ */
+void RunMapPipeline(ChunkReader read, ChunkDecoder decode, ChunkFiller fill, int nDecoders, int queueChunks)
+{
+  if (nDecoders <= 0)
+  {
+    while (true)
+    {
+      MapChunk chunk;
+      if (!read(chunk)) break;
+      decode(chunk);
+      fill(chunk);
+    }
+    return;
+  }
+
+  vector<BoundedQueue<MapChunk*>*> toDecode;
+  vector<BoundedQueue<MapChunk*>*> toFill;
+  for (int i=0; i<nDecoders; i++)
+  {
+    toDecode.push_back(new BoundedQueue<MapChunk*>(queueChunks));
+    toFill.push_back(new BoundedQueue<MapChunk*>(queueChunks));
+  }
+
+  // A null chunk means there are no more
+  thread reader([&]()
+  {
+    for (size_t i=0; ; i++)
+    {
+      MapChunk *chunk = new MapChunk;
+      if (!read(*chunk))
+      {
+        delete chunk;
+        for (int j=0; j<nDecoders; j++) toDecode[j]->Push(0);
+        return;
+      }
+      toDecode[i % nDecoders]->Push(chunk);
+    }
+  });
+  vector<thread> decoders;
+  for (int j=0; j<nDecoders; j++)
+  {
+    decoders.push_back(thread([&, j]()
+    {
+      while (MapChunk *chunk = toDecode[j]->Pop())
+      {
+        decode(*chunk);
+        toFill[j]->Push(chunk);
+      }
+      toFill[j]->Push(0);
+    }));
+  }
+
+  // The first null we meet comes after every chunk has been dealt out
+  for (size_t i=0; ; i++)
+  {
+    MapChunk *chunk = toFill[i % nDecoders]->Pop();
+    if (!chunk) break;
+    fill(*chunk);
+    delete chunk;
+  }
+  reader.join();
+  for (int j=0; j<nDecoders; j++) decoders[j].join();
+  for (int j=0; j<nDecoders; j++)
+  {
+    delete toDecode[j];
+    delete toFill[j];
+  }
+}
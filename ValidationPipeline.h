@@ -0,0 +1,113 @@
+#ifndef VALIDATION_PIPELINE_H
+#define VALIDATION_PIPELINE_H
+
+// Standard Library
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// ROOT
+#include "Rtypes.h"
+
+using namespace std;
+
+/**
+ *  A fixed-size queue between two threads: one pushes, one pops. A thread that finds it full
+ *  (or empty) sleeps until the other makes room (or adds something), so a slow stage holds
+ *  the others back, rather than letting chunks pile up in memory or spinning while it waits
+ */
+template <typename T> class BoundedQueue
+{
+public:
+  BoundedQueue(size_t capacity) : capacity(capacity) {}
+  void Push(const T &item)
+  {
+    unique_lock<mutex> lock(guard);
+    notFull.wait(lock, [this]() { return items.size() < this->capacity; });
+    items.push_back(item);
+    notEmpty.notify_one();
+  }
+  T Pop()
+  {
+    unique_lock<mutex> lock(guard);
+    notEmpty.wait(lock, [this]() { return !items.empty(); });
+    T item = items.front();
+    items.pop_front();
+    notFull.notify_one();
+    return item;
+  }
+
+private:
+  size_t capacity;
+  deque<T> items;
+  mutex guard;
+  condition_variable notFull;
+  condition_variable notEmpty;
+};
+
+// What can be wrong with an event's hits, as bits
+const int HIT_LENGTH_MISMATCH=1; // The values to average don't have one for each hit
+const int HIT_UNPARSEABLE=2; // A hit's location couldn't be decoded
+const int HIT_OFF_MAP=4; // A hit is somewhere that isn't on the map
+
+// How many events had each problem, for one branch
+struct HitProblems
+{
+  Long64_t lengthMismatch=0;
+  Long64_t unparseable=0;
+  Long64_t offMap=0;
+  void Count(int problems)
+  {
+    if (problems & HIT_LENGTH_MISMATCH) lengthMismatch++;
+    if (problems & HIT_UNPARSEABLE) unparseable++;
+    if (problems & HIT_OFF_MAP) offMap++;
+  }
+  bool Any() const { return lengthMismatch + unparseable + offMap > 0; }
+};
+
+/**
+ *  A run of events from a map branch on their way through the pipeline. The reader fills in
+ *  the raw hits, one event after another; the decoder works out where each hit is, and the
+ *  filler adds them to the histograms
+ */
+struct MapChunk
+{
+  // One for each event
+  vector<double> weights;
+  vector<int> intervals; // Time slice, or -1
+  vector<size_t> offsets; // Where each event's hits start, with the end of the last one after it
+  vector<int> problems; // HIT_ bits, found by the reader and the decoder
+  // One for each hit, as read
+  vector<int> trackerHits; // Encoded tracker locations
+  vector<string> caloHits; // Or calorimeter geometry IDs
+  vector<double> values; // Values to average, if it is an average branch
+  // One for each hit, decoded
+  vector<int> walls; // Calorimeter wall, or -1 if the hit couldn't be placed
+  vector<int> xs;
+  vector<int> ys;
+  vector<int> cells; // Dense cell number, or -1 if it is off the map
+
+  MapChunk() : offsets(1,0) {}
+  size_t Events() const { return weights.size(); }
+  size_t Hits() const { return offsets.back(); }
+  void EndEvent(double weight, int interval, int eventProblems=0)
+  {
+    weights.push_back(weight);
+    intervals.push_back(interval);
+    problems.push_back(eventProblems);
+    offsets.push_back(trackerHits.size() + caloHits.size());
+  }
+};
+
+// The three stages. The reader returns false when there are no more events
+typedef function<bool(MapChunk&)> ChunkReader;
+typedef function<void(MapChunk&)> ChunkDecoder;
+typedef function<void(const MapChunk&)> ChunkFiller;
+
+void RunMapPipeline(ChunkReader read, ChunkDecoder decode, ChunkFiller fill, int nDecoders, int queueChunks);
+
+#endif
@@ -0,0 +1,326 @@
+#include "ValidationProfiler.h"
+#include <cstdio>
+#include <sys/resource.h>
+
+// Everything we have timed so far, in the order the stages finished
+vector<ProfileRecord> profileRecords;
+mutex profileMutex; // Stages can finish on more than one thread
+chrono::steady_clock::time_point profileStart = chrono::steady_clock::now();
+string profileBranch=""; // The branch we are working on now
+thread_local int profileDepth=0;
+bool profileTracing=false; // Keep the fine-grained spans for a Chrome trace
+size_t profileFirstRecord=0; // Where the records of the sample being validated start
+Long64_t profileBytesStart=0; // Bytes read from ROOT files before it started
+
+// Give each thread a small number for the trace, in the order they first record something
+atomic<int> nextThreadId(0);
+int ProfileThreadId()
+{
+  thread_local int threadId = nextThreadId++;
+  return threadId;
+}
+
+void StoreRecord(const ProfileRecord &record)
+{
+  lock_guard<mutex> lock(profileMutex);
+  profileRecords.push_back(record);
+}
+
+ProfileScope::ProfileScope(string stage, string category)
+{
+  fStart = chrono::steady_clock::now();
+  fCpuStart = clock();
+  fBytesStart = TFile::GetFileBytesRead();
+  fRecord.stage = stage;
+  fRecord.category = category;
+  fRecord.branch = profileBranch;
+  fRecord.startSeconds = chrono::duration<double>(fStart - profileStart).count();
+  fRecord.rssStartkB = CurrentRSSkB();
+  fRecord.depth = profileDepth++;
+  fRecord.threadId = ProfileThreadId();
+  fRecord.traceOnly = false;
+}
+
+ProfileScope::~ProfileScope()
+{
+  fRecord.wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - fStart).count();
+  fRecord.cpuSeconds = (double)(clock() - fCpuStart) / CLOCKS_PER_SEC;
+  fRecord.bytesRead = TFile::GetFileBytesRead() - fBytesStart;
+  fRecord.rssEndkB = CurrentRSSkB();
+  profileDepth--;
+  StoreRecord(fRecord);
+}
+
+/**
+ *  Record time that was added up over many short pieces of a loop (like reading
+ *  each entry's branches), where timing each piece with a scope would cost too much.
+ *  Only the wall time and bytes are known for these
+ */
+void AddProfileTime(string stage, string category, double wallSeconds, Long64_t bytesRead)
+{
+  ProfileRecord record;
+  record.stage = stage;
+  record.category = category;
+  record.branch = profileBranch;
+  record.startSeconds = chrono::duration<double>(chrono::steady_clock::now() - profileStart).count() - wallSeconds;
+  record.wallSeconds = wallSeconds;
+  record.cpuSeconds = 0;
+  record.bytesRead = bytesRead;
+  record.rssStartkB = CurrentRSSkB();
+  record.rssEndkB = record.rssStartkB;
+  record.depth = profileDepth;
+  record.threadId = ProfileThreadId();
+  record.traceOnly = false;
+  StoreRecord(record);
+}
+
+/**
+ *  Start the profile of a new sample, so its JSON doesn't include the samples before it.
+ *  The records are kept for the trace if there is one, which covers the whole session
+ */
+void StartProfile()
+{
+  lock_guard<mutex> lock(profileMutex);
+  if (!profileTracing) profileRecords.clear();
+  profileFirstRecord = profileRecords.size();
+  profileBytesStart = TFile::GetFileBytesRead();
+}
+
+// Turn on the fine-grained spans needed for a trace
+void EnableTrace()
+{
+  profileTracing = true;
+}
+
+bool IsTracing()
+{
+  return profileTracing;
+}
+
+// Seconds since the profiler started, for marking the start of a span
+double ProfileSeconds()
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - profileStart).count();
+}
+
+// A span that only goes in the trace, like a single basket read or a chunk of the event loop
+void AddTraceSpan(string name, string category, double startSeconds, double wallSeconds, Long64_t bytesRead, string detail)
+{
+  if (!profileTracing) return;
+  ProfileRecord record;
+  record.stage = name;
+  record.category = category;
+  record.branch = profileBranch;
+  record.startSeconds = startSeconds;
+  record.wallSeconds = wallSeconds;
+  record.cpuSeconds = 0;
+  record.bytesRead = bytesRead;
+  record.rssStartkB = 0;
+  record.rssEndkB = 0;
+  record.depth = profileDepth;
+  record.threadId = ProfileThreadId();
+  record.traceOnly = true;
+  record.detail = detail;
+  StoreRecord(record);
+}
+
+// Stages started after this are attributed to this branch
+void SetProfileBranch(string branchName)
+{
+  profileBranch = branchName;
+}
+
+// Resident memory now, in kB
+long CurrentRSSkB()
+{
+  ProcInfo_t info;
+  if (gSystem->GetProcInfo(&info) != 0) return 0;
+  return info.fMemResident;
+}
+
+// Highest resident memory so far, in kB
+long PeakRSSkB()
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  return usage.ru_maxrss; // kB on Linux
+}
+
+const vector<ProfileRecord> &GetProfileRecords()
+{
+  return profileRecords;
+}
+
+// Totals for a group of records
+struct ProfileSummary
+{
+  int calls=0;
+  double wallSeconds=0;
+  double cpuSeconds=0;
+  Long64_t bytesRead=0;
+  long maxRSSkB=0;
+  long rssGrowthkB=0;
+};
+
+void AddToSummary(ProfileSummary &summary, const ProfileRecord &record)
+{
+  summary.calls++;
+  summary.wallSeconds += record.wallSeconds;
+  summary.cpuSeconds += record.cpuSeconds;
+  summary.bytesRead += record.bytesRead;
+  summary.rssGrowthkB += record.rssEndkB - record.rssStartkB;
+  if (record.rssEndkB > summary.maxRSSkB) summary.maxRSSkB = record.rssEndkB;
+}
+
+void WriteSummary(ostream &out, const ProfileSummary &summary)
+{
+  out<<"\"calls\": "<<summary.calls;
+  out<<", \"wall_s\": "<<summary.wallSeconds;
+  out<<", \"cpu_s\": "<<summary.cpuSeconds;
+  out<<", \"bytes_read\": "<<summary.bytesRead;
+  out<<", \"max_rss_kb\": "<<summary.maxRSSkB;
+  out<<", \"rss_growth_kb\": "<<summary.rssGrowthkB;
+}
+
+/**
+ *  Write what we have timed since StartProfile as JSON: totals per stage, and per stage for
+ *  each branch. It is built in memory and written in one go
+ */
+bool WriteProfileJSON(string fileName, string sampleName, string refName)
+{
+  // Group by stage, and by branch then stage, keeping the order we first saw them in
+  vector<string> stageOrder;
+  map<string, ProfileSummary> stageSummaries;
+  map<string, string> stageCategories;
+  vector<string> branchOrder;
+  map<string, ProfileSummary> branchSummaries;
+  map<string, vector<string> > branchStageOrder;
+  map<string, map<string, ProfileSummary> > branchStageSummaries;
+  double totalWall=0;
+  double totalCpu=0;
+  for (size_t i=profileFirstRecord;i<profileRecords.size();i++)
+  {
+    const ProfileRecord &record = profileRecords.at(i);
+    if (record.traceOnly) continue; // Only for the trace
+    if (record.depth==0)
+    {
+      totalWall += record.wallSeconds;
+      totalCpu += record.cpuSeconds;
+    }
+    if (stageSummaries.find(record.stage) == stageSummaries.end()) stageOrder.push_back(record.stage);
+    AddToSummary(stageSummaries[record.stage], record);
+    stageCategories[record.stage] = record.category;
+    if (record.branch.length()==0) continue;
+    if (branchSummaries.find(record.branch) == branchSummaries.end()) branchOrder.push_back(record.branch);
+    if (branchStageSummaries[record.branch].find(record.stage) == branchStageSummaries[record.branch].end()) branchStageOrder[record.branch].push_back(record.stage);
+    AddToSummary(branchStageSummaries[record.branch][record.stage], record);
+    if (record.stage == "PlotVariable") AddToSummary(branchSummaries[record.branch], record); // the whole branch
+  }
+
+  ostringstream out;
+  out<<setprecision(6);
+  out<<"{"<<endl;
+  out<<"  \"sample\": \""<<JSONEscape(sampleName)<<"\","<<endl;
+  out<<"  \"reference\": \""<<JSONEscape(refName)<<"\","<<endl;
+  out<<"  \"total_wall_s\": "<<totalWall<<","<<endl;
+  out<<"  \"total_cpu_s\": "<<totalCpu<<","<<endl;
+  out<<"  \"total_bytes_read\": "<<TFile::GetFileBytesRead() - profileBytesStart<<","<<endl;
+  out<<"  \"peak_rss_kb\": "<<PeakRSSkB()<<","<<endl;
+  out<<"  \"stages\": ["<<endl;
+  for (int i=0;i<stageOrder.size();i++)
+  {
+    out<<"    {\"stage\": \""<<JSONEscape(stageOrder.at(i))<<"\", \"category\": \""<<JSONEscape(stageCategories[stageOrder.at(i)])<<"\", ";
+    WriteSummary(out, stageSummaries[stageOrder.at(i)]);
+    out<<"}"<<(i+1<stageOrder.size()?",":"")<<endl;
+  }
+  out<<"  ],"<<endl;
+  out<<"  \"branches\": ["<<endl;
+  for (int i=0;i<branchOrder.size();i++)
+  {
+    string branch = branchOrder.at(i);
+    out<<"    {\"branch\": \""<<JSONEscape(branch)<<"\", ";
+    WriteSummary(out, branchSummaries[branch]);
+    out<<", \"stages\": ["<<endl;
+    vector<string> &stages = branchStageOrder[branch];
+    for (int j=0;j<stages.size();j++)
+    {
+      out<<"      {\"stage\": \""<<JSONEscape(stages.at(j))<<"\", ";
+      WriteSummary(out, branchStageSummaries[branch][stages.at(j)]);
+      out<<"}"<<(j+1<stages.size()?",":"")<<endl;
+    }
+    out<<"    ]}"<<(i+1<branchOrder.size()?",":"")<<endl;
+  }
+  out<<"  ]"<<endl;
+  out<<"}"<<endl;
+
+  ofstream profileFile(fileName.c_str());
+  if (!profileFile)
+  {
+    cout<<"WARNING: could not write profile to "<<fileName<<endl;
+    return false;
+  }
+  profileFile<<out.str();
+  return true;
+}
+
+/**
+ *  Write everything we have timed in the Chrome trace event format, which can be
+ *  loaded into chrome://tracing or https://ui.perfetto.dev. Each stage is a complete
+ *  ("X") event on the thread that ran it
+ */
+bool WriteChromeTrace(string fileName)
+{
+  ostringstream out;
+  out<<fixed<<setprecision(3);
+  int pid = getpid();
+  out<<"{\"displayTimeUnit\": \"ms\", \"traceEvents\": ["<<endl;
+  out<<"  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": "<<pid<<", \"tid\": 0, \"args\": {\"name\": \"ValidationParser\"}}";
+  for (int i=0;i<profileRecords.size();i++)
+  {
+    const ProfileRecord &record = profileRecords.at(i);
+    out<<","<<endl;
+    out<<"  {\"name\": \""<<JSONEscape(record.stage)<<"\", \"cat\": \""<<JSONEscape(record.category)<<"\", \"ph\": \"X\"";
+    out<<", \"ts\": "<<record.startSeconds * 1e6<<", \"dur\": "<<record.wallSeconds * 1e6;
+    out<<", \"pid\": "<<pid<<", \"tid\": "<<record.threadId;
+    out<<", \"args\": {\"branch\": \""<<JSONEscape(record.branch)<<"\", \"bytes_read\": "<<record.bytesRead;
+    if (!record.traceOnly) out<<", \"cpu_ms\": "<<record.cpuSeconds * 1e3<<", \"rss_end_kb\": "<<record.rssEndkB;
+    if (record.detail.length()>0) out<<", \"detail\": \""<<JSONEscape(record.detail)<<"\"";
+    out<<"}}";
+  }
+  out<<endl<<"]}"<<endl;
+
+  ofstream traceFile(fileName.c_str());
+  if (!traceFile)
+  {
+    cout<<"WARNING: could not write trace to "<<fileName<<endl;
+    return false;
+  }
+  traceFile<<out.str();
+  cout<<"Wrote trace of the run to "<<fileName<<endl;
+  return true;
+}
+
+// Escape quotes, backslashes and control characters for a JSON string
+string JSONEscape(string input)
+{
+  string output;
+  for (int i=0;i<input.length();i++)
+  {
+    char c = input[i];
+    if (c=='"' || c=='\\')
+    {
+      output += '\\';
+      output += c;
+    }
+    else if (c=='\n') output += "\\n";
+    else if (c=='\t') output += "\\t";
+    else if ((unsigned char)c < 0x20)
+    {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      output += escaped;
+    }
+    else output += c;
+  }
+  return output;
+}
@@ -0,0 +1,70 @@
+#ifndef VALIDATION_PROFILER_H
+#define VALIDATION_PROFILER_H
+
+// Standard Library
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <ctime>
+#include <mutex>
+#include <atomic>
+#include <unistd.h>
+
+// ROOT
+#include "TFile.h"
+#include "TSystem.h"
+
+using namespace std;
+
+// One timed stage: wall and CPU time, bytes read from ROOT files and resident memory
+// Times are inclusive, so a stage's time includes any stages nested inside it
+struct ProfileRecord
+{
+  string stage;
+  string category; // io, decode, fill, fit, render, compare or total
+  string branch; // Empty if the stage isn't for a particular branch
+  double startSeconds; // Since the profiler started
+  double wallSeconds;
+  double cpuSeconds;
+  Long64_t bytesRead;
+  long rssStartkB;
+  long rssEndkB;
+  int depth; // How deeply nested this stage is
+  int threadId; // Small number for the thread that ran it, 0 for the main thread
+  bool traceOnly; // Fine-grained spans (basket reads, loop chunks) that only go in the trace, not the profile
+  string detail; // Anything else worth showing in the trace, e.g. the entry range of a chunk
+};
+
+// Times a stage from construction until it goes out of scope
+class ProfileScope
+{
+public:
+  ProfileScope(string stage, string category);
+  ~ProfileScope();
+private:
+  ProfileRecord fRecord;
+  chrono::steady_clock::time_point fStart;
+  clock_t fCpuStart;
+  Long64_t fBytesStart;
+};
+
+void AddProfileTime(string stage, string category, double wallSeconds, Long64_t bytesRead);
+void StartProfile();
+void EnableTrace();
+bool IsTracing();
+double ProfileSeconds();
+void AddTraceSpan(string name, string category, double startSeconds, double wallSeconds, Long64_t bytesRead, string detail="");
+bool WriteChromeTrace(string fileName);
+void SetProfileBranch(string branchName);
+long CurrentRSSkB();
+long PeakRSSkB();
+const vector<ProfileRecord> &GetProfileRecords();
+bool WriteProfileJSON(string fileName, string sampleName, string refName);
+string JSONEscape(string input);
+
+#endif
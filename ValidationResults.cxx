@@ -0,0 +1,250 @@
+#include "ValidationResults.h"
+#include "ValidationProfiler.h" // for JSONEscape
+
+// One entry for each branch compared to the reference, in the order they were compared
+vector<BranchResult> branchResults;
+
+// Start recording the comparison for a branch; later results go to this one
+BranchResult &StartBranchResult(string branchName, string type, string reference)
+{
+  BranchResult result;
+  result.branch = branchName;
+  result.reference = reference;
+  result.type = type;
+  branchResults.push_back(result);
+  return branchResults.back();
+}
+
+// The branch we are comparing now
+BranchResult &CurrentBranchResult()
+{
+  if (branchResults.empty()) StartBranchResult("unknown","unknown"); // Shouldn't happen, but don't crash if it does
+  return branchResults.back();
+}
+
+bool HasBranchResults()
+{
+  return !branchResults.empty();
+}
+
+void AddFlaggedCell(string detector, string location, double pull)
+{
+  FlaggedCell cell;
+  cell.detector = detector;
+  cell.location = location;
+  cell.pull = pull;
+  CurrentBranchResult().flaggedCells.push_back(cell);
+}
+
+const vector<BranchResult> &GetBranchResults()
+{
+  return branchResults;
+}
+
+// Forget the results, before validating another sample
+void ClearBranchResults()
+{
+  branchResults.clear();
+}
+
+// Add a result we already have, e.g. one from an earlier run of an unchanged branch
+void AddBranchResult(const BranchResult &result)
+{
+  branchResults.push_back(result);
+}
+
+/**
+ *  A branch result as tab-separated lines, which ReadBranchResultRecord and ReadFlaggedCellRecord
+ *  read back exactly: a "result" line, then a "cell" line for each flagged cell
+ */
+string BranchResultRecord(const BranchResult &result)
+{
+  ostringstream out;
+  out<<setprecision(17);
+  out<<"result\t"<<result.branch<<"\t"<<result.reference<<"\t"<<result.type<<"\t"<<result.sampleEntries<<"\t"<<result.referenceEntries;
+  out<<"\t"<<result.ks<<"\t"<<result.chisq<<"\t"<<result.ndf<<"\t"<<result.pValue<<"\t"<<result.pullCells;
+  out<<"\t"<<result.meanPull<<"\t"<<result.meanPullError<<"\t"<<result.rmsPull<<"\t"<<result.rmsPullError<<"\t"<<(result.identical?1:0);
+  out<<"\t"<<result.toyPValue<<"\t"<<result.toyKSPValue<<"\n";
+  for (int i=0;i<result.flaggedCells.size();i++)
+  {
+    const FlaggedCell &cell = result.flaggedCells.at(i);
+    out<<"cell\t"<<cell.detector<<"\t"<<cell.location<<"\t"<<cell.pull<<"\n";
+  }
+  return out.str();
+}
+
+bool ReadBranchResultRecord(const vector<string> &fields, BranchResult &result)
+{
+  if ((fields.size()!=16 && fields.size()!=18) || fields.at(0)!="result") return false; // Records from before --toys have 16
+  try
+  {
+    result.branch = fields.at(1);
+    result.reference = fields.at(2);
+    result.type = fields.at(3);
+    result.sampleEntries = std::stoll(fields.at(4));
+    result.referenceEntries = std::stoll(fields.at(5));
+    result.ks = std::stod(fields.at(6));
+    result.chisq = std::stod(fields.at(7));
+    result.ndf = std::stoi(fields.at(8));
+    result.pValue = std::stod(fields.at(9));
+    result.pullCells = std::stoi(fields.at(10));
+    result.meanPull = std::stod(fields.at(11));
+    result.meanPullError = std::stod(fields.at(12));
+    result.rmsPull = std::stod(fields.at(13));
+    result.rmsPullError = std::stod(fields.at(14));
+    result.identical = (fields.at(15)=="1");
+    result.toyPValue = (fields.size()>16)?std::stod(fields.at(16)):NAN;
+    result.toyKSPValue = (fields.size()>17)?std::stod(fields.at(17)):NAN;
+  }
+  catch (exception &e)
+  {
+    return false;
+  }
+  result.flaggedCells.clear();
+  return true;
+}
+
+bool ReadFlaggedCellRecord(const vector<string> &fields, FlaggedCell &cell)
+{
+  if (fields.size()!=4 || fields.at(0)!="cell") return false;
+  cell.detector = fields.at(1);
+  cell.location = fields.at(2);
+  try
+  {
+    cell.pull = std::stod(fields.at(3));
+  }
+  catch (exception &e)
+  {
+    return false;
+  }
+  return true;
+}
+
+vector<string> SplitTabs(string line)
+{
+  vector<string> fields;
+  size_t start=0;
+  size_t tab;
+  while ((tab = line.find('\t', start)) != string::npos)
+  {
+    fields.push_back(line.substr(start, tab-start));
+    start = tab+1;
+  }
+  fields.push_back(line.substr(start));
+  return fields;
+}
+
+/**
+ *  Write the results for every branch as JSON, for automated checks.
+ *  It is built in memory and written in one go
+ */
+bool WriteResultsJSON(string fileName, const RunSummary &run)
+{
+  ostringstream out;
+  out<<setprecision(8);
+  out<<"{"<<"\n";
+  out<<"  \"sample\": {\"file\": \""<<JSONEscape(run.sampleFile)<<"\", \"sha256\": \""<<JSONEscape(run.sampleHash)<<"\", \"entries\": "<<run.sampleEntries<<"},"<<"\n";
+  out<<"  \"references\": ["<<"\n";
+  for (int i=0;i<run.references.size();i++)
+  {
+    const ReferenceSummary &ref = run.references.at(i);
+    out<<"    {\"label\": \""<<JSONEscape(ref.label)<<"\", \"file\": \""<<JSONEscape(ref.file)<<"\", \"sha256\": \""<<JSONEscape(ref.hash)<<"\", \"entries\": "<<ref.entries<<"}"<<(i+1<run.references.size()?",":"")<<"\n";
+  }
+  out<<"  ],"<<"\n";
+  out<<"  \"sampled\": "<<(run.sampled?"true":"false")<<","<<"\n";
+  out<<"  \"cut\": \""<<JSONEscape(run.cut)<<"\","<<"\n";
+  out<<"  \"weight\": \""<<JSONEscape(run.weight)<<"\","<<"\n";
+  out<<"  \"memory_limit_mb\": "<<run.memoryLimitMB<<", \"peak_rss_mb\": "<<JSONNumber(run.peakRSSMB)<<","<<"\n";
+  out<<"  \"toys\": "<<run.toys<<","<<"\n";
+  out<<"  \"branches\": ["<<"\n";
+  for (int i=0;i<branchResults.size();i++)
+  {
+    const BranchResult &result = branchResults.at(i);
+    out<<"    {\"branch\": \""<<JSONEscape(result.branch)<<"\", \"reference\": \""<<JSONEscape(result.reference)<<"\", \"type\": \""<<JSONEscape(result.type)<<"\"";
+    out<<", \"sample_entries\": "<<result.sampleEntries<<", \"reference_entries\": "<<result.referenceEntries;
+    out<<", \"ks\": "<<JSONNumber(result.ks);
+    out<<", \"chisq\": "<<JSONNumber(result.chisq)<<", \"ndf\": "<<result.ndf<<", \"p_value\": "<<JSONNumber(result.pValue);
+    out<<", \"toy_p_value\": "<<JSONNumber(result.toyPValue)<<", \"toy_ks_p_value\": "<<JSONNumber(result.toyKSPValue);
+    out<<", \"pull_cells\": "<<result.pullCells;
+    out<<", \"mean_pull\": "<<JSONNumber(result.meanPull)<<", \"mean_pull_error\": "<<JSONNumber(result.meanPullError);
+    out<<", \"rms_pull\": "<<JSONNumber(result.rmsPull)<<", \"rms_pull_error\": "<<JSONNumber(result.rmsPullError);
+    out<<", \"identical\": "<<(result.identical?"true":"false");
+    out<<", \"flagged_cells\": [";
+    for (int j=0;j<result.flaggedCells.size();j++)
+    {
+      const FlaggedCell &cell = result.flaggedCells.at(j);
+      if (j>0) out<<", ";
+      out<<"{\"detector\": \""<<JSONEscape(cell.detector)<<"\", \"location\": \""<<JSONEscape(cell.location)<<"\", \"pull\": "<<JSONNumber(cell.pull)<<"}";
+    }
+    out<<"]}"<<(i+1<branchResults.size()?",":"")<<"\n";
+  }
+  out<<"  ]"<<"\n";
+  out<<"}"<<"\n";
+
+  ofstream resultsFile(fileName.c_str());
+  if (!resultsFile)
+  {
+    cout<<"WARNING: could not write results to "<<fileName<<endl;
+    return false;
+  }
+  resultsFile<<out.str();
+  return true;
+}
+
+/**
+ *  Write the results as CSV: one row per branch, with the flagged cells
+ *  as location=pull pairs separated by semicolons in the last column
+ */
+bool WriteResultsCSV(string fileName, const RunSummary &run)
+{
+  ostringstream out;
+  out<<setprecision(8);
+  out<<"branch,reference,type,sample_entries,reference_entries,ks,chisq,ndf,p_value,pull_cells,mean_pull,mean_pull_error,rms_pull,rms_pull_error,identical,toy_p_value,toy_ks_p_value,n_flagged_cells,flagged_cells"<<"\n";
+  for (int i=0;i<branchResults.size();i++)
+  {
+    const BranchResult &result = branchResults.at(i);
+    out<<CSVField(result.branch)<<","<<CSVField(result.reference)<<","<<CSVField(result.type)<<","<<result.sampleEntries<<","<<result.referenceEntries<<",";
+    out<<result.ks<<","<<result.chisq<<","<<result.ndf<<","<<result.pValue<<","<<result.pullCells<<",";
+    out<<result.meanPull<<","<<result.meanPullError<<","<<result.rmsPull<<","<<result.rmsPullError<<",";
+    out<<(result.identical?1:0)<<","<<result.toyPValue<<","<<result.toyKSPValue<<","<<result.flaggedCells.size()<<",";
+    ostringstream cells;
+    cells<<setprecision(4);
+    for (int j=0;j<result.flaggedCells.size();j++)
+    {
+      if (j>0) cells<<";";
+      cells<<result.flaggedCells.at(j).location<<"="<<result.flaggedCells.at(j).pull;
+    }
+    out<<CSVField(cells.str())<<"\n";
+  }
+
+  ofstream resultsFile(fileName.c_str());
+  if (!resultsFile)
+  {
+    cout<<"WARNING: could not write results to "<<fileName<<endl;
+    return false;
+  }
+  resultsFile<<out.str();
+  return true;
+}
+
+// JSON has no NaN or infinity, so those are null
+string JSONNumber(double value)
+{
+  if (std::isnan(value) || std::isinf(value)) return "null";
+  ostringstream out;
+  out<<setprecision(8)<<value;
+  return out.str();
+}
+
+// Quote a CSV field if it has commas, quotes or new lines in it
+string CSVField(string value)
+{
+  if (value.find_first_of(",\"\n") == string::npos) return value;
+  string output="\"";
+  for (int i=0;i<value.length();i++)
+  {
+    if (value[i]=='"') output += "\"\"";
+    else output += value[i];
+  }
+  return output+"\"";
+}
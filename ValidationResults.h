@@ -0,0 +1,89 @@
+#ifndef VALIDATION_RESULTS_H
+#define VALIDATION_RESULTS_H
+
+// Standard Library
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cmath>
+
+// ROOT
+#include "Rtypes.h"
+
+using namespace std;
+
+// A cell (tracker) or module (calorimeter) whose pull is over threshold, or that has too little data for a pull
+struct FlaggedCell
+{
+  string detector; // tracker or calorimeter
+  string location; // Human-readable, as in ValidationResults.txt
+  double pull; // NAN if there was not enough data to calculate one
+};
+
+// Everything we found when comparing one branch to the reference
+struct BranchResult
+{
+  string branch;
+  string reference; // Label of the reference it was compared with
+  string type; // histogram, tracker map, tracker average, calorimeter map or calorimeter average
+  Long64_t sampleEntries=0;
+  Long64_t referenceEntries=0;
+  double ks=NAN; // Not calculated for calorimeter maps
+  double chisq=NAN;
+  int ndf=0;
+  double pValue=NAN;
+  double toyPValue=NAN; // From --toys, for the chi-square
+  double toyKSPValue=NAN; // And for the KS distance, where there is a KS score
+  int pullCells=0; // Cells with enough data to calculate a pull
+  double meanPull=NAN;
+  double meanPullError=NAN;
+  double rmsPull=NAN;
+  double rmsPullError=NAN;
+  bool identical=false; // All pulls zero
+  vector<FlaggedCell> flaggedCells;
+};
+
+// One of the references the sample was compared with
+struct ReferenceSummary
+{
+  string label;
+  string file;
+  string hash;
+  Long64_t entries=0;
+};
+
+// Header information for the whole run
+struct RunSummary
+{
+  string sampleFile;
+  string sampleHash;
+  Long64_t sampleEntries=0;
+  vector<ReferenceSummary> references;
+  bool sampled=false; // Quick-look mode
+  string cut; // Only events passing this were used
+  string weight; // Each event was weighted by this
+  long memoryLimitMB=0; // --memory-limit, or 0
+  double peakRSSMB=0; // Highest resident memory of the run
+  int toys=0; // --toys, or 0
+};
+
+BranchResult &StartBranchResult(string branchName, string type, string reference="");
+BranchResult &CurrentBranchResult();
+bool HasBranchResults();
+void AddFlaggedCell(string detector, string location, double pull);
+const vector<BranchResult> &GetBranchResults();
+void ClearBranchResults();
+bool WriteResultsJSON(string fileName, const RunSummary &run);
+bool WriteResultsCSV(string fileName, const RunSummary &run);
+void AddBranchResult(const BranchResult &result);
+string BranchResultRecord(const BranchResult &result);
+bool ReadBranchResultRecord(const vector<string> &fields, BranchResult &result);
+bool ReadFlaggedCellRecord(const vector<string> &fields, FlaggedCell &cell);
+vector<string> SplitTabs(string line);
+string JSONNumber(double value);
+string CSVField(string value);
+
+#endif
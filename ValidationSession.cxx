@@ -0,0 +1,102 @@
+#include "ValidationSession.h"
+#include "ValidationProfiler.h"
+
+bool ValidationSession::active=false;
+
+ValidationSession::ValidationSession(const ValidationOptions &sessionOptions)
+{
+  options = sessionOptions;
+  valid = !active;
+  if (!valid)
+  {
+    cout<<"ERROR: only one ValidationSession can exist at a time"<<endl;
+    return;
+  }
+  active = true;
+  ResetValidation(false);
+  ConfigureValidation(options);
+  if (options.traceFile.length()>0) EnableTrace();
+}
+
+ValidationSession::~ValidationSession()
+{
+  if (!valid) return;
+  if (options.traceFile.length()>0) WriteChromeTrace(options.traceFile);
+  ResetValidation(false);
+  StopImplicitMT();
+  active = false;
+}
+
+// A reference file with a Validation tree. Returns false (with a warning) if it can't be used
+bool ValidationSession::AddReference(string fileName)
+{
+  if (!valid) return false;
+  return ::AddReference(fileName);
+}
+
+// A reference tree already in memory. It has to stay there until the session is finished with
+bool ValidationSession::AddReference(TTree *referenceTree, string label)
+{
+  if (!valid) return false;
+  return AddReferenceTree(referenceTree, label, "");
+}
+
+// Validate the Validation tree in a file
+bool ValidationSession::Validate(string sampleFile)
+{
+  if (!valid) return false;
+  ResetValidation(true);
+  StartProfile();
+  bool succeeded = ValidateFile(sampleFile, options.configFile, options.tempDir, options.plotDir);
+  if (GetPlotDirectory().length()>0) WriteProfileJSON(GetPlotDirectory()+"/ValidationProfile.json", sampleFile, "");
+  return succeeded;
+}
+
+/**
+ *  Validate a tree that is already in memory; it doesn't need to be in a file. The name is
+ *  used in the results, and for the output directory if one wasn't set
+ */
+bool ValidationSession::Validate(TTree *sampleTree, string sampleName)
+{
+  if (!valid) return false;
+  ResetValidation(true);
+  StartProfile();
+  bool succeeded = ValidateTree(sampleTree, sampleName, options.configFile, options.tempDir, options.plotDir);
+  if (GetPlotDirectory().length()>0) WriteProfileJSON(GetPlotDirectory()+"/ValidationProfile.json", sampleName, "");
+  return succeeded;
+}
+
+/**
+ *  Validate the events fed so far. The feed keeps its histograms, not the events, so this can
+ *  be done again as more arrive
+ */
+bool ValidationSession::Validate(ValidationFeed &feed, string sampleName)
+{
+  if (!valid) return false;
+  if (feed.GetEntries()==0)
+  {
+    cout<<"WARNING: no events have been fed for "<<sampleName<<endl;
+    return false;
+  }
+  ResetValidation(true);
+  StartProfile();
+  bool succeeded = ValidateFeed(&feed, sampleName, options.configFile, options.tempDir, options.plotDir);
+  if (GetPlotDirectory().length()>0) WriteProfileJSON(GetPlotDirectory()+"/ValidationProfile.json", sampleName, "");
+  return succeeded;
+}
+
+// The results for the last sample validated, one for each branch and reference
+const vector<BranchResult> &ValidationSession::GetResults() const
+{
+  return GetBranchResults();
+}
+
+const RunSummary &ValidationSession::GetRunSummary() const
+{
+  return ::GetRunSummary();
+}
+
+string ValidationSession::GetOutputDirectory() const
+{
+  return GetPlotDirectory();
+}
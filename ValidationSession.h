@@ -0,0 +1,88 @@
+#ifndef VALIDATION_SESSION_H
+#define VALIDATION_SESSION_H
+
+// Standard Library
+#include <string>
+#include <vector>
+
+// ROOT
+#include "TTree.h"
+
+// Structured results
+#include "ValidationResults.h"
+// Events pushed from memory
+#include "ValidationFeed.h"
+
+using namespace std;
+
+// Everything that can be set on the ValidationParser command line
+struct ValidationOptions
+{
+  string configFile="";
+  string plotDir=""; // Output directory; plots_<sample> if not given
+  string tempDir=""; // Where to write the temporary histogram file; the output directory if not given
+  // Quick-look sampling
+  Long64_t maxEntries=-1;
+  int prescale=1;
+  double sampleFraction=1.;
+  unsigned int sampleSeed=4357;
+  string cut="";
+  string weight="";
+  string referenceCache="";
+  string historyFile="";
+  int historyWindow=10;
+  bool reuseUnchanged=false;
+  int cellDistributionBins=0;
+  string timeBranch="";
+  int timeSlices=10;
+  int pipelineThreads=0;
+  string hitIndexDir=""; // Keep the decoded map hits here, for later runs to read back
+  int toys=0; // Toy samples and references for empirical p-values; 0 for none
+  long memoryLimitMB=0; // Keep resident memory flat, under this many MB; 0 for no limit
+  int threads=-1; // ROOT implicit multithreading, shared with the pipeline; -1 for off, 0 for a thread per core
+  string traceFile=""; // Chrome/Perfetto trace of the whole session
+};
+
+/**
+ *  ValidationParser as a library, so validation can run inside another program.
+ *  Set the options, add references, then validate samples: from a file, from a TTree that
+ *  is already in memory and has never been written anywhere, or from events fed to a
+ *  ValidationFeed. The plots and results
+ *  files are written to the output directory as usual, and the results can also be read
+ *  back. The references are kept for every sample validated by the session.
+ *  The parser keeps its state in globals, so only one session can exist at a time
+ */
+class ValidationSession
+{
+public:
+  ValidationSession(const ValidationOptions &options=ValidationOptions());
+  ~ValidationSession();
+  bool IsValid() const { return valid; }
+  bool AddReference(string fileName);
+  bool AddReference(TTree *referenceTree, string label);
+  bool Validate(string sampleFile);
+  bool Validate(TTree *sampleTree, string sampleName);
+  bool Validate(ValidationFeed &feed, string sampleName);
+  const vector<BranchResult> &GetResults() const;
+  const RunSummary &GetRunSummary() const;
+  string GetOutputDirectory() const;
+
+private:
+  ValidationOptions options;
+  bool valid;
+  static bool active;
+};
+
+// The parser functions a session drives (in ValidationParser.cxx)
+void ConfigureValidation(const ValidationOptions &options);
+void StopImplicitMT();
+void ResetValidation(bool keepReferences);
+bool AddReference(string refFileName);
+bool AddReferenceTree(TTree *referenceTree, string label, string fileName);
+bool ValidateFile(string rootFileName, string configFileName, string tempDirName, string plotDirName);
+bool ValidateTree(TTree *sampleTree, string sampleName, string configFileName, string tempDirName, string plotDirName);
+bool ValidateFeed(ValidationFeed *feed, string sampleName, string configFileName, string tempDirName, string plotDirName);
+const RunSummary &GetRunSummary();
+string GetPlotDirectory();
+
+#endif
@@ -0,0 +1,69 @@
+#include "ValidationTimeSlices.h"
+
+// An interval with no hits in a cell is only reported if we expected at least this many there
+double MIN_EXPECTED_SLICE_HITS=5;
+
+void TimeSlices::Setup(int intervals, int cells, double firstTime, double lastTime)
+{
+  nIntervals = intervals;
+  nCells = cells;
+  first = firstTime;
+  last = (lastTime > firstTime)?lastTime:firstTime + 1;
+  events.assign(nIntervals, 0);
+  counts.assign((size_t)nIntervals * nCells, 0);
+  countsSquared.assign((size_t)nIntervals * nCells, 0);
+}
+
+// Hits per event in each cell (x) and interval (y), to save and plot
+TH2D *TimeSlices::ToHistogram(string name, string title) const
+{
+  TH2D *hist = new TH2D(name.c_str(), title.c_str(), nCells, 0, nCells, nIntervals, first, last);
+  hist->Sumw2();
+  hist->GetXaxis()->SetTitle("Cell");
+  hist->GetYaxis()->SetTitle("Interval");
+  for (int interval=0; interval<nIntervals; interval++)
+  {
+    if (events[interval] <= 0) continue;
+    for (int cell=0; cell<nCells; cell++)
+    {
+      size_t index = (size_t)interval * nCells + cell;
+      hist->SetBinContent(cell+1, interval+1, counts[index] / events[interval]);
+      hist->SetBinError(cell+1, interval+1, TMath::Sqrt(countsSquared[index]) / events[interval]);
+    }
+  }
+  return hist;
+}
+
+/**
+ *  How consistent a cell's hits per event are over the intervals: a chi-square against a
+ *  constant rate (the cell's rate over the whole file), with the expected number of hits as
+ *  the variance, so an interval with no hits at all still counts. Intervals with no events
+ *  are left out. emptyIntervals gets the intervals with no hits where some were expected.
+ *  Returns the p-value, or NAN if the cell has no hits or there is only one interval with events
+ */
+double TimeSlices::CellStability(int cell, double &chisq, int &ndf, vector<int> &emptyIntervals) const
+{
+  chisq = 0;
+  ndf = -1; // One for the rate
+  emptyIntervals.clear();
+  double totalCounts = 0;
+  double totalEvents = 0;
+  for (int interval=0; interval<nIntervals; interval++)
+  {
+    totalCounts += counts[(size_t)interval * nCells + cell];
+    totalEvents += events[interval];
+  }
+  if (totalCounts <= 0 || totalEvents <= 0) return NAN;
+  double rate = totalCounts / totalEvents;
+  for (int interval=0; interval<nIntervals; interval++)
+  {
+    if (events[interval] <= 0) continue;
+    double expected = rate * events[interval];
+    double observed = counts[(size_t)interval * nCells + cell];
+    chisq += pow(observed - expected, 2) / expected;
+    ndf++;
+    if (observed == 0 && expected >= MIN_EXPECTED_SLICE_HITS) emptyIntervals.push_back(interval);
+  }
+  if (ndf < 1) return NAN;
+  return TMath::Prob(chisq, ndf);
+}
@@ -0,0 +1,52 @@
+#ifndef VALIDATION_TIME_SLICES_H
+#define VALIDATION_TIME_SLICES_H
+
+// Standard Library
+#include <string>
+#include <vector>
+#include <cmath>
+
+// ROOT
+#include "TH2.h"
+#include "TMath.h"
+
+using namespace std;
+
+/**
+ *  The hits in every cell of a map, split into intervals of time (or run number), so a cell
+ *  that stops working part way through a file can be seen. The counts are in one flat array,
+ *  interval by interval, indexed by a dense cell number
+ */
+struct TimeSlices
+{
+  int nIntervals=0;
+  int nCells=0;
+  double first=0; // Time range covered by the intervals
+  double last=1;
+  vector<double> events; // Summed weight of the events in each interval
+  vector<double> counts;
+  vector<double> countsSquared; // Sum of the weights squared
+
+  void Setup(int intervals, int cells, double firstTime, double lastTime);
+  int Interval(double time) const
+  {
+    if (std::isnan(time) || time < first || time > last) return -1;
+    int interval = (int)((time - first) * nIntervals / (last - first));
+    return (interval < nIntervals)?interval:nIntervals - 1; // The last time goes in the last interval
+  }
+  void AddEvent(int interval, double weight=1)
+  {
+    if (interval >= 0) events[interval] += weight;
+  }
+  void Fill(int interval, int cell, double weight=1)
+  {
+    if (interval < 0 || cell < 0 || cell >= nCells) return;
+    size_t index = (size_t)interval * nCells + cell;
+    counts[index] += weight;
+    countsSquared[index] += weight * weight;
+  }
+  TH2D *ToHistogram(string name, string title) const;
+  double CellStability(int cell, double &chisq, int &ndf, vector<int> &emptyIntervals) const;
+};
+
+#endif
@@ -0,0 +1,224 @@
+#include "ValidationToys.h"
+
+// Toys are thrown in blocks of this many, each block with its own random numbers, so the
+// results are the same however many threads there are
+const int TOYS_PER_BLOCK=64;
+
+// The weight per effective entry of a histogram as a whole, for its empty bins
+double AverageEntryWeight(TH1 *h)
+{
+  double sum=0;
+  double sumErrSq=0;
+  for (int x=1; x<=h->GetNbinsX(); x++)
+  {
+    for (int y=1; y<=h->GetNbinsY(); y++)
+    {
+      double value = h->GetBinContent(x,y);
+      double error = h->GetBinError(x,y);
+      if (std::isnan(value) || std::isnan(error)) continue;
+      sum += value;
+      sumErrSq += error*error;
+    }
+  }
+  return (sum>0 && sumErrSq>0)?sumErrSq/sum:1;
+}
+
+/**
+ *  Flatten the histograms being compared, bin by bin in the same order as ChiSquared, and
+ *  work out the expected value of each bin if sample and reference agree. Bins ChiSquared
+ *  could never use (NaN in either) are left out of the toys too
+ */
+ToyComparison MakeToyComparison(const vector<TH1*> &samples, const vector<TH1*> &refs, bool isAverage)
+{
+  ToyComparison comparison;
+  comparison.isAverage = isAverage;
+  if (samples.size()==1)
+  {
+    comparison.nx = samples.at(0)->GetNbinsX();
+    comparison.ny = samples.at(0)->GetNbinsY();
+  }
+  for (int i=0; i<samples.size(); i++)
+  {
+    TH1 *h1 = samples.at(i);
+    TH1 *h2 = refs.at(i);
+    double emptyWeight1 = AverageEntryWeight(h1);
+    double emptyWeight2 = AverageEntryWeight(h2);
+    for (int x=1; x<=h1->GetNbinsX(); x++)
+    {
+      for (int y=1; y<=h1->GetNbinsY(); y++)
+      {
+        double val1 = h1->GetBinContent(x,y);
+        double val2 = h2->GetBinContent(x,y);
+        double err1 = h1->GetBinError(x,y);
+        double err2 = h2->GetBinError(x,y);
+        double expected = NAN;
+        double scale1 = 0;
+        double scale2 = 0;
+        if (!(std::isnan(val1) || std::isnan(val2) || std::isnan(err1) || std::isnan(err2)))
+        {
+          if (isAverage)
+          {
+            // The means, weighted by their errors. A mean with no error can't be thrown
+            if (err1 > 0 && err2 > 0)
+            {
+              expected = (val1/pow(err1,2) + val2/pow(err2,2)) / (1/pow(err1,2) + 1/pow(err2,2));
+              scale1 = err1;
+              scale2 = err2;
+            }
+          }
+          else
+          {
+            // Each count is a number of effective entries times a weight. Together they are
+            // Poisson, with a mean of expected/scale1 + expected/scale2
+            scale1 = (val1 > 0 && err1 > 0)?pow(err1,2)/val1:emptyWeight1;
+            scale2 = (val2 > 0 && err2 > 0)?pow(err2,2)/val2:emptyWeight2;
+            expected = (val1/scale1 + val2/scale2) / (1/scale1 + 1/scale2);
+          }
+        }
+        comparison.expected.push_back(expected);
+        comparison.sampleScale.push_back(scale1);
+        comparison.refScale.push_back(scale2);
+      }
+    }
+  }
+  return comparison;
+}
+
+/**
+ *  The chi-square probability of two sets of bins, given their squared errors, exactly as
+ *  ChiSquared works it out for histograms: bins with NaNs or no error don't count
+ */
+double FlatChiSquaredProb(const double *v1, const double *errSq1, const double *v2, const double *errSq2, size_t nBins)
+{
+  double chisq=0;
+  int ndf=0;
+  for (size_t i=0; i<nBins; i++)
+  {
+    if (std::isnan(v1[i]) || std::isnan(v2[i]) || std::isnan(errSq1[i]) || std::isnan(errSq2[i])) continue;
+    if (errSq1[i] == 0 || errSq2[i] == 0) continue;
+    ndf++;
+    chisq += pow(v1[i] - v2[i], 2) / (errSq1[i] + errSq2[i]);
+  }
+  return TMath::Prob(chisq, ndf);
+}
+
+/**
+ *  The largest difference between the cumulative distributions of two maps, adding up the
+ *  bins along x then y, and along y then x, as TH2::KolmogorovTest does. The bins are in
+ *  order of x then y; a 1-D histogram has ny=1. NaN if either is empty
+ */
+double FlatKolmogorovDistance(const double *v1, const double *v2, int nx, int ny)
+{
+  double sum1=0;
+  double sum2=0;
+  for (int i=0; i<nx*ny; i++)
+  {
+    if (!std::isnan(v1[i])) sum1 += v1[i];
+    if (!std::isnan(v2[i])) sum2 += v2[i];
+  }
+  if (sum1 == 0 || sum2 == 0) return NAN;
+  double distance=0;
+  for (int order=0; order<2; order++)
+  {
+    double cumulative1=0;
+    double cumulative2=0;
+    int nOuter = (order==0)?nx:ny;
+    int nInner = (order==0)?ny:nx;
+    for (int outer=0; outer<nOuter; outer++)
+    {
+      for (int inner=0; inner<nInner; inner++)
+      {
+        int i = (order==0)?(outer*ny + inner):(inner*ny + outer);
+        if (!std::isnan(v1[i])) cumulative1 += v1[i];
+        if (!std::isnan(v2[i])) cumulative2 += v2[i];
+        distance = TMath::Max(distance, TMath::Abs(cumulative1/sum1 - cumulative2/sum2));
+      }
+    }
+    if (ny==1) break; // The same either way
+  }
+  return distance;
+}
+
+// The statistics the toys are compared with, for the histograms as they are
+void ObservedToyStatistics(const vector<TH1*> &samples, const vector<TH1*> &refs, bool withKS, double &chisqProb, double &ksDistance)
+{
+  vector<double> v1, errSq1, v2, errSq2;
+  for (int i=0; i<samples.size(); i++)
+  {
+    for (int x=1; x<=samples.at(i)->GetNbinsX(); x++)
+    {
+      for (int y=1; y<=samples.at(i)->GetNbinsY(); y++)
+      {
+        v1.push_back(samples.at(i)->GetBinContent(x,y));
+        errSq1.push_back(pow(samples.at(i)->GetBinError(x,y),2));
+        v2.push_back(refs.at(i)->GetBinContent(x,y));
+        errSq2.push_back(pow(refs.at(i)->GetBinError(x,y),2));
+      }
+    }
+  }
+  chisqProb = FlatChiSquaredProb(v1.data(), errSq1.data(), v2.data(), errSq2.data(), v1.size());
+  ksDistance = NAN;
+  if (withKS && samples.size()==1) ksDistance = FlatKolmogorovDistance(v1.data(), v2.data(), samples.at(0)->GetNbinsX(), samples.at(0)->GetNbinsY());
+}
+
+/**
+ *  Throw toy samples and references that agree, and work out the chi-square probability (and
+ *  KS distance, if wanted) of each. The blocks of toys are shared out between nThreads
+ *  threads as each finishes its last one, so the time goes down with the number of cores
+ */
+void RunToys(const ToyComparison &comparison, int nToys, bool withKS, unsigned int seed, int nThreads, vector<double> &chisqProbs, vector<double> &ksDistances)
+{
+  chisqProbs.assign(nToys, NAN);
+  ksDistances.assign(withKS?nToys:0, NAN);
+  int nBlocks = (nToys + TOYS_PER_BLOCK - 1) / TOYS_PER_BLOCK;
+  atomic<int> nextBlock(0);
+  auto throwToys = [&]()
+  {
+    size_t nBins = comparison.expected.size();
+    vector<double> v1(nBins), errSq1(nBins), v2(nBins), errSq2(nBins);
+    for (int block = nextBlock++; block < nBlocks; block = nextBlock++)
+    {
+      unsigned int blockSeed = seed * 1000003u + block + 1;
+      TRandom3 random(blockSeed?blockSeed:1); // 0 would seed it from the clock
+      int lastToy = TMath::Min(nToys, (block + 1) * TOYS_PER_BLOCK);
+      for (int toy = block * TOYS_PER_BLOCK; toy < lastToy; toy++)
+      {
+        for (size_t i=0; i<nBins; i++)
+        {
+          double expected = comparison.expected[i];
+          if (std::isnan(expected))
+          {
+            v1[i] = v2[i] = errSq1[i] = errSq2[i] = NAN;
+            continue;
+          }
+          double scale1 = comparison.sampleScale[i];
+          double scale2 = comparison.refScale[i];
+          if (comparison.isAverage)
+          {
+            v1[i] = random.Gaus(expected, scale1);
+            v2[i] = random.Gaus(expected, scale2);
+            errSq1[i] = scale1*scale1;
+            errSq2[i] = scale2*scale2;
+          }
+          else
+          {
+            v1[i] = (expected > 0)?scale1 * random.PoissonD(expected/scale1):0;
+            v2[i] = (expected > 0)?scale2 * random.PoissonD(expected/scale2):0;
+            errSq1[i] = scale1 * v1[i];
+            errSq2[i] = scale2 * v2[i];
+          }
+        }
+        chisqProbs[toy] = FlatChiSquaredProb(v1.data(), errSq1.data(), v2.data(), errSq2.data(), nBins);
+        if (withKS) ksDistances[toy] = FlatKolmogorovDistance(v1.data(), v2.data(), comparison.nx, comparison.ny);
+      }
+    }
+  };
+  if (nThreads <= 1)
+  {
+    throwToys();
+    return;
+  }
+  vector<thread> workers;
+  for (int i=0; i<nThreads; i++) workers.push_back(thread(throwToys));
+  for (int i=0; i<nThreads; i++) workers[i].join();
+}
@@ -0,0 +1,42 @@
+#ifndef VALIDATION_TOYS_H
+#define VALIDATION_TOYS_H
+
+// Standard Library
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cmath>
+
+// ROOT
+#include "TH1.h"
+#include "TMath.h"
+#include "TRandom3.h"
+
+using namespace std;
+
+/**
+ *  A sample and reference histogram (or a set of them, like the calorimeter walls) being
+ *  compared, flattened into arrays so toys can be thrown quickly. For maps of counts, each bin
+ *  is treated as a Poisson number of effective entries times a weight per entry, which is
+ *  what the bin's content and error say it is; for maps of averages, as a Gaussian mean with
+ *  the bin's error. Under the hypothesis that sample and reference come from the same
+ *  distribution, each bin of both has the same expected value, estimated from the two together
+ */
+struct ToyComparison
+{
+  bool isAverage=false;
+  vector<double> expected; // For each bin, in sample units; NaN to leave the bin out
+  vector<double> sampleScale; // Weight per effective entry for counts, or the error for averages
+  vector<double> refScale;
+  int nx=0; // The binning of a single histogram, for the KS distance
+  int ny=0;
+};
+
+ToyComparison MakeToyComparison(const vector<TH1*> &samples, const vector<TH1*> &refs, bool isAverage);
+double FlatChiSquaredProb(const double *v1, const double *errSq1, const double *v2, const double *errSq2, size_t nBins);
+double FlatKolmogorovDistance(const double *v1, const double *v2, int nx, int ny);
+void ObservedToyStatistics(const vector<TH1*> &samples, const vector<TH1*> &refs, bool withKS, double &chisqProb, double &ksDistance);
+void RunToys(const ToyComparison &comparison, int nToys, bool withKS, unsigned int seed, int nThreads, vector<double> &chisqProbs, vector<double> &ksDistances);
+
+#endif